@@ -22,6 +22,7 @@
 
 #include "screencapture.h"
 #include "audiocapture.h"
+#include "tools.h"
 
 CAppModule _Module;
 
@@ -192,6 +193,7 @@ public:
             "HEVC 4:4:4 Main profile",
             "HEVC 4:4:4 Main10 profile",
             "HEVC Lossless profile",
+            "FFV1 (lossless, software)",
         };
 
         r = Rect(line, aLeft, aTop, 300, line.Height(), aLeft, aTop, labelwidth);
@@ -461,7 +463,7 @@ public:
 
         if (force || lastConfig.CodecCfg.Profile != Config.CodecCfg.Profile)
         {
-            bool rcEna = Config.CodecCfg.Profile != CodecProfile::HEVC_LOSSLESS;
+            bool rcEna = Config.CodecCfg.Profile != CodecProfile::HEVC_LOSSLESS && Config.CodecCfg.Profile != CodecProfile::FFV1;
             rateControl.EnableWindow(rcEna);
             rateParam.EnableWindow(rcEna);
         }
@@ -484,6 +486,16 @@ public:
         }
 
 
+        if (force || lastConfig.CodecCfg.Profile != Config.CodecCfg.Profile || lastConfig.UseContainer != Config.UseContainer)
+        {
+            // mp4 can't hold FFV1
+            if (Config.CodecCfg.Profile == CodecProfile::FFV1 && Config.UseContainer == Container::Mp4)
+            {
+                Config.UseContainer = Container::Mov;
+                container.SetCurSel((int)Config.UseContainer);
+            }
+        }
+
         if (force || lastConfig.CodecCfg.FrameCfg != Config.CodecCfg.FrameCfg)
         {
             gopSize.EnableWindow(Config.CodecCfg.FrameCfg != FrameConfig::I);
@@ -525,6 +537,8 @@ public:
     int stat = -1;
     int lastStat = -1;
 
+    Array<CaptureStats::FrameRange> frames; // the whole file, downsampled to fit the graphs
+
     DECLARE_WND_CLASS_EX("StatsForm", 0, COLOR_MENU);
 
     BEGIN_MSG_MAP(StatsForm)
@@ -680,7 +694,7 @@ public:
 
     }
 
-    void PaintGraph(CDC& dc, const RECT& rect, const Vec3& color, const char* label, const char* unitFmt, size_t nPoints, double max, double avg, Func<double(int)> getPoint) const
+    void PaintGraph(CDC& dc, const RECT& rect, const Vec3& color, const char* label, const char* unitFmt, ReadOnlySpan<CaptureStats::FrameRange> ranges, double CaptureStats::Frame::* value, double max, double avg) const
     {
         CPen pen;
         pen.CreatePen(PS_SOLID, 1, 0xc0c0c0);
@@ -692,16 +706,23 @@ public:
         CRect grapharea = rect;
         grapharea.InflateRect(-1, -1);
 
-        // the points for the graph...
-        int np = Min(grapharea.Width() + 1, (int)nPoints);
-        int offs = (int)nPoints - np;
+        // the points for the graph, one pixel per range
+        int np = Min(grapharea.Width() + 1, (int)ranges.Len());
+        int offs = (int)ranges.Len() - np;
         double gh = (double)grapharea.Height() + 1;
+        auto y = [&](const CaptureStats::Frame& f) { return grapharea.bottom - LONG(f.*value * gh / max); };
+
         Array<POINT> points(POINT{ .x = grapharea.left, .y = grapharea.bottom });
+        Array<POINT> band;
         for (int i = 0; i < np; i++)
         {
-            points += POINT{ .x = grapharea.left + i, .y = grapharea.bottom - LONG(getPoint(i + offs) * gh / max) };
+            auto& r = ranges[i + offs];
+            points += POINT{ .x = grapharea.left + i, .y = y(r.Mean) };
+            band += POINT{ .x = grapharea.left + i, .y = y(r.Max) };
         }
         points += POINT{ .x = grapharea.left + np - 1, .y = grapharea.bottom };
+        for (int i = np; i-- > 0; )
+            band += POINT{ .x = grapharea.left + i, .y = y(ranges[i + offs].Min) };
 
         CBrush green;
         Vec3 grcol = Lerp(0.75f, color, Vec3(1));
@@ -712,6 +733,15 @@ public:
 
         dc.Polygon(&points[0], np + 2);
 
+        // min/max of the frames in each range
+        if (np > 1)
+        {
+            CBrush bandBrush;
+            bandBrush.CreateSolidBrush(CRef(Lerp(0.5f, color, Vec3(1))));
+            dc.SelectBrush(bandBrush);
+            dc.Polygon(&band[0], 2 * np);
+        }
+
         CPen darkgreen;
 
         darkgreen.CreatePen(PS_SOLID, 1, CRef(color));
@@ -791,12 +821,12 @@ public:
             CaptureStats stats = Capture->GetStats();
             stat = stats.Recording ? 1 : 0;
 
+            frames.Clear();
+            Capture->GetFrameRanges(WithDpi(area.Width()), frames);
+
             // FPS graph    
             CRect graph(area.left, area.top, area.right, area.top + 62);
-            PaintGraph(dc, WithDpi(graph), Vec3(0, 0.5, 0), "FPS", "%.2f", stats.Frames.Len(), stats.FPS, -1, [&](int i)
-                {
-                    return stats.Frames[i].FPS;
-                });
+            PaintGraph(dc, WithDpi(graph), Vec3(0, 0.5, 0), "FPS", "%.2f", frames, &CaptureStats::Frame::FPS, stats.FPS, -1);
 
             while (stats.MaxBitrate < (maxRate - 5000))
                 maxRate = maxRate - 5000;
@@ -805,10 +835,7 @@ public:
 
             // Bitrate graph
             graph.OffsetRect(0, 70);
-            PaintGraph(dc, WithDpi(graph), Vec3(0.0, 0, 0.5), "Bit rate", "%.0f kbits/s", stats.Frames.Len(), maxRate, stats.AvgBitrate, [&](int i)
-                {
-                    return stats.Frames[i].Bitrate;
-                });
+            PaintGraph(dc, WithDpi(graph), Vec3(0.0, 0, 0.5), "Bit rate", "%.0f kbits/s", frames, &CaptureStats::Frame::Bitrate, maxRate, stats.AvgBitrate);
 
             // VU meter
             CRect vumeter(area.left, graph.bottom + 10, area.right, graph.bottom + 10 + 26);
@@ -828,6 +855,28 @@ public:
             PaintText(dc, "Length", String::PrintF("%d:%02d:%02d", h, m, s), line, lw);
 
             PaintText(dc, "Bitrate", String::PrintF("avg %d, max %d kbits/s", (int)stats.AvgBitrate, (int)stats.MaxBitrate), line, lw);
+            if (stats.StartDelay > 0)
+                PaintText(dc, "Start", String::PrintF("%.0f ms to the first packet, %.0f ms setup%s",
+                    stats.StartDelay, stats.SetupTime, stats.SetupCached ? " (cached)" : ""), line, lw);
+
+            // the slowest stage next to the whole thing
+            int slowest = 0;
+            for (int i = 1; i < (int)CaptureStats::Stage::Total; i++)
+                if (stats.Latencies[i].P99 > stats.Latencies[slowest].P99)
+                    slowest = i;
+            static const char* const stages[] = { "acquire", "convert", "submit", "encode", "mux" };
+            auto& total = stats.Latencies[(int)CaptureStats::Stage::Total];
+            if (stats.MuxCapacity)
+                PaintText(dc, "Write buffer", String::PrintF("%.0f%% used, %.0f%% max, %u stalls, %u dropped",
+                    100.0 * stats.MuxQueued / stats.MuxCapacity, 100.0 * stats.MuxHighWater / stats.MuxCapacity, stats.MuxStalls, stats.MuxDropped), line, lw);
+            if (stats.DiskWritten && stats.Time > 0)
+                PaintText(dc, "Disk", String::PrintF("%.0f MB/s, %.0f%% busy, %.1f s stalled",
+                    stats.DiskWritten / (1048576.0 * stats.Time), 100.0 * stats.DiskBusy / stats.Time, stats.DiskStall), line, lw);
+            if (Config.ReplaySeconds > 0)
+                PaintText(dc, "Replay", String::PrintF("%.0f s, %.0f MB buffered, %u saved (Win+F10)",
+                    stats.ReplayLength, stats.ReplayBytes / 1048576.0, stats.ReplaysSaved), line, lw);
+
+            PaintText(dc, "Latency", String::PrintF("p99 %.1f ms, max %.1f ms (%s p99 %.1f ms)", total.P99, total.Max, stages[slowest], stats.Latencies[slowest].P99), line, lw);
         }
 
         int d10 = WithDpi(10);
@@ -923,6 +972,10 @@ public:
         {
         case 1:
             return OnSetCapture(0, Capture ? 0 : 1, 0, bHandled);
+        case 2:
+            if (Capture)
+                Capture->SaveReplay();
+            break;
         }
         return 0;
     }
@@ -989,6 +1042,7 @@ static int Run(LPTSTR /*lpstrCmdLine*/ = NULL, int nCmdShow = SW_SHOWDEFAULT)
     wndMain.ShowWindow(nCmdShow);
 
     auto hr = RegisterHotKey(wndMain, 1, MOD_WIN | MOD_NOREPEAT, VK_F9);
+    RegisterHotKey(wndMain, 2, MOD_WIN | MOD_NOREPEAT, VK_F10);
 
     int nRet = theLoop.Run();
 
@@ -1029,6 +1083,14 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPSTR lpstr
     GfxInit();
     InitAudioCapture();
 
+    // command line tools run on the console and don't need any UI
+    int toolResult = 0;
+    if (RunTool(lpstrCmdLine, toolResult))
+    {
+        ::CoUninitialize();
+        return toolResult;
+    }
+
     // this resolves ATL window thunking problem when Microsoft Layer for Unicode (MSLU) is used
     ::DefWindowProc(NULL, 0, 0, 0L);
 
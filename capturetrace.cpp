@@ -0,0 +1,57 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include <string.h>
+
+#include "types.h"
+#include "system.h"
+#include "capturetrace.h"
+
+CaptureTraceWriter::CaptureTraceWriter(const char* filename, const CaptureTraceHeader& header)
+{
+    File = OpenFile(filename, OpenFileMode::Create);
+    File->Write(&header, sizeof(header));
+}
+
+CaptureTraceWriter::~CaptureTraceWriter()
+{
+    Flush();
+    delete File;
+}
+
+void CaptureTraceWriter::Write(const CaptureTraceRecord& rec)
+{
+    Buffer[Count++] = rec;
+    if (Count == BUFFERED)
+        Flush();
+}
+
+void CaptureTraceWriter::Flush()
+{
+    if (Count)
+        File->Write(Buffer, Count * sizeof(CaptureTraceRecord));
+    Count = 0;
+}
+
+bool ReadCaptureTrace(const char* filename, CaptureTraceHeader& header, Array<CaptureTraceRecord>& records)
+{
+    if (!FileExists(filename))
+        return false;
+
+    RCPtr<Buffer> data = LoadFile(filename);
+    if (!data.IsValid() || data->Len() < sizeof(CaptureTraceHeader))
+        return false;
+
+    memcpy(&header, data->Ptr(), sizeof(header));
+    if (header.Magic != CaptureTraceHeader::MAGIC || header.Version != CaptureTraceHeader::VERSION || !header.TicksPerSecond)
+        return false;
+
+    // a trace that was cut off (eg. by a crash) is fine, just ignore the last partial record
+    size_t count = (data->Len() - sizeof(header)) / sizeof(CaptureTraceRecord);
+    records.Clear();
+    records.SetSize(count);
+    memcpy(records.Ptr(), data->Ptr() + sizeof(header), count * sizeof(CaptureTraceRecord));
+    return true;
+}
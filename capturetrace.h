@@ -0,0 +1,68 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#pragma once
+
+#include "types.h"
+#include "system.h"
+
+// Binary per frame trace of what the capture loop saw and decided, so
+// frame pacing can be analyzed and replayed offline.
+// File layout: CaptureTraceHeader, followed by CaptureTraceRecords until EOF
+
+struct CaptureTraceHeader
+{
+    static constexpr uint MAGIC = 0x43525443; // 'CTRC'
+    static constexpr uint VERSION = 1;
+
+    uint Magic = MAGIC;
+    uint Version = VERSION;
+    int64 TicksPerSecond = 0;   // timer frequency for all tick values
+    uint RateNum = 0;           // screen refresh rate
+    uint RateDen = 1;
+    uint SizeX = 0;
+    uint SizeY = 0;
+};
+
+struct CaptureTraceRecord
+{
+    enum Flags : uint8
+    {
+        SUBMITTED = 1,          // frame was encoded (and not skipped as an old refresh)
+        FIRST = 2,              // first frame of the file
+    };
+
+    int64 PresentTicks;         // when the frame was presented
+    uint64 FrameCount;          // refresh counter as calculated from the present times
+    uint AcquireTicks;          // from present until we got the frame
+    int16 Compensation;         // correction applied to the refresh counter for this frame
+    uint16 Duplicates;          // frames duplicated before this one because of the refresh counter...
+    uint16 IdleDuplicates;      // ... and because nothing new was presented for too long
+    uint8 Flags;
+    uint8 _pad[5];
+};
+
+static_assert(sizeof(CaptureTraceRecord) == 32);
+
+class CaptureTraceWriter
+{
+public:
+    CaptureTraceWriter(const char* filename, const CaptureTraceHeader& header);
+    ~CaptureTraceWriter();
+
+    void Write(const CaptureTraceRecord& rec);
+
+private:
+    static constexpr uint BUFFERED = 1024;
+
+    Stream* File = nullptr;
+    CaptureTraceRecord Buffer[BUFFERED];
+    uint Count = 0;
+
+    void Flush();
+};
+
+// returns false if the file isn't a (compatible) capture trace
+bool ReadCaptureTrace(const char* filename, CaptureTraceHeader& header, Array<CaptureTraceRecord>& records);
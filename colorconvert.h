@@ -0,0 +1,94 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#pragma once
+
+#include "types.h"
+#include "math3d.h"
+#include "graphics.h"
+#include "encode.h"
+#include "colormath.h"
+
+// what colorconvert.hlsl needs to know, and the CPU converter as well
+struct ConvertPara
+{
+    PixelFormat InFormat;
+    uint SizeX, SizeY;      // of the output, so upscaled
+    uint Upscale;           // the input is SizeX/Upscale * SizeY/Upscale
+    IEncode::BufferFormat OutFormat;
+    bool Rec2020;           // YUV for Rec.2020 instead of Rec.709 (HDR screens)
+    bool Hdr;               // PQ encode the (linear scRGB) input in Rec.2020
+    bool FastPQ;            // with Hdr: use ST2084Approx instead of the exact curve
+    Mat44 YuvMatrix;        // RGB to output values, already scaled to the integer range
+    Mat44 ColorMatrix;      // with Hdr: input to Rec.2020, 1.0 = 10000 nits
+};
+
+// RGB to output values for a format, already scaled to the integer range
+constexpr Mat44 MakeYuvMatrix(IEncode::BufferFormat outFormat, bool rec2020)
+{
+    auto fi = GetFormatInfo(outFormat, 0, 0);
+    Mat44 m;
+    if (outFormat != IEncode::BufferFormat::BGRA8)
+        m = MakeRGB2YUV44(rec2020 ? Rec2020 : Rec709, fi.ymin, fi.ymax, fi.uvmin, fi.uvmax);
+    return m * Mat44::Scale(fi.amp);
+}
+
+// scRGB (Rec.709 primaries, 1.0 = 80 nits) to Rec.2020, 1.0 = 10000 nits
+constexpr Mat44 HdrColorMatrix = Mat44(Rec709.GetConvertTo(Rec2020) * Mat33::Scale(80.f / 10000.0f), Vec3(0));
+
+// fills in the matrices the way the capture does
+constexpr ConvertPara MakeConvertPara(PixelFormat inFormat, uint sizeX, uint sizeY, uint upscale, IEncode::BufferFormat outFormat, bool isHdr, bool fastPQ = true)
+{
+    return
+    {
+        .InFormat = inFormat,
+        .SizeX = sizeX,
+        .SizeY = sizeY,
+        .Upscale = Max(upscale, 1u),
+        .OutFormat = outFormat,
+        .Rec2020 = isHdr,
+        .Hdr = isHdr && inFormat == PixelFormat::RGBA16F,
+        .FastPQ = fastPQ,
+        .YuvMatrix = MakeYuvMatrix(outFormat, isHdr),
+        .ColorMatrix = HdrColorMatrix,
+    };
+}
+
+enum class ConvertPath { Scalar, SSE4, AVX2 };
+
+// the fastest one this CPU can do
+ConvertPath GetBestConvertPath();
+const char* GetConvertPathName(ConvertPath path);
+
+// LinToST2084() on count values in place, with ST2084Approx or the exact curve (which has no SIMD version)
+void EncodeST2084(float* values, size_t count, bool fast, ConvertPath path = GetBestConvertPath());
+
+// Does what colorconvert.hlsl does, on the CPU: takes a frame in any of the capture
+// formats and writes encoder input in the layout GetFormatInfo() describes. The
+// results are the same, except that values that don't fit get clamped instead of
+// spilling into the neighboring ones.
+// There's a function for every input format, output format, upscale and HDR with
+// the matrices compiled in, so para's matrices need to be the MakeConvertPara() ones.
+class CpuColorConvert
+{
+public:
+    CpuColorConvert(const ConvertPara& para, ConvertPath path = GetBestConvertPath());
+
+    // converts the output lines [y0, y1). For the 4:2:0 formats, y0 needs to be even.
+    // Different line ranges can be converted on different threads at the same time.
+    void Convert(const uint8* src, uint srcPitch, uint8* dest, uint y0 = 0, uint y1 = ~0u) const;
+
+    // the whole frame, in bands of lines spread over up to maxThreads threads of the pool
+    void ConvertParallel(const uint8* src, uint srcPitch, uint8* dest, uint maxThreads = ~0u) const;
+
+    const ConvertPara& GetPara() const { return Para; }
+    ConvertPath GetPath() const { return Path; }
+
+private:
+    ConvertPara Para;
+    ConvertPath Path;
+    uint BandLines;
+    void (*ConvertFunc)(const ConvertPara& para, const uint8* src, uint srcPitch, uint8* dest, uint y0, uint y1);
+};
@@ -14,9 +14,11 @@
 
 #ifndef HDR
 #define HDR 1
+#define FASTPQ 1
 #endif
 
-Texture2D<float4> TexIn;
+Texture2D<float4> TexIn : register(t0);
+StructuredBuffer<uint> Tiles : register(t1);  // with tiling.x: the 64x64 pixel tiles to convert, x | y << 16
 RWByteAddressBuffer Out;
 
 cbuffer cb_csc : register(b0)
@@ -24,6 +26,8 @@ cbuffer cb_csc : register(b0)
     float4x4 yuvmatrix;    // convert from RGB to YUV and scale to integer
     uint4 pitch_height_scale;
     float4x4 colormatrix;  // convert to ST 2020 and normalize to 10000 nits
+    float4 pqcoeffs[40];   // ST2084Approx (colormath.h)
+    uint4 tiling;          // x: only convert Tiles (8 groups in x per tile, 8 in y), zw: size of the input in groups
 }
 
 groupshared float4 tile[8 * 8];
@@ -55,23 +59,138 @@ float3 lin2ST2084(float3 y)
     return saturate(pow((0.8359375f + 18.8515625f * pow(y, 0.1593017578f)) / (1.0f + 18.6875f * pow(y, 0.1593017578f)), 78.84375f));
 }
 
+// the same, as a cubic polynomial per octave of the input (from 2^-40 to 1)
+float3 lin2ST2084fast(float3 y)
+{
+    uint3 bits = asuint(clamp(y, asfloat(0x2b800000), asfloat(0x3f7fffff)));   // 2^-40 to right below 1
+    uint3 octave = (bits >> 23) - (127 - 40);
+    float3 t = asfloat((bits & 0x7fffff) | 0x3f800000) - 1;
+
+    float3 result;
+    [unroll] for (int i = 0; i < 3; i++)
+    {
+        float4 c = pqcoeffs[octave[i]];
+        result[i] = ((c.w * t[i] + c.z) * t[i] + c.y) * t[i] + c.x;
+    }
+    return result;
+}
+
+//-----------------------------------------------------------------------------------------
+
+#if UPSCALE == 1
+
+// With upscaling, the groups go over the source instead of the output: every source
+// pixel gets converted once into the tile, and then the group writes the 8*scale by
+// 8*scale output pixels that come from it, a uint at a time per thread. All of the
+// lines that come from the same source line are the same lookups into the tile.
+
+// output pixels per uint
+#if OUTFORMAT == 0
+#define PERUINT 1
+#elif OUTFORMAT == 1 || OUTFORMAT == 2
+#define PERUINT 4
+#else
+#define PERUINT 2
+#endif
+
+// an output pixel of the group's block, from the tile
+float4 upscaled(uint x, uint y)
+{
+    uint scale = pitch_height_scale.z;
+    return tile[8 * (y / scale) + x / scale];
+}
+
+float2 uv420upscaled(uint x, uint y)
+{
+    return (upscaled(x, y).yz + upscaled(x + 1, y).yz + upscaled(x, y + 1).yz + upscaled(x + 1, y + 1).yz) / 4.0;
+}
+
+void storeupscaled(uint2 groupid, uint thread)
+{
+    uint pitch = pitch_height_scale.x;
+    uint height = pitch_height_scale.y;
+    uint width = pitch * PERUINT / 4;
+    uint size = 8 * pitch_height_scale.z;
+    uint2 origin = groupid * size;
+    uint words = size / PERUINT;
+
+    // Y, or BGRA, and U and V for 4:4:4
+    for (uint i = thread; i < words * size; i += 64)
+    {
+        uint x = (i % words) * PERUINT;
+        uint y = i / words;
+        if (origin.x + x >= width || origin.y + y >= height)
+            continue;
+        uint addr = pitch * (origin.y + y) + (origin.x + x) * 4 / PERUINT;
+
+#if OUTFORMAT == 0
+        Out.Store(addr, getuint8(upscaled(x, y).zyxw));
+#elif PERUINT == 4
+        float4 p0 = upscaled(x, y), p1 = upscaled(x + 1, y), p2 = upscaled(x + 2, y), p3 = upscaled(x + 3, y);
+        Out.Store(addr, getuint8(float4(p0.x, p1.x, p2.x, p3.x)));
+#if OUTFORMAT == 2
+        Out.Store(addr + pitch * height, getuint8(float4(p0.y, p1.y, p2.y, p3.y)));
+        Out.Store(addr + 2 * pitch * height, getuint8(float4(p0.z, p1.z, p2.z, p3.z)));
+#endif
+#else
+        float4 p0 = upscaled(x, y), p1 = upscaled(x + 1, y);
+        Out.Store(addr, getuint16(float2(p0.x, p1.x)));
+#if OUTFORMAT == 4
+        Out.Store(addr + pitch * height, getuint16(float2(p0.y, p1.y)));
+        Out.Store(addr + 2 * pitch * height, getuint16(float2(p0.z, p1.z)));
+#endif
+#endif
+    }
+
+#if OUTFORMAT == 1 || OUTFORMAT == 3
+    // U/V for 2x2 output pixels each, the same number of bytes per line as Y
+    for (uint j = thread; j < words * size / 2; j += 64)
+    {
+        uint x = (j % words) * PERUINT;
+        uint y = 2 * (j / words);
+        if (origin.x + x >= width || (origin.y + y) / 2 >= height / 2)
+            continue;
+        uint addr = pitch * (height + (origin.y + y) / 2) + (origin.x + x) * 4 / PERUINT;
+
+#if OUTFORMAT == 1
+        Out.Store(addr, getuint8(float4(uv420upscaled(x, y), uv420upscaled(x + 2, y))));
+#else
+        Out.Store(addr, getuint16(uv420upscaled(x, y)));
+#endif
+    }
+#endif
+}
+
+#endif
+
 //-----------------------------------------------------------------------------------------
 
 // color space conversion
 [numthreads(8, 8, 1)]
-void csc(uint3 dispid : SV_DispatchThreadID, uint3 threadid : SV_GroupThreadID)
+void csc(uint3 threadid : SV_GroupThreadID, uint3 groupid : SV_GroupID)
 {
-    // convert 8x8 pixels to output color space and store in tile
-#if UPSCALE == 1
-    float4 pixel = TexIn.Load(int3(dispid.x / pitch_height_scale.z, dispid.y / pitch_height_scale.z, 0));
-#else
+    // Only the tiles of the screen that changed. Groups that are off the edge do
+    // the last one again instead, which writes the same values to the same places.
+    uint2 group = groupid.xy;
+    if (tiling.x)
+    {
+        uint t = Tiles[groupid.x / 8];
+        group = min(8 * uint2(t & 0xffff, t >> 16) + uint2(groupid.x % 8, groupid.y), tiling.zw - 1);
+    }
+    uint2 dispid = 8 * group + threadid.xy;
+
+    // convert 8x8 pixels to output color space and store in tile.
+    // With UPSCALE, dispid is in the source.
     float4 pixel = TexIn.Load(int3(dispid.x, dispid.y, 0));
-#endif
     pixel.w = 1;
     
 #if HDR == 1
     // convert from source color space to ST-2020, and apply the ST-2048 transfer curve
+#if FASTPQ == 1
+    pixel.xyz = lin2ST2084fast(mul(pixel, colormatrix).xyz);
+#else
     pixel.xyz = lin2ST2084(mul(pixel, colormatrix).xyz);
+#endif
 #endif
 
     uint tileaddr = 8 * threadid.y + threadid.x;
@@ -79,7 +198,11 @@ void csc(uint3 dispid : SV_DispatchThreadID, uint3 threadid : SV_GroupThreadID)
 
     GroupMemoryBarrierWithGroupSync();
     
-#if OUTFORMAT == 0     // 8bpp BGRA
+#if UPSCALE == 1
+
+    storeupscaled(group, tileaddr);
+
+#elif OUTFORMAT == 0     // 8bpp BGRA
     
     uint addr = pitch_height_scale.x * dispid.y + 4 * dispid.x;
     Out.Store(addr, getuint8(tile[tileaddr].zyxw));
@@ -164,3 +287,54 @@ void csc(uint3 dispid : SV_DispatchThreadID, uint3 threadid : SV_GroupThreadID)
 
 }
 
+
+//-----------------------------------------------------------------------------------------
+
+// content hash of the 64x64 pixel tiles in Tiles (one group each, see dirtytiles.cpp),
+// into 8 bytes per tile in Out: every thread hashes an 8x8 block with the four
+// channels as the lanes of xxHash32, then the first one combines the blocks.
+groupshared uint2 blockhash[8 * 8];
+
+uint hashround(uint acc, uint value)
+{
+    acc += value * 0x85ebca77u;
+    return ((acc << 13) | (acc >> 19)) * 0x9e3779b1u;
+}
+
+uint avalanche(uint h)
+{
+    h = (h ^ (h >> 15)) * 0x85ebca77u;
+    h = (h ^ (h >> 13)) * 0xc2b2ae3du;
+    return h ^ (h >> 16);
+}
+
+[numthreads(8, 8, 1)]
+void tilehash(uint3 threadid : SV_GroupThreadID, uint3 groupid : SV_GroupID)
+{
+    uint t = Tiles[groupid.x];
+    uint2 origin = 64 * uint2(t & 0xffff, t >> 16) + 8 * threadid.xy;
+
+    // off the edge, Load() gives 0 every time
+    uint4 acc = uint4(0x9e3779b1u + 0x85ebca77u, 0x85ebca77u, 0, 0x61c88647u);   // the last one is -0x9e3779b1
+    for (uint y = 0; y < 8; y++)
+        for (uint x = 0; x < 8; x++)
+        {
+            uint4 value = asuint(TexIn.Load(int3(origin.x + x, origin.y + y, 0)));
+            [unroll] for (int i = 0; i < 4; i++)
+                acc[i] = hashround(acc[i], value[i]);
+        }
+
+    uint lo = ((acc.x << 1) | (acc.x >> 31)) + ((acc.y << 7) | (acc.y >> 25)) + ((acc.z << 12) | (acc.z >> 20)) + ((acc.w << 18) | (acc.w >> 14));
+    uint hi = ((acc.x * 0xc2b2ae3du + acc.y) * 0xc2b2ae3du + acc.z) * 0xc2b2ae3du + acc.w;
+    blockhash[8 * threadid.y + threadid.x] = uint2(lo, hi);
+
+    GroupMemoryBarrierWithGroupSync();
+
+    if (!threadid.x && !threadid.y)
+    {
+        uint2 h = uint2(0x27d4eb2fu, 0x165667b1u);
+        for (uint i = 0; i < 64; i++)
+            h = uint2(hashround(h.x, blockhash[i].x), hashround(h.y, blockhash[i].y));
+        Out.Store2(8 * groupid.x, uint2(avalanche(h.x), avalanche(h.y)));
+    }
+}
@@ -0,0 +1,773 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include <math.h>
+#include <string.h>
+#include <intrin.h>
+
+#include "types.h"
+#include "system.h"
+#include "colormath.h"
+#include "colorconvert.h"
+
+ConvertPath GetBestConvertPath()
+{
+    int info[4];
+    __cpuid(info, 1);
+    bool sse41 = info[2] & (1 << 19);
+    bool fma = info[2] & (1 << 12);
+    bool avx = (info[2] & (1 << 28)) && (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6; // and the OS saves the registers
+    bool f16c = info[2] & (1 << 29);
+    __cpuidex(info, 7, 0);
+    bool avx2 = info[1] & (1 << 5);
+
+    if (avx && avx2 && fma && f16c)
+        return ConvertPath::AVX2;
+    return sse41 ? ConvertPath::SSE4 : ConvertPath::Scalar;
+}
+
+const char* GetConvertPathName(ConvertPath path)
+{
+    static const char* const names[] = { "scalar", "sse4", "avx2" };
+    return names[(int)path];
+}
+
+//---------------------------------------------------------------------------
+// single values
+//---------------------------------------------------------------------------
+
+static float HalfToFloat(uint16 h)
+{
+    union { uint u; float f; } v;
+    uint sign = (h & 0x8000u) << 16;
+    uint exp = (h >> 10) & 0x1f;
+    uint mant = h & 0x3ff;
+    if (exp == 31)
+        v.u = sign | 0x7f800000 | (mant << 13);
+    else if (exp)
+        v.u = sign | ((exp + 112) << 23) | (mant << 13);
+    else
+    {
+        v.f = mant * (1.0f / (1 << 24));
+        v.u |= sign;
+    }
+    return v.f;
+}
+
+// what the GPU does when reading from an sRGB texture
+struct SRGBTable
+{
+    float Values[256];
+
+    SRGBTable()
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            float c = i / 255.0f;
+            Values[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+        }
+    }
+};
+
+static const SRGBTable& GetSRGBTable()
+{
+    static SRGBTable table;
+    return table;
+}
+
+//---------------------------------------------------------------------------
+// the same few operations for plain floats, SSE4 and AVX2, so the
+// kernels below only need to be written once
+//---------------------------------------------------------------------------
+
+struct Scalar
+{
+    static constexpr uint N = 1;
+    static constexpr bool HALF = false;
+    using F = float;
+
+    static F Load(const float* p) { return *p; }
+    static void Store(float* p, F v) { *p = v; }
+    static F Set(float v) { return v; }
+    static F Add(F a, F b) { return a + b; }
+    static F Mul(F a, F b) { return a * b; }
+    static F MulAdd(F a, F b, F c) { return a * b + c; }
+
+    // p[0]+p[1], p[2]+p[3], ...
+    static F PairSum(const float* p) { return p[0] + p[1]; }
+
+    // a0 b0 a1 b1 ... into lo (first N values) and hi (the next N)
+    static void Interleave(F a, F b, F& lo, F& hi) { lo = a; hi = b; }
+
+    // rounded and clamped to the type's range
+    static void StoreOut(uint8* p, F v) { *p = (uint8)lrintf(Clamp(v, 0.0f, 255.0f)); }
+    static void StoreOut(uint16* p, F v) { *p = (uint16)lrintf(Clamp(v, 0.0f, 65535.0f)); }
+
+    // 4 values to 4 bytes of a uint, a in the lowest
+    static void StoreOut4(uint* p, F a, F b, F c, F d)
+    {
+        *p = (uint)lrintf(Clamp(a, 0.0f, 255.0f)) | ((uint)lrintf(Clamp(b, 0.0f, 255.0f)) << 8)
+            | ((uint)lrintf(Clamp(c, 0.0f, 255.0f)) << 16) | ((uint)lrintf(Clamp(d, 0.0f, 255.0f)) << 24);
+    }
+
+    // three bit fields of 32 bit pixels
+    static void LoadPacked(const uint8* px, int s0, int s1, int s2, uint mask, F scale, F& a, F& b, F& c)
+    {
+        uint v;
+        memcpy(&v, px, 4);
+        a = ((v >> s0) & mask) * scale;
+        b = ((v >> s1) & mask) * scale;
+        c = ((v >> s2) & mask) * scale;
+    }
+
+    static void LoadHalf(const uint8* px, F& r, F& g, F& b) {}
+
+    static F PQ(F y, const ST2084Approx& pq) { return pq(y); }
+};
+
+struct SSE4
+{
+    static constexpr uint N = 4;
+    static constexpr bool HALF = false;
+    using F = __m128;
+
+    static F Load(const float* p) { return _mm_loadu_ps(p); }
+    static void Store(float* p, F v) { _mm_storeu_ps(p, v); }
+    static F Set(float v) { return _mm_set1_ps(v); }
+    static F Add(F a, F b) { return _mm_add_ps(a, b); }
+    static F Mul(F a, F b) { return _mm_mul_ps(a, b); }
+    static F MulAdd(F a, F b, F c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+
+    static F PairSum(const float* p) { return _mm_hadd_ps(_mm_loadu_ps(p), _mm_loadu_ps(p + 4)); }
+
+    static void Interleave(F a, F b, F& lo, F& hi)
+    {
+        lo = _mm_unpacklo_ps(a, b);
+        hi = _mm_unpackhi_ps(a, b);
+    }
+
+    static __m128i ToInt(F v, int max) { return _mm_max_epi32(_mm_min_epi32(_mm_cvtps_epi32(v), _mm_set1_epi32(max)), _mm_setzero_si128()); }
+
+    static void StoreOut(uint8* p, F v)
+    {
+        __m128i i = _mm_packus_epi32(ToInt(v, 255), _mm_setzero_si128());
+        *(int*)p = _mm_cvtsi128_si32(_mm_packus_epi16(i, i));
+    }
+
+    static void StoreOut(uint16* p, F v) { _mm_storel_epi64((__m128i*)p, _mm_packus_epi32(_mm_cvtps_epi32(v), _mm_setzero_si128())); }
+
+    static void StoreOut4(uint* p, F a, F b, F c, F d)
+    {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(ToInt(a, 255), _mm_slli_epi32(ToInt(b, 255), 8)),
+            _mm_or_si128(_mm_slli_epi32(ToInt(c, 255), 16), _mm_slli_epi32(ToInt(d, 255), 24)));
+        _mm_storeu_si128((__m128i*)p, v);
+    }
+
+    static void LoadPacked(const uint8* px, int s0, int s1, int s2, uint mask, F scale, F& a, F& b, F& c)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)px);
+        __m128i m = _mm_set1_epi32((int)mask);
+        a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srl_epi32(v, _mm_cvtsi32_si128(s0)), m)), scale);
+        b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srl_epi32(v, _mm_cvtsi32_si128(s1)), m)), scale);
+        c = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srl_epi32(v, _mm_cvtsi32_si128(s2)), m)), scale);
+    }
+
+    static void LoadHalf(const uint8* px, F& r, F& g, F& b) {}
+
+    // ST2084Approx: the octave from the exponent, t from the mantissa
+    static F PQ(F y, const ST2084Approx& pq)
+    {
+        __m128i bits = _mm_castps_si128(_mm_min_ps(_mm_max_ps(y, _mm_set1_ps(ST2084Approx::MIN)), _mm_set1_ps(ST2084Approx::MAX)));
+        F t = _mm_sub_ps(_mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7fffff)), _mm_set1_epi32(0x3f800000))), _mm_set1_ps(1));
+        __m128i octave = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127 - ST2084Approx::OCTAVES));
+
+        // no gather, but the four coefficient sets transposed are the same
+        const float* c = &pq.Coeffs[0].x;
+        F c0 = _mm_loadu_ps(c + 4 * _mm_extract_epi32(octave, 0));
+        F c1 = _mm_loadu_ps(c + 4 * _mm_extract_epi32(octave, 1));
+        F c2 = _mm_loadu_ps(c + 4 * _mm_extract_epi32(octave, 2));
+        F c3 = _mm_loadu_ps(c + 4 * _mm_extract_epi32(octave, 3));
+        _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+        return MulAdd(MulAdd(MulAdd(c3, t, c2), t, c1), t, c0);
+    }
+};
+
+struct AVX2
+{
+    static constexpr uint N = 8;
+    static constexpr bool HALF = true;
+    using F = __m256;
+
+    static F Load(const float* p) { return _mm256_loadu_ps(p); }
+    static void Store(float* p, F v) { _mm256_storeu_ps(p, v); }
+    static F Set(float v) { return _mm256_set1_ps(v); }
+    static F Add(F a, F b) { return _mm256_add_ps(a, b); }
+    static F Mul(F a, F b) { return _mm256_mul_ps(a, b); }
+    static F MulAdd(F a, F b, F c) { return _mm256_fmadd_ps(a, b, c); }
+
+    static F PairSum(const float* p)
+    {
+        // hadd works within the 128 bit halves, so put the 64 bit pieces back in order
+        __m256 h = _mm256_hadd_ps(_mm256_loadu_ps(p), _mm256_loadu_ps(p + 8));
+        return _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(h), 0xd8));
+    }
+
+    static void Interleave(F a, F b, F& lo, F& hi)
+    {
+        __m256 l = _mm256_unpacklo_ps(a, b);
+        __m256 h = _mm256_unpackhi_ps(a, b);
+        lo = _mm256_permute2f128_ps(l, h, 0x20);
+        hi = _mm256_permute2f128_ps(l, h, 0x31);
+    }
+
+    static __m256i ToInt(F v, int max) { return _mm256_max_epi32(_mm256_min_epi32(_mm256_cvtps_epi32(v), _mm256_set1_epi32(max)), _mm256_setzero_si256()); }
+
+    // the 8 values of a 256 bit pack result, which is per 128 bit half
+    static __m128i Pack16(__m256i v)
+    {
+        return _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08));
+    }
+
+    static void StoreOut(uint8* p, F v)
+    {
+        __m128i i = Pack16(ToInt(v, 255));
+        _mm_storel_epi64((__m128i*)p, _mm_packus_epi16(i, i));
+    }
+
+    static void StoreOut(uint16* p, F v) { _mm_storeu_si128((__m128i*)p, Pack16(_mm256_cvtps_epi32(v))); }
+
+    static void StoreOut4(uint* p, F a, F b, F c, F d)
+    {
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(ToInt(a, 255), _mm256_slli_epi32(ToInt(b, 255), 8)),
+            _mm256_or_si256(_mm256_slli_epi32(ToInt(c, 255), 16), _mm256_slli_epi32(ToInt(d, 255), 24)));
+        _mm256_storeu_si256((__m256i*)p, v);
+    }
+
+    static void LoadPacked(const uint8* px, int s0, int s1, int s2, uint mask, F scale, F& a, F& b, F& c)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)px);
+        __m256i m = _mm256_set1_epi32((int)mask);
+        a = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(v, _mm_cvtsi32_si128(s0)), m)), scale);
+        b = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(v, _mm_cvtsi32_si128(s1)), m)), scale);
+        c = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(v, _mm_cvtsi32_si128(s2)), m)), scale);
+    }
+
+    // 8 RGBA16F pixels
+    static void LoadHalf(const uint8* px, F& r, F& g, F& b)
+    {
+        __m256 p01 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)px));
+        __m256 p23 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(px + 16)));
+        __m256 p45 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(px + 32)));
+        __m256 p67 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(px + 48)));
+
+        // pixels 0-3 in the low halves, 4-7 in the high ones, then transpose 4x4
+        __m256 t0 = _mm256_permute2f128_ps(p01, p45, 0x20);
+        __m256 t1 = _mm256_permute2f128_ps(p01, p45, 0x31);
+        __m256 t2 = _mm256_permute2f128_ps(p23, p67, 0x20);
+        __m256 t3 = _mm256_permute2f128_ps(p23, p67, 0x31);
+        __m256 u0 = _mm256_unpacklo_ps(t0, t1);
+        __m256 u1 = _mm256_unpackhi_ps(t0, t1);
+        __m256 u2 = _mm256_unpacklo_ps(t2, t3);
+        __m256 u3 = _mm256_unpackhi_ps(t2, t3);
+        r = _mm256_shuffle_ps(u0, u2, 0x44);
+        g = _mm256_shuffle_ps(u0, u2, 0xee);
+        b = _mm256_shuffle_ps(u1, u3, 0x44);
+    }
+
+    static F PQ(F y, const ST2084Approx& pq)
+    {
+        __m256i bits = _mm256_castps_si256(_mm256_min_ps(_mm256_max_ps(y, _mm256_set1_ps(ST2084Approx::MIN)), _mm256_set1_ps(ST2084Approx::MAX)));
+        F t = _mm256_sub_ps(_mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x7fffff)), _mm256_set1_epi32(0x3f800000))), _mm256_set1_ps(1));
+        __m256i index = _mm256_slli_epi32(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127 - ST2084Approx::OCTAVES)), 2);
+
+        const float* c = &pq.Coeffs[0].x;
+        F r = _mm256_i32gather_ps(c + 3, index, 4);
+        r = _mm256_fmadd_ps(r, t, _mm256_i32gather_ps(c + 2, index, 4));
+        r = _mm256_fmadd_ps(r, t, _mm256_i32gather_ps(c + 1, index, 4));
+        return _mm256_fmadd_ps(r, t, _mm256_i32gather_ps(c, index, 4));
+    }
+};
+
+//---------------------------------------------------------------------------
+// kernels. Each one does as much as it can with S and leaves the rest of the
+// line to the scalar version.
+//---------------------------------------------------------------------------
+
+template<class S> struct ConvertKernels
+{
+    using F = typename S::F;
+
+    // three bit fields of 32 bit pixels to floats, times scale
+    static void DecodePacked(const uint8* src, uint x, uint x1, int s0, int s1, int s2, uint mask, float scale, float* a, float* b, float* c)
+    {
+        F sc = S::Set(scale);
+        for (; x + S::N <= x1; x += S::N)
+        {
+            F va, vb, vc;
+            S::LoadPacked(src + 4 * x, s0, s1, s2, mask, sc, va, vb, vc);
+            S::Store(a + x, va);
+            S::Store(b + x, vb);
+            S::Store(c + x, vc);
+        }
+        if constexpr (S::N > 1)
+            ConvertKernels<Scalar>::DecodePacked(src, x, x1, s0, s1, s2, mask, scale, a, b, c);
+    }
+
+    static void DecodeHalf(const uint8* src, uint x, uint x1, float* r, float* g, float* b)
+    {
+        if constexpr (S::HALF)
+            for (; x + S::N <= x1; x += S::N)
+            {
+                F vr, vg, vb;
+                S::LoadHalf(src + 8 * x, vr, vg, vb);
+                S::Store(r + x, vr);
+                S::Store(g + x, vg);
+                S::Store(b + x, vb);
+            }
+
+        const uint16* px = (const uint16*)src;
+        for (; x < x1; x++)
+        {
+            r[x] = HalfToFloat(px[4 * x + 0]);
+            g[x] = HalfToFloat(px[4 * x + 1]);
+            b[x] = HalfToFloat(px[4 * x + 2]);
+        }
+    }
+
+    static void DecodeUnorm16(const uint8* src, uint w, float* r, float* g, float* b)
+    {
+        const uint16* px = (const uint16*)src;
+        for (uint x = 0; x < w; x++)
+        {
+            r[x] = px[4 * x + 0] / 65535.0f;
+            g[x] = px[4 * x + 1] / 65535.0f;
+            b[x] = px[4 * x + 2] / 65535.0f;
+        }
+    }
+
+    static void DecodeSRGB(const uint8* src, uint w, int ri, float* r, float* g, float* b)
+    {
+        const float* lut = GetSRGBTable().Values;
+        for (uint x = 0; x < w; x++)
+        {
+            r[x] = lut[src[4 * x + ri]];
+            g[x] = lut[src[4 * x + 1]];
+            b[x] = lut[src[4 * x + 2 - ri]];
+        }
+    }
+
+    static void EncodePQ(float* v, size_t x, size_t n, bool fast)
+    {
+        if (fast)
+        {
+            const ST2084Approx& pq = GetST2084Approx();
+            for (; x + S::N <= n; x += S::N)
+                S::Store(v + x, S::PQ(S::Load(v + x), pq));
+            if constexpr (S::N > 1)
+                ConvertKernels<Scalar>::EncodePQ(v, x, n, fast);
+        }
+        else
+            for (; x < n; x++)
+                v[x] = LinToST2084(v[x]);
+    }
+
+    // (r,g,b,1) * m, into the first OUTS of out
+    template<int OUTS> static void Transform(const Mat44& m, uint x, uint x1, const float* r, const float* g, const float* b, float* const* out)
+    {
+        const Vec4* rows = &m.i;
+        for (int c = 0; c < OUTS; c++)
+        {
+            F mr = S::Set(rows[0][c]), mg = S::Set(rows[1][c]), mb = S::Set(rows[2][c]), mo = S::Set(rows[3][c]);
+            float* o = out[c];
+            uint xx = x;
+            for (; xx + S::N <= x1; xx += S::N)
+                S::Store(o + xx, S::MulAdd(S::Load(r + xx), mr, S::MulAdd(S::Load(g + xx), mg, S::MulAdd(S::Load(b + xx), mb, mo))));
+        }
+        if constexpr (S::N > 1)
+            ConvertKernels<Scalar>::template Transform<OUTS>(m, x + (x1 - x) / S::N * S::N, x1, r, g, b, out);
+    }
+
+    // nearest neighbor upscale: every value scale times. The runs of broadcasts can go up to
+    // N-1 values too far, which the next run writes over, and past the end of the line.
+    static void Expand(float* dest, const float* src, uint w, uint scale)
+    {
+        for (uint x = 0; x < w; x++, dest += scale)
+        {
+            F v = S::Set(src[x]);
+            for (uint i = 0; i < scale; i += S::N)
+                S::Store(dest + i, v);
+        }
+    }
+
+    template<typename T> static void StorePlane(T* dest, const float* plane, uint x, uint x1)
+    {
+        for (; x + S::N <= x1; x += S::N)
+            S::StoreOut(dest + x, S::Load(plane + x));
+        if constexpr (S::N > 1)
+            ConvertKernels<Scalar>::StorePlane(dest, plane, x, x1);
+    }
+
+    // 2x2 averages of U and V, interleaved
+    template<typename T> static void StoreUV420(T* dest, const float* const* line0, const float* const* line1, uint x, uint x1)
+    {
+        F quarter = S::Set(0.25f);
+        for (; x + S::N <= x1; x += S::N)
+        {
+            F u = S::Mul(S::Add(S::PairSum(line0[1] + 2 * x), S::PairSum(line1[1] + 2 * x)), quarter);
+            F v = S::Mul(S::Add(S::PairSum(line0[2] + 2 * x), S::PairSum(line1[2] + 2 * x)), quarter);
+            F lo, hi;
+            S::Interleave(u, v, lo, hi);
+            S::StoreOut(dest + 2 * x, lo);
+            S::StoreOut(dest + 2 * x + S::N, hi);
+        }
+        if constexpr (S::N > 1)
+            ConvertKernels<Scalar>::StoreUV420(dest, line0, line1, x, x1);
+    }
+
+    static void StoreBGRA(uint* dest, const float* const* planes, uint x, uint x1)
+    {
+        for (; x + S::N <= x1; x += S::N)
+            S::StoreOut4(dest + x, S::Load(planes[2] + x), S::Load(planes[1] + x), S::Load(planes[0] + x), S::Load(planes[3] + x));
+        if constexpr (S::N > 1)
+            ConvertKernels<Scalar>::StoreBGRA(dest, planes, x, x1);
+    }
+
+    template<typename T> static void Store444(const ConvertPara& p, uint8* dest, uint pitch, uint y, const float* const* planes)
+    {
+        for (uint c = 0; c < 3; c++)
+            StorePlane((T*)(dest + (size_t)pitch * (c * p.SizeY + y)), planes[c], 0, p.SizeX);
+    }
+};
+
+//---------------------------------------------------------------------------
+// everything that's known per input format, output format, upscale and HDR
+// decided at compile time, including the matrices
+//---------------------------------------------------------------------------
+
+template<class S, PixelFormat IN, IEncode::BufferFormat OUT, bool UPSCALE, bool HDR> struct ConvertPermutation
+{
+    using K = ConvertKernels<S>;
+
+    static constexpr Mat44 YuvMatrix = MakeYuvMatrix(OUT, HDR);
+    static constexpr bool PQ = HDR && IN == PixelFormat::RGBA16F;   // only scRGB is linear
+    static constexpr int OUTS = OUT == IEncode::BufferFormat::BGRA8 ? 4 : 3;
+    static constexpr bool IS420 = OUT == IEncode::BufferFormat::NV12 || OUT == IEncode::BufferFormat::YUV420_16;
+
+    static void DecodeLine(const uint8* src, uint w, float* r, float* g, float* b)
+    {
+        if constexpr (IN == PixelFormat::BGRA8)
+            K::DecodePacked(src, 0, w, 16, 8, 0, 0xff, 1 / 255.0f, r, g, b);
+        else if constexpr (IN == PixelFormat::RGBA8)
+            K::DecodePacked(src, 0, w, 0, 8, 16, 0xff, 1 / 255.0f, r, g, b);
+        else if constexpr (IN == PixelFormat::RGB10A2)
+            K::DecodePacked(src, 0, w, 0, 10, 20, 0x3ff, 1 / 1023.0f, r, g, b);
+        else if constexpr (IN == PixelFormat::RGBA16F)
+            K::DecodeHalf(src, 0, w, r, g, b);
+        else if constexpr (IN == PixelFormat::RGBA16)
+            K::DecodeUnorm16(src, w, r, g, b);
+        else
+            K::DecodeSRGB(src, w, IN == PixelFormat::BGRA8sRGB ? 2 : 0, r, g, b);
+    }
+
+    // one output line as float planes (Y,U,V and maybe A, or R,G,B,A for BGRA8 output).
+    // narrow is for the source width planes before upscaling.
+    static void ConvertLine(const ConvertPara& p, const uint8* src, float* const* planes, float* tmp, float* const* narrow)
+    {
+        uint w = UPSCALE ? p.SizeX / p.Upscale : p.SizeX;
+
+        // the YUV planes are free until the matrix is applied, tmp only needed for HDR
+        float* r = planes[0];
+        float* g = planes[1];
+        float* b = planes[2];
+        DecodeLine(src, w, r, g, b);
+
+        if constexpr (PQ)
+        {
+            float* hdr[3] = { tmp, tmp + w, tmp + 2 * w };
+            K::template Transform<3>(HdrColorMatrix, 0, w, r, g, b, hdr);
+            K::EncodePQ(tmp, 0, 3 * w, p.FastPQ);
+            r = hdr[0];
+            g = hdr[1];
+            b = hdr[2];
+        }
+        else
+        {
+            // the matrix can't work in place
+            memcpy(tmp, r, w * sizeof(float));
+            memcpy(tmp + w, g, w * sizeof(float));
+            memcpy(tmp + 2 * w, b, w * sizeof(float));
+            r = tmp;
+            g = tmp + w;
+            b = tmp + 2 * w;
+        }
+
+        if constexpr (UPSCALE)
+        {
+            K::template Transform<OUTS>(YuvMatrix, 0, w, r, g, b, narrow);
+            for (int c = 0; c < OUTS; c++)
+                K::Expand(planes[c], narrow[c], w, p.Upscale);
+        }
+        else
+            K::template Transform<OUTS>(YuvMatrix, 0, w, r, g, b, planes);
+    }
+
+    // converted lines by source line; two, so the lines of a 4:2:0 pair can come from different ones
+    struct LineCache
+    {
+        const ConvertPara& P;
+        const uint8* Src;
+        uint SrcPitch;
+        Array<float> Mem;
+        float* Planes[2][4];
+        float* Narrow[4];
+        float* Tmp;
+        uint Cached[2] = { ~0u, ~0u };
+
+        LineCache(const ConvertPara& p, const uint8* src, uint srcPitch) : P(p), Src(src), SrcPitch(srcPitch)
+        {
+            // two lines of four planes, three lines' worth of temp space and four narrow
+            // planes (+ some so the planes don't share cache lines and Expand() can overshoot)
+            size_t stride = p.SizeX + 16;
+            Mem.SetSize(15 * stride);
+            for (int i = 0; i < 8; i++)
+                Planes[i / 4][i % 4] = Mem.Ptr() + i * stride;
+            Tmp = Mem.Ptr() + 8 * stride;
+            for (int i = 0; i < 4; i++)
+                Narrow[i] = Mem.Ptr() + (11 + i) * stride;
+        }
+
+        // converts source line sy if it isn't there yet, without throwing out keep
+        float* const* Get(uint sy, uint keep)
+        {
+            int slot = Cached[0] == sy ? 0 : Cached[1] == sy ? 1 : -1;
+            if (slot < 0)
+            {
+                slot = Cached[0] == keep ? 1 : 0;
+                ConvertLine(P, Src + (size_t)SrcPitch * sy, Planes[slot], Tmp, Narrow);
+                Cached[slot] = sy;
+            }
+            return Planes[slot];
+        }
+    };
+
+    // With upscaling, output lines that come from the same source lines as the ones
+    // before them are copies. Only the ones written by this call, so the bands
+    // on different threads stay independent.
+    template<typename T> static void Run420(const ConvertPara& p, LineCache& lines, uint8* dest, uint pitch, uint y0, uint y1)
+    {
+        uint upscale = UPSCALE ? p.Upscale : 1;
+        for (uint y = y0; y < y1; y += 2)
+        {
+            // an odd last line gets paired with itself
+            bool twoLines = y + 1 < p.SizeY;
+            uint sy0 = y / upscale;
+            uint sy1 = twoLines ? (y + 1) / upscale : sy0;
+            uint8* line = dest + (size_t)pitch * y;
+            uint8* uv = dest + (size_t)pitch * (p.SizeY + y / 2);
+
+            if (UPSCALE && y > y0 && sy0 == (y - 1) / upscale)
+                memcpy(line, line - pitch, pitch);
+            else
+                K::StorePlane((T*)line, lines.Get(sy0, sy1)[0], 0, p.SizeX);
+
+            if (UPSCALE && twoLines && sy1 == sy0)
+                memcpy(line + pitch, line, pitch);
+            else if (twoLines)
+                K::StorePlane((T*)(line + pitch), lines.Get(sy1, sy0)[0], 0, p.SizeX);
+
+            if (y / 2 < p.SizeY / 2)
+            {
+                if (UPSCALE && y > y0 && sy0 == (y - 2) / upscale && sy1 == (y - 1) / upscale)
+                    memcpy(uv, uv - pitch, pitch);
+                else
+                    K::StoreUV420((T*)uv, lines.Get(sy0, sy1), lines.Get(sy1, sy0), 0, p.SizeX / 2);
+            }
+        }
+    }
+
+    static void Run(const ConvertPara& p, const uint8* src, uint srcPitch, uint8* dest, uint y0, uint y1)
+    {
+        uint pitch = GetFormatInfo(OUT, p.SizeX, p.SizeY).pitch;
+        uint upscale = UPSCALE ? p.Upscale : 1;
+        y1 = Min(y1, p.SizeY);
+        ASSERT(!IS420 || !(y0 & 1));
+
+        LineCache lines(p, src, srcPitch);
+        if constexpr (OUT == IEncode::BufferFormat::NV12)
+            Run420<uint8>(p, lines, dest, pitch, y0, y1);
+        else if constexpr (IS420)
+            Run420<uint16>(p, lines, dest, pitch, y0, y1);
+        else
+            for (uint y = y0; y < y1; y++)
+            {
+                // see Run420()
+                if (UPSCALE && y > y0 && y / upscale == (y - 1) / upscale)
+                {
+                    for (uint c = 0; c < (OUTS == 4 ? 1u : 3u); c++)
+                    {
+                        uint8* line = dest + (size_t)pitch * (c * p.SizeY + y);
+                        memcpy(line, line - pitch, pitch);
+                    }
+                    continue;
+                }
+
+                float* const* planes = lines.Get(y / upscale, ~0u);
+                if constexpr (OUT == IEncode::BufferFormat::BGRA8)
+                    K::StoreBGRA((uint*)(dest + (size_t)pitch * y), planes, 0, p.SizeX);
+                else if constexpr (OUT == IEncode::BufferFormat::YUV444_8)
+                    K::template Store444<uint8>(p, dest, pitch, y, planes);
+                else
+                    K::template Store444<uint16>(p, dest, pitch, y, planes);
+            }
+    }
+};
+
+//---------------------------------------------------------------------------
+// all permutations for all paths, by path, input format, output format,
+// upscale and HDR
+//---------------------------------------------------------------------------
+
+using ConvertFunc = void (*)(const ConvertPara& para, const uint8* src, uint srcPitch, uint8* dest, uint y0, uint y1);
+
+static constexpr PixelFormat ConvertInFormats[] =
+{
+    PixelFormat::BGRA8, PixelFormat::RGBA8, PixelFormat::BGRA8sRGB, PixelFormat::RGBA8sRGB,
+    PixelFormat::RGB10A2, PixelFormat::RGBA16, PixelFormat::RGBA16F,
+};
+
+static constexpr int PATHS = (int)ConvertPath::AVX2 + 1;
+static constexpr int IN_FORMATS = sizeof(ConvertInFormats) / sizeof(ConvertInFormats[0]);
+static constexpr int OUT_FORMATS = (int)IEncode::BufferFormat::YUV444_16 + 1;
+
+template<ConvertPath P> struct PathOps;
+template<> struct PathOps<ConvertPath::Scalar> { using S = Scalar; };
+template<> struct PathOps<ConvertPath::SSE4> { using S = SSE4; };
+template<> struct PathOps<ConvertPath::AVX2> { using S = AVX2; };
+
+struct ConvertTable
+{
+    ConvertFunc Funcs[PATHS][IN_FORMATS][OUT_FORMATS][2][2] = {};
+
+    // one path/input/output combination per step
+    template<int I = 0> constexpr void Fill()
+    {
+        if constexpr (I < PATHS * IN_FORMATS * OUT_FORMATS)
+        {
+            constexpr int path = I / (IN_FORMATS * OUT_FORMATS);
+            constexpr int in = I / OUT_FORMATS % IN_FORMATS;
+            constexpr int out = I % OUT_FORMATS;
+            using S = typename PathOps<(ConvertPath)path>::S;
+            constexpr PixelFormat IN = ConvertInFormats[in];
+            constexpr IEncode::BufferFormat OUT = (IEncode::BufferFormat)out;
+
+            auto& f = Funcs[path][in][out];
+            f[0][0] = ConvertPermutation<S, IN, OUT, false, false>::Run;
+            f[0][1] = ConvertPermutation<S, IN, OUT, false, true>::Run;
+            f[1][0] = ConvertPermutation<S, IN, OUT, true, false>::Run;
+            f[1][1] = ConvertPermutation<S, IN, OUT, true, true>::Run;
+            Fill<I + 1>();
+        }
+    }
+
+    constexpr ConvertTable() { Fill(); }
+};
+
+static constexpr ConvertTable ConvertFuncs;
+
+//---------------------------------------------------------------------------
+// the compiled in matrices against the numbers from the standards, so
+// nothing in colormath.h can quietly go wrong
+//---------------------------------------------------------------------------
+
+static constexpr bool Near(float a, float b)
+{
+    float d = a > b ? a - b : b - a;
+    return d <= 1e-3f * Max(b < 0 ? -b : b, 1.0f);
+}
+
+// BT.709 8 bits: Y = 0.2126 R + 0.7152 G + 0.0722 B in 16..235, U and V +-112 around 128
+constexpr Mat44 Nv12Matrix = MakeYuvMatrix(IEncode::BufferFormat::NV12, false);
+static_assert(Near(Nv12Matrix.i.x, 0.2126f * 219) && Near(Nv12Matrix.j.x, 0.7152f * 219) && Near(Nv12Matrix.k.x, 0.0722f * 219) && Near(Nv12Matrix.l.x, 16));
+static_assert(Near(Nv12Matrix.k.y, 112) && Near(Nv12Matrix.i.z, 112) && Near(Nv12Matrix.l.y, 128) && Near(Nv12Matrix.l.z, 128));
+static_assert(Near(Nv12Matrix.i.y + Nv12Matrix.j.y + Nv12Matrix.k.y, 0) && Near(Nv12Matrix.i.z + Nv12Matrix.j.z + Nv12Matrix.k.z, 0));
+
+// BT.2020 10 bits in the top of 16: Y = 0.2627 R + 0.6780 G + 0.0593 B in 64..940, U and V +-448 around 512
+constexpr float Scale10 = 65535.0f / 1023;
+constexpr Mat44 P010Matrix = MakeYuvMatrix(IEncode::BufferFormat::YUV420_16, true);
+static_assert(Near(P010Matrix.i.x, 0.2627f * 876 * Scale10) && Near(P010Matrix.j.x, 0.6780f * 876 * Scale10) && Near(P010Matrix.k.x, 0.0593f * 876 * Scale10));
+static_assert(Near(P010Matrix.l.x, 64 * Scale10) && Near(P010Matrix.k.y, 448 * Scale10) && Near(P010Matrix.l.y, 512 * Scale10));
+
+// BGRA8 just scales
+constexpr Mat44 BgraMatrix = MakeYuvMatrix(IEncode::BufferFormat::BGRA8, false);
+static_assert(Near(BgraMatrix.i.x, 255) && Near(BgraMatrix.j.y, 255) && Near(BgraMatrix.k.z, 255) && Near(BgraMatrix.i.y, 0) && Near(BgraMatrix.l.x, 0));
+
+// BT.2087 Rec.709 to Rec.2020, times 80/10000 nits
+static_assert(Near(HdrColorMatrix.i.x, 0.6274f * 0.008f) && Near(HdrColorMatrix.j.x, 0.3293f * 0.008f) && Near(HdrColorMatrix.k.x, 0.0433f * 0.008f));
+static_assert(Near(HdrColorMatrix.i.y, 0.0691f * 0.008f) && Near(HdrColorMatrix.j.y, 0.9195f * 0.008f) && Near(HdrColorMatrix.k.y, 0.0114f * 0.008f));
+static_assert(Near(HdrColorMatrix.i.z, 0.0164f * 0.008f) && Near(HdrColorMatrix.j.z, 0.0880f * 0.008f) && Near(HdrColorMatrix.k.z, 0.8956f * 0.008f));
+
+// and what the capture puts into ConvertPara is what got compiled in
+static_assert(Near(MakeConvertPara(PixelFormat::RGBA16F, 0, 0, 1, IEncode::BufferFormat::YUV420_16, true).YuvMatrix.k.y, P010Matrix.k.y));
+
+static bool SameMatrix(const Mat44& a, const Mat44& b)
+{
+    for (int i = 0; i < 16; i++)
+        if (!Near((&a.i.x)[i], (&b.i.x)[i]))
+            return false;
+    return true;
+}
+
+//---------------------------------------------------------------------------
+
+void EncodeST2084(float* values, size_t count, bool fast, ConvertPath path)
+{
+    switch (path)
+    {
+    case ConvertPath::AVX2: ConvertKernels<AVX2>::EncodePQ(values, 0, count, fast); break;
+    case ConvertPath::SSE4: ConvertKernels<SSE4>::EncodePQ(values, 0, count, fast); break;
+    default: ConvertKernels<Scalar>::EncodePQ(values, 0, count, fast); break;
+    }
+}
+
+CpuColorConvert::CpuColorConvert(const ConvertPara& para, ConvertPath path) : Para(para), Path(path)
+{
+    int in = 0;
+    while (in < IN_FORMATS && ConvertInFormats[in] != Para.InFormat)
+        in++;
+    if (in == IN_FORMATS)
+        Fatal("CPU color conversion: unsupported pixel format %d\n", (int)Para.InFormat);
+    Para.Upscale = Max(Para.Upscale, 1u);
+
+    // the permutations have their own copies
+    ASSERT(SameMatrix(Para.YuvMatrix, MakeYuvMatrix(Para.OutFormat, Para.Rec2020)));
+    ASSERT(Para.Hdr == (Para.Rec2020 && Para.InFormat == PixelFormat::RGBA16F));
+    ASSERT(!Para.Hdr || SameMatrix(Para.ColorMatrix, HdrColorMatrix));
+
+    // bands that read and write about 256K each, a bit more than fits in L2 along with the line buffers
+    // on older CPUs, but few enough that handing them out doesn't cost much. Even for the 4:2:0 formats.
+    auto fi = GetFormatInfo(Para.OutFormat, Para.SizeX, Para.SizeY);
+    uint pixelBytes = Para.InFormat == PixelFormat::RGBA16 || Para.InFormat == PixelFormat::RGBA16F ? 8 : 4;
+    uint lineBytes = (uint)((uint64)fi.pitch * fi.lines / Max(Para.SizeY, 1u)) + Para.SizeX / Para.Upscale * pixelBytes;
+    BandLines = Max((256u << 10) / Max(lineBytes, 1u), 2u) & ~1u;
+
+    ConvertFunc = ConvertFuncs.Funcs[(int)path][in][(int)Para.OutFormat][Para.Upscale > 1][Para.Rec2020];
+}
+
+void CpuColorConvert::Convert(const uint8* src, uint srcPitch, uint8* dest, uint y0, uint y1) const
+{
+    ConvertFunc(Para, src, srcPitch, dest, y0, y1);
+}
+
+void CpuColorConvert::ConvertParallel(const uint8* src, uint srcPitch, uint8* dest, uint maxThreads) const
+{
+    // at least a few bands per thread, so one that gets interrupted doesn't hold up the others
+    ThreadPool& pool = GetThreadPool();
+    uint threads = Min(pool.GetThreadCount(), Max(maxThreads, 1u));
+    uint lines = Clamp(Para.SizeY / (4 * threads), 2u, BandLines) & ~1u;
+
+    pool.ParallelFor(Para.SizeY, lines, [&](uint y0, uint y1) { Convert(src, srcPitch, dest, y0, y1); }, threads);
+}
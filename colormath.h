@@ -5,6 +5,9 @@
 
 #pragma once
 
+#include <math.h>
+#include <string.h>
+
 #include "types.h"
 #include "math3d.h"
 
@@ -137,5 +140,85 @@ constexpr static const ColorSpace ACEScg =
     .white = { 0.32168f, 0.33767f }
 };
 
+// transfer functions
+// -------------------------------------------------------------------------------
+
+// SMPTE ST 2084 (PQ): linear (0..1, 1.0 = 10000 nits) to 0..1
+inline double LinToST2084(double y)
+{
+    double p = pow(Max(y, 0.0), 0.1593017578125);
+    return Min(pow((0.8359375 + 18.8515625 * p) / (1.0 + 18.6875 * p), 78.84375), 1.0);
+}
+
+inline float LinToST2084(float y)
+{
+    float p = powf(Max(y, 0.0f), 0.1593017578f);
+    return Min(powf((0.8359375f + 18.8515625f * p) / (1.0f + 18.6875f * p), 78.84375f), 1.0f);
+}
+
+// LinToST2084 without the pow()s: a cubic polynomial per octave of the input, in
+// t = the mantissa bits as 0..1. Inputs below 2^-40 get the value at 2^-40 (which
+// is 1.4e-5), anything from 1 up gets 1. The max error against the double version
+// is 6.3e-5, 1/15 of a 10 bit code value; bench-pq checks every float from 0 to 1.
+struct ST2084Approx
+{
+    static constexpr int OCTAVES = 40;
+    static constexpr float MIN = 1.0f / (1ull << OCTAVES);
+    static constexpr float MAX = 0.99999994f;   // the float right below 1
+
+    Vec4 Coeffs[OCTAVES];   // c.x + c.y*t + c.z*t^2 + c.w*t^3 for 2^(i-OCTAVES) * (1+t)
+
+    ST2084Approx()
+    {
+        // interpolate at the Chebyshev nodes, which comes close to the minimax polynomial
+        for (int i = 0; i < OCTAVES; i++)
+        {
+            double m[4][5];
+            for (int n = 0; n < 4; n++)
+            {
+                double t = 0.5 + 0.5 * cos(3.14159265358979 * (n + 0.5) / 4);
+                for (int j = 0; j < 4; j++)
+                    m[n][j] = pow(t, j);
+                m[n][4] = LinToST2084(ldexp(1 + t, i - OCTAVES));
+            }
+
+            for (int n = 0; n < 4; n++)
+                for (int k = n + 1; k < 4; k++)
+                {
+                    double f = m[k][n] / m[n][n];
+                    for (int j = n; j < 5; j++)
+                        m[k][j] -= f * m[n][j];
+                }
+
+            double c[4];
+            for (int n = 3; n >= 0; n--)
+            {
+                c[n] = m[n][4];
+                for (int j = n + 1; j < 4; j++)
+                    c[n] -= m[n][j] * c[j];
+                c[n] /= m[n][n];
+            }
+            Coeffs[i] = Vec4((float)c[0], (float)c[1], (float)c[2], (float)c[3]);
+        }
+    }
+
+    float operator()(float y) const
+    {
+        y = Clamp(y, MIN, MAX);
+        uint bits;
+        memcpy(&bits, &y, 4);
+        const Vec4& c = Coeffs[(bits >> 23) - (127 - OCTAVES)];
+        bits = (bits & 0x7fffff) | 0x3f800000;
+        float t;
+        memcpy(&t, &bits, 4);
+        t -= 1;
+        return ((c.w * t + c.z) * t + c.y) * t + c.x;
+    }
+};
 
+inline const ST2084Approx& GetST2084Approx()
+{
+    static ST2084Approx approx;
+    return approx;
+}
 
@@ -0,0 +1,176 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include <intrin.h>
+
+#include "types.h"
+#include "system.h"
+#include "dirtytiles.h"
+
+void DirtyTiles::Init(uint sizeX, uint sizeY)
+{
+    SizeX = sizeX;
+    SizeY = sizeY;
+    TilesX = (sizeX + TILE - 1) / TILE;
+    TilesY = (sizeY + TILE - 1) / TILE;
+    Dirty.SetSize(TilesX * TilesY);
+    Hashes.SetSize(TilesX * TilesY);
+    for (uint i = 0; i < Hashes.Len(); i++)
+        Hashes[i] = 0;
+    MarkAll();
+}
+
+void DirtyTiles::MarkAll()
+{
+    for (uint i = 0; i < Dirty.Len(); i++)
+        Dirty[i] = true;
+    DirtyCount = Dirty.Len();
+    Hashed = false;
+}
+
+void DirtyTiles::Mark(const DirtyRect& rect)
+{
+    uint x1 = Min(rect.x1, SizeX), y1 = Min(rect.y1, SizeY);
+    if (rect.x0 >= x1 || rect.y0 >= y1)
+        return;
+
+    for (uint ty = rect.y0 / TILE; ty <= (y1 - 1) / TILE; ty++)
+        for (uint tx = rect.x0 / TILE; tx <= (x1 - 1) / TILE; tx++)
+        {
+            bool& d = Dirty[ty * TilesX + tx];
+            DirtyCount += d ? 0 : 1;
+            d = true;
+        }
+    Hashed = false;
+}
+
+void DirtyTiles::Mark(const CaptureInfo& info)
+{
+    if (info.allDirty)
+        MarkAll();
+    else
+        for (auto& rect : info.dirty)
+            Mark(rect);
+}
+
+void DirtyTiles::GetDirty(Array<uint>& tiles) const
+{
+    for (uint ty = 0; ty < TilesY; ty++)
+        for (uint tx = 0; tx < TilesX; tx++)
+            if (Dirty[ty * TilesX + tx])
+                tiles += tx | (ty << 16);
+}
+
+void DirtyTiles::Take(Array<uint>& tiles)
+{
+    GetDirty(tiles);
+    for (uint i = 0; i < Dirty.Len(); i++)
+    {
+        // what gets converted now without having been hashed can't be compared against later
+        if (Dirty[i] && !Hashed)
+            Hashes[i] = 0;
+        Dirty[i] = false;
+    }
+    DirtyCount = 0;
+    Hashed = false;
+}
+
+uint DirtyTiles::KeepChanged(ReadOnlySpan<uint> tiles, const uint64* hashes)
+{
+    for (uint t : tiles)
+    {
+        uint i = (t >> 16) * TilesX + (t & 0xffff);
+        uint64 hash = Max(*hashes++, 1ull);
+        if (Dirty[i] && Hashes[i] == hash)
+        {
+            Dirty[i] = false;
+            DirtyCount--;
+        }
+        Hashes[i] = hash;
+    }
+    Hashed = true;
+    return DirtyCount;
+}
+
+//---------------------------------------------------------------------------
+// content hashes
+//---------------------------------------------------------------------------
+
+static constexpr uint HashPrime1 = 0x9e3779b1u;
+static constexpr uint HashPrime2 = 0x85ebca77u;
+static constexpr uint HashPrime3 = 0xc2b2ae3du;
+static constexpr uint HashPrime4 = 0x27d4eb2fu;
+
+static inline uint RotL(uint x, int r) { return (x << r) | (x >> (32 - r)); }
+
+static inline uint Avalanche(uint h)
+{
+    h ^= h >> 15;
+    h *= HashPrime2;
+    h ^= h >> 13;
+    h *= HashPrime3;
+    return h ^ (h >> 16);
+}
+
+// Four lanes like xxHash32 (word k of a line goes into lane k % 4, which is what SSE4
+// does 16 bytes at a time), made into 64 bits at the end as a 32 bit hash would
+// mistake some change somewhere for nothing every few hours.
+template<bool SSE> static uint64 HashTile(const uint8* src, uint pitch, uint lineBytes, uint lines)
+{
+    uint acc[4] = { HashPrime1 + HashPrime2, HashPrime2, 0, 0u - HashPrime1 };
+
+    if (SSE && !(lineBytes & 15))
+    {
+        const __m128i p1 = _mm_set1_epi32((int)HashPrime1), p2 = _mm_set1_epi32((int)HashPrime2);
+        __m128i vacc = _mm_loadu_si128((const __m128i*)acc);
+        for (uint y = 0; y < lines; y++, src += pitch)
+            for (uint x = 0; x < lineBytes; x += 16)
+            {
+                __m128i v = _mm_add_epi32(vacc, _mm_mullo_epi32(_mm_loadu_si128((const __m128i*)(src + x)), p2));
+                vacc = _mm_mullo_epi32(_mm_or_si128(_mm_slli_epi32(v, 13), _mm_srli_epi32(v, 19)), p1);
+            }
+        _mm_storeu_si128((__m128i*)acc, vacc);
+    }
+    else
+    {
+        for (uint y = 0; y < lines; y++, src += pitch)
+            for (uint x = 0; x < lineBytes; x += 4)
+            {
+                uint& a = acc[(x >> 2) & 3];
+                a = RotL(a + *(const uint*)(src + x) * HashPrime2, 13) * HashPrime1;
+            }
+    }
+
+    uint len = lineBytes * lines;
+    uint lo = RotL(acc[0], 1) + RotL(acc[1], 7) + RotL(acc[2], 12) + RotL(acc[3], 18) + len;
+    uint hi = ((acc[0] * HashPrime3 + acc[1]) * HashPrime3 + acc[2]) * HashPrime3 + acc[3] + len * HashPrime4;
+    return Avalanche(lo) | ((uint64)Avalanche(hi) << 32);
+}
+
+static uint GetHashBytesPerPixel(PixelFormat fmt)
+{
+    switch (fmt)
+    {
+    case PixelFormat::RGBA16: case PixelFormat::RGBA16F: return 8;
+    default: return 4;
+    }
+}
+
+void HashTiles(const uint8* data, uint pitch, uint sizeX, uint sizeY, PixelFormat format, ReadOnlySpan<uint> tiles, uint64* hashes, ConvertPath path)
+{
+    const uint T = DirtyTiles::TILE;
+    uint bpp = GetHashBytesPerPixel(format);
+    auto hashTile = path == ConvertPath::Scalar ? HashTile<false> : HashTile<true>;
+
+    GetThreadPool().ParallelFor((uint)tiles.Len(), 16, [&](uint begin, uint end)
+    {
+        for (uint i = begin; i < end; i++)
+        {
+            uint x = T * (tiles[i] & 0xffff), y = T * (tiles[i] >> 16);
+            uint w = Min(T, sizeX - x), h = Min(T, sizeY - y);
+            hashes[i] = hashTile(data + (size_t)y * pitch + (size_t)x * bpp, pitch, w * bpp, h);
+        }
+    });
+}
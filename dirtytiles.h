@@ -0,0 +1,54 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#pragma once
+
+#include "types.h"
+#include "graphics.h"
+#include "colorconvert.h"
+
+// Keeps track of which tiles of the captured screen changed since they were last
+// converted, from the dirty rects of every frame that comes in (see CaptureInfo),
+// so the conversion only has to redo those in the persistent encoder input.
+// Frames that don't get converted still have to be marked, or their changes get lost.
+class DirtyTiles
+{
+public:
+    static constexpr uint TILE = 64;    // pixels, 8x8 thread groups of colorconvert.hlsl
+
+    // starts with everything dirty
+    void Init(uint sizeX, uint sizeY);
+
+    void MarkAll();
+    void Mark(const DirtyRect& rect);
+    void Mark(const CaptureInfo& info);
+
+    // appends the dirty tiles as x | y << 16 to tiles
+    void GetDirty(Array<uint>& tiles) const;
+
+    // the same, and starts over with none. Tiles that weren't hashed since they were
+    // last marked forget their hash, as it's not the one of what gets converted now
+    void Take(Array<uint>& tiles);
+
+    // Un-marks the tiles (from GetDirty) whose content hash is the same as when they
+    // were last in here, hashes[i] being the one of tiles[i]. Returns how many are left.
+    uint KeepChanged(ReadOnlySpan<uint> tiles, const uint64* hashes);
+
+    uint GetDirtyCount() const { return DirtyCount; }
+    uint GetTileCount() const { return TilesX * TilesY; }
+
+private:
+    uint SizeX = 0, SizeY = 0;
+    uint TilesX = 0, TilesY = 0;
+    Array<bool> Dirty;
+    uint DirtyCount = 0;
+    Array<uint64> Hashes;       // 0: don't know yet
+    bool Hashed = false;        // KeepChanged() ran since the last Mark()
+};
+
+// xxHash32 style content hashes of the DirtyTiles::TILE sized tiles of a frame in memory,
+// spread over the thread pool. The tilehash shader in colorconvert.hlsl does the same for
+// textures, but hashes what the shader reads instead of the bytes, so the values differ.
+void HashTiles(const uint8* data, uint pitch, uint sizeX, uint sizeY, PixelFormat format, ReadOnlySpan<uint> tiles, uint64* hashes, ConvertPath path = GetBestConvertPath());
@@ -10,6 +10,14 @@
 
 struct CaptureConfig;
 
+// what comes with an encoded packet
+struct PacketInfo
+{
+    double Time;        // capture time of the frame
+    bool Keyframe;      // IDR frame, decoding can start here
+    uint Skipped;       // frame times before this one that the last frame stayed on for (see IEncode::RepeatFrame())
+};
+
 struct IEncode
 {
     enum class BufferFormat
@@ -27,17 +35,46 @@ struct IEncode
 
     virtual void Init(uint sizeX, uint sizeY, uint rateNum, uint rateDen, RCPtr<GpuByteBuffer> buffer) = 0;
 
+    // encode what's in the buffer passed to Init()
     virtual void SubmitFrame(double time) = 0;
 
-    virtual void DuplicateFrame() = 0;
+    // encode a frame from the CPU, in the same layout as the buffer
+    virtual void SubmitFrame(ReadOnlySpan<uint8> frame, double time) = 0;
+
+    // encode the last frame again, its packet gets time as capture time
+    virtual void DuplicateFrame(double time) = 0;
+
+    // the last frame stays on screen for another frame time, without encoding anything.
+    // The next packet that comes out has the count in PacketInfo::Skipped.
+    virtual void RepeatFrame() = 0;
+
+    // the next frame becomes a keyframe that a new file can start with. Repeats that
+    // didn't make it into a packet yet are forgotten.
+    virtual void ForceKeyframe() = 0;
+
+    // makes everything submitted so far come out, without waiting for more frames (eg. to fill a lookahead),
+    // and returns once all of it got taken with BeginGetPacket(), so someone else needs to be doing that.
+    // The encoder takes new frames afterwards.
+    virtual void Drain() = 0;
 
+    // stops encoding, whatever's still in the encoder gets thrown away
     virtual void Flush() = 0;
 
-    virtual bool BeginGetPacket(uint8 *&data, uint &size, uint timeoutMs, double &time) = 0;
+    virtual bool BeginGetPacket(uint8 *&data, uint &size, uint timeoutMs, PacketInfo &info) = 0;
     virtual void EndGetPacket() = 0;
+
+    // codec extradata, if the codec has some outside of the bitstream (valid after Init())
+    virtual ReadOnlySpan<uint8> GetHeader() { return {}; }
 };
 
+bool IsNVENCAvailable();
+
 IEncode* CreateEncodeNVENC(const CaptureConfig &cfg, bool isHdr);
+IEncode* CreateEncodeLibAV(const CaptureConfig &cfg, bool isHdr);
+IEncode* CreateEncodeNull(const CaptureConfig &cfg, bool isHdr);
+
+// the one the config asks for, or the best one there is
+IEncode* CreateEncode(const CaptureConfig &cfg, bool isHdr);
 
 struct FormatInfo
 {
@@ -47,4 +84,51 @@ struct FormatInfo
     float ymin, ymax, uvmin, uvmax;
 };
 
-FormatInfo GetFormatInfo(IEncode::BufferFormat fmt, uint sizeX, uint sizeY);
\ No newline at end of file
+constexpr FormatInfo GetFormatInfo(IEncode::BufferFormat fmt, uint sizeX, uint sizeY)
+{
+    FormatInfo info = {};
+    switch (fmt)
+    {
+    case IEncode::BufferFormat::BGRA8:
+        info.pitch = 4 * sizeX;
+        info.lines = sizeY;
+        info.amp = 255.0f;
+        break;
+    case IEncode::BufferFormat::NV12:
+        info.pitch = sizeX;
+        info.lines = sizeY + sizeY / 2;
+        info.amp = 255.0f;
+        info.ymin = info.uvmin = 16.f / 255.f;
+        info.ymax = 235.f / 255.f;
+        info.uvmax = 240.f / 255.f;
+        break;
+    case IEncode::BufferFormat::YUV444_8:
+        info.pitch = sizeX;
+        info.lines = 3 * sizeY;
+        info.amp = 255.0f;
+        info.ymin = info.uvmin = 16.f / 255.f;
+        info.ymax = 235.f / 255.f;
+        info.uvmax = 240.f / 255.f;
+        break;
+    case IEncode::BufferFormat::YUV420_16:
+        info.pitch = 2 * sizeX;
+        info.lines = sizeY + sizeY / 2;
+        info.amp = 65535.0f;
+        info.ymin = info.uvmin = 64.f / 1023.f;
+        info.ymax = 940.f / 1023.f;
+        info.uvmax = 960.f / 1023.f;
+        break;
+    case IEncode::BufferFormat::YUV444_16:
+        info.pitch = 2 * sizeX;
+        info.lines = 3 * sizeY;
+        info.amp = 65535.0f;
+        info.ymin = info.uvmin = 64.f / 1023.f;
+        info.ymax = 940.f / 1023.f;
+        info.uvmax = 960.f / 1023.f;
+        break;
+    }
+    return info;
+}
+
+enum class CodecProfile;
+IEncode::BufferFormat GetProfileBufferFormat(CodecProfile profile);
\ No newline at end of file
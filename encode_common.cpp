@@ -4,49 +4,34 @@
 //
 
 #include "encode.h"
+#include "screencapture.h"
 
-FormatInfo GetFormatInfo(IEncode::BufferFormat fmt, uint sizeX, uint sizeY)
+IEncode* CreateEncode(const CaptureConfig& cfg, bool isHdr)
 {
-    FormatInfo info = {};
-    switch (fmt)
+    // FFV1 is software only
+    if (cfg.CodecCfg.Profile == CodecProfile::FFV1 && cfg.CodecCfg.UseEncoder != VideoEncoder::Null)
+        return CreateEncodeLibAV(cfg, isHdr);
+
+    switch (cfg.CodecCfg.UseEncoder)
+    {
+    case VideoEncoder::NVENC: return CreateEncodeNVENC(cfg, isHdr);
+    case VideoEncoder::LibAV: return CreateEncodeLibAV(cfg, isHdr);
+    case VideoEncoder::Null: return CreateEncodeNull(cfg, isHdr);
+    default: return IsNVENCAvailable() ? CreateEncodeNVENC(cfg, isHdr) : CreateEncodeLibAV(cfg, isHdr);
+    }
+}
+
+IEncode::BufferFormat GetProfileBufferFormat(CodecProfile profile)
+{
+    switch (profile)
     {
-    case IEncode::BufferFormat::BGRA8:
-        info.pitch = 4 * sizeX;
-        info.lines = sizeY;
-        info.amp = 255.0f;
-        break;
-    case IEncode::BufferFormat::NV12:
-        info.pitch = sizeX;
-        info.lines = sizeY + sizeY / 2;
-        info.amp = 255.0f;
-        info.ymin = info.uvmin = 16.f / 255.f;
-        info.ymax = 235.f / 255.f;
-        info.uvmax = 240.f / 255.f;
-        break;
-    case IEncode::BufferFormat::YUV444_8:
-        info.pitch = sizeX;
-        info.lines = 3 * sizeY;
-        info.amp = 255.0f;
-        info.ymin = info.uvmin = 16.f / 255.f;
-        info.ymax = 235.f / 255.f;
-        info.uvmax = 240.f / 255.f;
-        break;
-    case IEncode::BufferFormat::YUV420_16:
-        info.pitch = 2 * sizeX;
-        info.lines = sizeY + sizeY / 2;
-        info.amp = 65535.0f;
-        info.ymin = info.uvmin = 64.f / 1023.f;
-        info.ymax = 940.f / 1023.f;
-        info.uvmax = 960.f / 1023.f;
-        break;
-    case IEncode::BufferFormat::YUV444_16:
-        info.pitch = 2 * sizeX;
-        info.lines = 3 * sizeY;
-        info.amp = 65535.0f;
-        info.ymin = info.uvmin = 64.f / 1023.f;
-        info.ymax = 940.f / 1023.f;
-        info.uvmax = 960.f / 1023.f;
-        break;
+    case CodecProfile::H264_HIGH_444: case CodecProfile::HEVC_MAIN_444:
+        return IEncode::BufferFormat::YUV444_8;
+    case CodecProfile::HEVC_MAIN10:
+        return IEncode::BufferFormat::YUV420_16;
+    case CodecProfile::HEVC_MAIN10_444: case CodecProfile::HEVC_LOSSLESS: case CodecProfile::FFV1:
+        return IEncode::BufferFormat::YUV444_16;
+    default:
+        return IEncode::BufferFormat::NV12;
     }
-    return info;
 }
\ No newline at end of file
@@ -0,0 +1,477 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include "system.h"
+#include "graphics.h"
+#include "encode.h"
+#include "screencapture.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <libavutil/opt.h>
+#include <libavutil/error.h>
+}
+
+#include <string.h>
+
+static char averrbuf[1024];
+
+#if _DEBUG
+#define AVERR(x) { auto _ret=(x); if(_ret<0) { Fatal("%s(%d): libav call failed: %s\nCall: %s\n",__FILE__,__LINE__,av_make_error_string(averrbuf, 1024, _ret),#x); } }
+#else
+#define AVERR(x) { auto _ret=(x); if(_ret<0) { Fatal("%s(%d): libav call failed: %s\n",__FILE__,__LINE__,av_make_error_string(averrbuf, 1024, _ret)); } }
+#endif
+
+struct LibAVProfileDef
+{
+    const char* encoder;
+    const char* profile;
+    AVPixelFormat pixfmt;   // what the buffer gets converted to
+};
+
+static const LibAVProfileDef LibAVProfiles[] =
+{
+    { "libx264", "main",        AV_PIX_FMT_NV12 },
+    { "libx264", "high",        AV_PIX_FMT_NV12 },
+    { "libx264", "high444",     AV_PIX_FMT_YUV444P },
+    { "libx265", "main",        AV_PIX_FMT_YUV420P },
+    { "libx265", "main10",      AV_PIX_FMT_YUV420P10 },
+    { "libx265", "main444-8",   AV_PIX_FMT_YUV444P },
+    { "libx265", "main444-10",  AV_PIX_FMT_YUV444P10 },
+    { "libx265", "main444-10",  AV_PIX_FMT_YUV444P10 },
+    { "ffv1",    nullptr,       AV_PIX_FMT_YUV444P16 },
+};
+
+// copy lines of pixels, 16 bit ones get shifted down to fit (eg. MSB aligned -> 10 bits)
+template<typename T> static void CopyPlane(uint8* dst, int dstPitch, const uint8* src, uint srcPitch, uint width, uint lines, int shift)
+{
+    for (uint y = 0; y < lines; y++, dst += dstPitch, src += srcPitch)
+    {
+        if (!shift)
+            memcpy(dst, src, width * sizeof(T));
+        else
+        {
+            const T* s = (const T*)src;
+            T* d = (T*)dst;
+            for (uint x = 0; x < width; x++)
+                d[x] = s[x] >> shift;
+        }
+    }
+}
+
+// split interleaved U,V lines into two planes
+template<typename T> static void SplitPlane(uint8* dstU, uint8* dstV, int dstPitch, const uint8* src, uint srcPitch, uint width, uint lines, int shift)
+{
+    for (uint y = 0; y < lines; y++, dstU += dstPitch, dstV += dstPitch, src += srcPitch)
+    {
+        const T* s = (const T*)src;
+        T* u = (T*)dstU;
+        T* v = (T*)dstV;
+        for (uint x = 0; x < width; x++)
+        {
+            u[x] = s[2 * x] >> shift;
+            v[x] = s[2 * x + 1] >> shift;
+        }
+    }
+}
+
+class Encode_LibAV : public IEncode
+{
+    // a frame to encode, or nullptr to drain the encoder
+    struct Input
+    {
+        AVFrame* frame;
+        double time;
+        bool keep;          // when draining: hand out what comes out and get ready for more frames (see Drain())
+    };
+
+    static constexpr uint MAX_FRAMES = 16;  // in flight, before submitting blocks
+    static constexpr uint TIMES = 256;      // more than the encoder will ever keep back
+
+    const VideoCodecConfig Config;
+    bool IsHDR;
+    LibAVProfileDef Def = {};
+
+    AVCodecContext* Context = nullptr;
+    Thread* EncodeThread = nullptr;
+
+    Queue<Input, MAX_FRAMES> Inputs;
+    Queue<AVPacket*, 64> Packets;
+    ThreadEvent InputEvent;
+    ThreadEvent PacketEvent;
+    ThreadEvent DrainedEvent;
+    AVPacket* CurrentPacket = nullptr;
+    volatile bool Flushed = false;
+
+    Array<AVFrame*> FramePool;  // owned by the submitting thread
+    AVFrame* LastFrame = nullptr;
+    int64 FrameNo = 0;
+    bool ForceKey = false;
+    double Times[TIMES] = {};   // frame times, by pts
+    uint Skipped[TIMES] = {};   // and how many RepeatFrame()s came before them
+    uint Repeats = 0;
+
+    uint SizeX = 0;
+    uint SizeY = 0;
+    uint RateNum = 0;
+    uint RateDen = 1;
+
+    RCPtr<GpuByteBuffer> InBuffer;
+    Array<uint8> Readback;
+
+    AVFrame* AcquireFrame()
+    {
+        // pool frames are free again once the encoder let go of all references to them
+        for (;;)
+        {
+            for (auto f : FramePool)
+                if (av_frame_is_writable(f))
+                    return f;
+
+            if (FramePool.Len() < MAX_FRAMES + 2)
+                break;
+            Thread::Sleep(1);
+        }
+
+        AVFrame* frame = av_frame_alloc();
+        frame->format = Def.pixfmt;
+        frame->width = SizeX;
+        frame->height = SizeY;
+        AVERR(av_frame_get_buffer(frame, 0));
+        FramePool += frame;
+        return frame;
+    }
+
+    void Enqueue(const Input& in)
+    {
+        // the encoder is behind, so are we
+        while (!Inputs.Enqueue(in))
+            Thread::Sleep(1);
+        InputEvent.Fire();
+    }
+
+    void Submit(AVFrame* frame, double time)
+    {
+        AVFrame* ref = av_frame_clone(frame);
+        ref->pts = FrameNo;
+        if (ForceKey)
+        {
+            ref->pict_type = AV_PICTURE_TYPE_I;
+            ForceKey = false;
+        }
+        Times[FrameNo % TIMES] = time;
+        Skipped[FrameNo % TIMES] = Repeats;
+        Repeats = 0;
+        FrameNo++;
+        Enqueue({ ref, time });
+    }
+
+    void ConvertFrame(AVFrame* frame, const uint8* src)
+    {
+        auto fmt = GetBufferFormat();
+        auto fi = GetFormatInfo(fmt, SizeX, SizeY);
+        uint planeSize = fi.pitch * SizeY;
+
+        switch (fmt)
+        {
+        case BufferFormat::NV12:
+            CopyPlane<uint8>(frame->data[0], frame->linesize[0], src, fi.pitch, SizeX, SizeY, 0);
+            if (Def.pixfmt == AV_PIX_FMT_NV12)
+                CopyPlane<uint8>(frame->data[1], frame->linesize[1], src + planeSize, fi.pitch, SizeX, SizeY / 2, 0);
+            else
+                SplitPlane<uint8>(frame->data[1], frame->data[2], frame->linesize[1], src + planeSize, fi.pitch, SizeX / 2, SizeY / 2, 0);
+            break;
+
+        case BufferFormat::YUV420_16:
+            CopyPlane<uint16>(frame->data[0], frame->linesize[0], src, fi.pitch, SizeX, SizeY, 6);
+            SplitPlane<uint16>(frame->data[1], frame->data[2], frame->linesize[1], src + planeSize, fi.pitch, SizeX / 2, SizeY / 2, 6);
+            break;
+
+        case BufferFormat::YUV444_8:
+            for (int i = 0; i < 3; i++)
+                CopyPlane<uint8>(frame->data[i], frame->linesize[i], src + i * planeSize, fi.pitch, SizeX, SizeY, 0);
+            break;
+
+        case BufferFormat::YUV444_16:
+            for (int i = 0; i < 3; i++)
+                CopyPlane<uint16>(frame->data[i], frame->linesize[i], src + i * planeSize, fi.pitch, SizeX, SizeY, Def.pixfmt == AV_PIX_FMT_YUV444P10 ? 6 : 0);
+            break;
+
+        default:
+            ASSERT0("unsupported buffer format");
+        }
+    }
+
+    void OpenContext()
+    {
+        const AVCodec* codec = avcodec_find_encoder_by_name(Def.encoder);
+        if (!codec)
+            Fatal("This build of libavcodec doesn't have the %s encoder (x264/x265 need the gpl vcpkg feature)\n", Def.encoder);
+
+        Context = avcodec_alloc_context3(codec);
+        Context->width = SizeX;
+        Context->height = SizeY;
+        Context->time_base = { .num = (int)RateDen, .den = (int)RateNum };
+        Context->framerate = { .num = (int)RateNum, .den = (int)RateDen };
+        Context->pix_fmt = Def.pixfmt;
+        Context->sample_aspect_ratio = { .num = 1, .den = 1 };
+
+        // no reordering, the output expects dts == pts
+        Context->max_b_frames = 0;
+        if (Config.FrameCfg == FrameConfig::I)
+            Context->gop_size = 1;
+        else if (Config.GopSize)
+            Context->gop_size = Config.GopSize;
+
+        // let libavcodec (or x264/x265 themselves) use all cores
+        Context->thread_count = 0;
+        Context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+        Context->color_range = AVCOL_RANGE_MPEG;
+        if (IsHDR)
+        {
+            Context->color_primaries = AVCOL_PRI_BT2020;
+            Context->color_trc = AVCOL_TRC_SMPTE2084;
+            Context->colorspace = AVCOL_SPC_BT2020_NCL;
+        }
+        else
+        {
+            Context->color_primaries = AVCOL_PRI_BT709;
+            Context->color_trc = AVCOL_TRC_IEC61966_2_1;
+            Context->colorspace = AVCOL_SPC_BT709;
+        }
+
+        void* opts = Context->priv_data;
+        if (Config.Profile == CodecProfile::FFV1)
+        {
+            // version 3 has slices, which is what it can run in parallel
+            Context->level = 3;
+            av_opt_set_int(opts, "slicecrc", 1, 0);
+        }
+        else
+        {
+            av_opt_set(opts, "profile", Def.profile, 0);
+            av_opt_set(opts, "preset", Config.SoftwarePreset, 0);
+            av_opt_set_int(opts, "forced-idr", 1, 0); // so ForceKeyframe() gives an IDR frame, not just an I frame
+
+            if (Config.Profile == CodecProfile::HEVC_LOSSLESS)
+                av_opt_set(opts, "x265-params", "lossless=1", 0);
+            else if (Config.UseBitrateControl == BitrateControl::CBR)
+            {
+                Context->bit_rate = Context->rc_max_rate = Config.BitrateParameter * 1000ll;
+                Context->rc_buffer_size = (int)Min<int64>(Context->bit_rate, 0x7fffffff);
+            }
+            else
+                av_opt_set_int(opts, "qp", Config.BitrateParameter, 0);
+        }
+
+        AVERR(avcodec_open2(Context, codec, nullptr));
+    }
+
+    // a drained encoder doesn't take frames anymore until it's reset, and not all of them can do that
+    void Restart()
+    {
+        if (Context->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH)
+            avcodec_flush_buffers(Context);
+        else
+        {
+            avcodec_free_context(&Context);
+            OpenContext();
+        }
+    }
+
+    void EncodeThreadFunc(Thread& thread)
+    {
+        AVPacket* packet = av_packet_alloc();
+
+        while (thread.IsRunning())
+        {
+            Input in;
+            if (!Inputs.Dequeue(in))
+            {
+                InputEvent.Wait(10);
+                continue;
+            }
+
+            AVERR(avcodec_send_frame(Context, in.frame));
+
+            for (;;)
+            {
+                int ret = avcodec_receive_packet(Context, packet);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+                    break;
+                AVERR(ret);
+
+                // like NVENC, whatever's still in the encoder when flushing gets dropped
+                if (!in.frame && !in.keep)
+                {
+                    av_packet_unref(packet);
+                    continue;
+                }
+
+                AVPacket* out = av_packet_alloc();
+                av_packet_move_ref(out, packet);
+                while (!Packets.Enqueue(out))
+                {
+                    // nobody's going to pick it up anymore
+                    if (Flushed || !thread.IsRunning())
+                    {
+                        av_packet_free(&out);
+                        break;
+                    }
+                    Thread::Sleep(1);
+                }
+                PacketEvent.Fire();
+            }
+
+            if (in.frame)
+                av_frame_free(&in.frame);
+            else
+            {
+                if (in.keep)
+                    Restart();
+                DrainedEvent.Fire();
+            }
+        }
+
+        av_packet_free(&packet);
+    }
+
+public:
+    Encode_LibAV(const VideoCodecConfig& cfg, bool isHdr) : Config(cfg), IsHDR(isHdr)
+    {
+        Def = LibAVProfiles[(int)Config.Profile];
+    }
+
+    ~Encode_LibAV()
+    {
+        Flush();
+        delete EncodeThread;
+
+        EndGetPacket();
+        AVPacket* packet;
+        while (Packets.Dequeue(packet))
+            av_packet_free(&packet);
+
+        Input in;
+        while (Inputs.Dequeue(in))
+            av_frame_free(&in.frame);
+
+        for (auto f : FramePool)
+            av_frame_free(&f);
+
+        avcodec_free_context(&Context);
+    }
+
+    BufferFormat GetBufferFormat() override { return GetProfileBufferFormat(Config.Profile); }
+
+    void Init(uint sizeX, uint sizeY, uint rateNum, uint rateDen, RCPtr<GpuByteBuffer> buffer) override
+    {
+        SizeX = sizeX;
+        SizeY = sizeY;
+        RateNum = rateNum;
+        RateDen = rateDen;
+        InBuffer = buffer;
+
+        if (IsHDR && Def.pixfmt != AV_PIX_FMT_YUV420P10 && Def.pixfmt != AV_PIX_FMT_YUV444P10 && Def.pixfmt != AV_PIX_FMT_YUV444P16)
+        {
+            ASSERT0("HDR capture is only supported when using a 10 bits per pixel profile");
+        }
+
+        OpenContext();
+
+        if (InBuffer.IsValid())
+        {
+            auto fi = GetFormatInfo(GetBufferFormat(), SizeX, SizeY);
+            Readback.SetSize((size_t)fi.pitch * fi.lines);
+        }
+
+        EncodeThread = new Thread(Bind(this, &Encode_LibAV::EncodeThreadFunc));
+    }
+
+    void SubmitFrame(double time) override
+    {
+        ASSERT(InBuffer.IsValid());
+        ReadBuffer(InBuffer, Readback);
+        SubmitFrame(Readback, time);
+    }
+
+    void SubmitFrame(ReadOnlySpan<uint8> frame, double time) override
+    {
+        ASSERT(!Flushed);
+        auto fi = GetFormatInfo(GetBufferFormat(), SizeX, SizeY);
+        ASSERT(frame.Len() >= (size_t)fi.pitch * fi.lines);
+
+        AVFrame* f = AcquireFrame();
+        ConvertFrame(f, frame.Ptr());
+        LastFrame = f;
+        Submit(f, time);
+    }
+
+    void DuplicateFrame(double time) override
+    {
+        if (!LastFrame || Flushed) return;
+        Submit(LastFrame, time);
+    }
+
+    void RepeatFrame() override { Repeats++; }
+
+    void ForceKeyframe() override
+    {
+        ForceKey = true;
+        Repeats = 0;
+    }
+
+    void Drain() override
+    {
+        if (Flushed || !EncodeThread) return;
+
+        Enqueue({ nullptr, 0, true });
+        DrainedEvent.Wait();
+        while (!Packets.IsEmpty())
+            Thread::Sleep(1);
+    }
+
+    void Flush() override
+    {
+        if (Flushed || !EncodeThread) return;
+        Flushed = true;
+
+        Enqueue({ nullptr, 0 });
+        DrainedEvent.Wait();
+    }
+
+    bool BeginGetPacket(uint8*& data, uint& size, uint timeoutMs, PacketInfo& info) override
+    {
+        ASSERT(!CurrentPacket);
+        if (Packets.IsEmpty() && !PacketEvent.Wait(timeoutMs))
+            return false;
+
+        if (!Packets.Dequeue(CurrentPacket))
+            return false;
+
+        data = CurrentPacket->data;
+        size = CurrentPacket->size;
+        info.Time = Times[CurrentPacket->pts % TIMES];
+        info.Skipped = Skipped[CurrentPacket->pts % TIMES];
+        info.Keyframe = (CurrentPacket->flags & AV_PKT_FLAG_KEY) != 0;
+        return true;
+    }
+
+    void EndGetPacket() override
+    {
+        if (CurrentPacket)
+            av_packet_free(&CurrentPacket);
+    }
+
+    ReadOnlySpan<uint8> GetHeader() override
+    {
+        return Context ? ReadOnlySpan<uint8>(Context->extradata, Context->extradata_size) : ReadOnlySpan<uint8>();
+    }
+};
+
+IEncode* CreateEncodeLibAV(const CaptureConfig& cfg, bool isHdr) { return new Encode_LibAV(cfg.CodecCfg, isHdr); }
@@ -0,0 +1,162 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "system.h"
+#include "encode.h"
+#include "screencapture.h"
+
+// Doesn't encode anything but puts out packets of made up sizes (full of zeros)
+// with a given latency, so the rest of the pipeline can be measured on its own.
+class Encode_Null : public IEncode
+{
+    struct Packet
+    {
+        uint size;
+        double time;
+        bool keyframe;
+        uint skipped;
+        int64 ready;    // ticks when the packet comes out
+    };
+
+    const VideoCodecConfig& Config;
+    NullEncoderConfig Para;
+
+    Queue<Packet, 256> Packets;
+    ThreadEvent PacketEvent;
+    bool HaveCurrent = false;
+
+    Array<uint> Sizes;      // for the Trace pattern
+    Array<uint8> Data;
+    uint64 FrameNo = 0;
+    uint64 GopStart = 0;
+    bool ForceKey = false;
+    uint Repeats = 0;
+    int64 LatencyTicks = 0;
+    int64 TicksPerMs = 1;
+
+    uint NextSize(bool keyframe)
+    {
+        switch (Para.Pattern)
+        {
+        case NullPattern::Keyframes: return keyframe ? Para.KeyframeSize : Para.PacketSize;
+        case NullPattern::Trace: return Sizes[FrameNo % Sizes.Len()];
+        default: return Para.PacketSize;
+        }
+    }
+
+    void AddPacket(double time)
+    {
+        uint gop = Config.FrameCfg == FrameConfig::I ? 1 : Max(Config.GopSize, 1u);
+        if (ForceKey)
+        {
+            GopStart = FrameNo;
+            ForceKey = false;
+        }
+        bool keyframe = (FrameNo - GopStart) % gop == 0;
+        Packet p = { .size = NextSize(keyframe), .time = time, .keyframe = keyframe, .skipped = Repeats, .ready = GetTicks() + LatencyTicks };
+        Repeats = 0;
+        FrameNo++;
+        while (!Packets.Enqueue(p))
+            Thread::Sleep(1);
+        PacketEvent.Fire();
+    }
+
+public:
+    Encode_Null(const VideoCodecConfig& cfg) : Config(cfg), Para(cfg.NullCfg)
+    {
+        if (Para.Pattern == NullPattern::Trace)
+        {
+            // one number per line, anything else gets skipped
+            String text = ReadFileUTF8(Para.SizeTrace);
+            for (const char* line = text; *line; )
+            {
+                char* end;
+                uint size = (uint)strtoul(line, &end, 10);
+                if (end != line)
+                    Sizes += size;
+                while (*end && *end != '\n') end++;
+                line = *end ? end + 1 : end;
+            }
+            if (!Sizes.Len())
+                Fatal("No packet sizes in %s\n", (const char*)Para.SizeTrace);
+        }
+
+        uint maxSize = Max(Para.PacketSize, Para.KeyframeSize);
+        for (auto s : Sizes)
+            maxSize = Max(maxSize, s);
+        Data.SetSize(Max(maxSize, 1u));
+        memset(Data.Ptr(), 0, Data.Len());
+
+        TicksPerMs = Max<int64>(GetTicksPerSecond() / 1000, 1);
+        LatencyTicks = (int64)(Para.LatencyMs * GetTicksPerSecond() / 1000.0);
+    }
+
+    BufferFormat GetBufferFormat() override { return GetProfileBufferFormat(Config.Profile); }
+
+    void Init(uint sizeX, uint sizeY, uint rateNum, uint rateDen, RCPtr<GpuByteBuffer> buffer) override {}
+
+    void SubmitFrame(double time) override { AddPacket(time); }
+
+    void SubmitFrame(ReadOnlySpan<uint8> frame, double time) override { SubmitFrame(time); }
+
+    void DuplicateFrame(double time) override { AddPacket(time); }
+
+    void RepeatFrame() override { Repeats++; }
+
+    void ForceKeyframe() override
+    {
+        ForceKey = true;
+        Repeats = 0;
+    }
+
+    void Drain() override
+    {
+        while (!Packets.IsEmpty())
+            Thread::Sleep(1);
+    }
+
+    void Flush() override
+    {
+        Packet p;
+        while (Packets.Dequeue(p)) {}
+    }
+
+    bool BeginGetPacket(uint8*& data, uint& size, uint timeoutMs, PacketInfo& info) override
+    {
+        ASSERT(!HaveCurrent);
+        if (Packets.IsEmpty() && !PacketEvent.Wait(timeoutMs))
+            return false;
+
+        Packet p;
+        if (!Packets.Peek(p))
+            return false;
+
+        // still "encoding"?
+        int64 wait = p.ready - GetTicks();
+        if (wait > 0)
+        {
+            int64 ms = (wait + TicksPerMs - 1) / TicksPerMs;
+            Thread::Sleep((int)Min<int64>(ms, timeoutMs));
+            if (ms > timeoutMs)
+                return false;
+        }
+
+        Packets.Dequeue(p);
+        HaveCurrent = true;
+        data = Data.Ptr();
+        size = p.size;
+        info.Time = p.time;
+        info.Keyframe = p.keyframe;
+        info.Skipped = p.skipped;
+        return true;
+    }
+
+    void EndGetPacket() override { HaveCurrent = false; }
+};
+
+IEncode* CreateEncodeNull(const CaptureConfig& cfg, bool isHdr) { return new Encode_Null(cfg.CodecCfg); }
@@ -19,6 +19,33 @@ static bool Inited = false;
 static NV_ENCODE_API_FUNCTION_LIST Nvenc = {};
 static CudaFunctions *Cuda;
 
+static bool LoadNVENC()
+{
+    if (Inited)
+        return true;
+
+    if (cuda_load_functions(&Cuda, nullptr))
+        return false;
+
+    NvencFunctions* funcs{};
+    if (Cuda->cuInit(0) != CUDA_SUCCESS || nvenc_load_functions(&funcs, nullptr))
+    {
+        cuda_free_functions(&Cuda);
+        return false;
+    }
+
+    Nvenc.version = NV_ENCODE_API_FUNCTION_LIST_VER;
+    if (funcs->NvEncodeAPICreateInstance(&Nvenc) != NV_ENC_SUCCESS)
+    {
+        nvenc_free_functions(&funcs);
+        cuda_free_functions(&Cuda);
+        return false;
+    }
+
+    Inited = true;
+    return true;
+}
+
 #if _DEBUG
 #define CUDAERR(x) { auto ret = (x); if(ret != CUDA_SUCCESS) { const char *err; Cuda->cuGetErrorString(ret, &err); Fatal("%s(%d): CUDA call failed: %s (%d)\nCall: %s\n",__FILE__,__LINE__,err,ret,#x); } }
 #define NVERR(x) { auto _ret=(x); if(_ret!= NV_ENC_SUCCESS) Fatal("%s(%d): NVENC call failed: %s (%d)\nCall: %s\n",__FILE__,__LINE__,Nvenc.nvEncGetLastErrorString(Encoder),_ret,#x); }
@@ -52,7 +79,6 @@ class Encode_NVENC : public IEncode
     {
         uint Used = 0;
         CUdeviceptr Buffer;
-        double Time;
 
         NV_ENC_MAP_INPUT_RESOURCE Map = {};
     };
@@ -60,11 +86,13 @@ class Encode_NVENC : public IEncode
     struct OutBuffer
     {
         Frame* frame = nullptr;
+        double time = 0;
+        uint skipped = 0;
         ThreadEvent event;
         NV_ENC_OUTPUT_PTR buffer = nullptr;
     };
 
-    const VideoCodecConfig& Config;
+    const VideoCodecConfig Config;
     bool IsHDR;
 
     Queue<Frame*, 32> FreeFrames;
@@ -81,6 +109,8 @@ class Encode_NVENC : public IEncode
     uint SizeX = 0;
     uint SizeY = 0;
     uint FrameNo = 0;
+    bool ForceIDR = false;
+    uint Repeats = 0;           // RepeatFrame()s since the last frame that got encoded
 
     // intermediate texture (needed bc CUDA won't register shared textures)
     RCPtr<GpuByteBuffer> InBuffer;
@@ -166,7 +196,7 @@ class Encode_NVENC : public IEncode
         buffer = nullptr;
     }
 
-    void EncodeFrame()
+    void EncodeFrame(double time)
     {
         OutBuffer* ob = nullptr;
 
@@ -174,6 +204,9 @@ class Encode_NVENC : public IEncode
 
         ob = AcquireOutBuffer();
         ob->frame = CurrentFrame;
+        ob->time = time;
+        ob->skipped = Repeats;
+        Repeats = 0;
         AtomicInc(CurrentFrame->Used);
 
         auto fi = GetFormatInfo(GetBufferFormat(), SizeX, SizeY);
@@ -183,7 +216,7 @@ class Encode_NVENC : public IEncode
             .inputWidth = SizeX,
             .inputHeight = SizeY,
             .inputPitch = fi.pitch,
-            .encodePicFlags = 0, // NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS
+            .encodePicFlags = ForceIDR ? (uint32_t)(NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS) : 0u,
             .frameIdx = FrameNo,
             .inputTimeStamp = FrameNo,
             .inputDuration = 1,
@@ -210,7 +243,8 @@ class Encode_NVENC : public IEncode
 
         EncodingBuffers.Enqueue(ob);
         EncodeEvent.Fire();
-        FrameNo++;       
+        FrameNo++;
+        ForceIDR = false;
     }
 
 
@@ -219,21 +253,8 @@ public:
     Encode_NVENC(const VideoCodecConfig &cfg, bool isHdr) : Config(cfg), IsHDR(isHdr)
     {
         // init cuda/nvenc api on first run
-        if (!Inited)
-        {
-            ASSERT(!cuda_load_functions(&Cuda, nullptr));
-
-            // init CUDA
-            CUDAERR(Cuda->cuInit(0));
-
-            NvencFunctions *funcs{};
-            ASSERT(!nvenc_load_functions(&funcs, nullptr));
-
-            Nvenc.version = NV_ENCODE_API_FUNCTION_LIST_VER;
-            NVERR(funcs->NvEncodeAPICreateInstance(&Nvenc));
-
-            Inited = true;
-        }
+        if (!LoadNVENC())
+            Fatal("Could not load CUDA and NVENC. This needs an NVIDIA GPU and driver, or use the libav encoder.\n");
 
         // init CUDA
         CUdevice cudaDevice = 0;
@@ -277,20 +298,7 @@ public:
         Cuda->cuCtxDestroy(CudaContext);
     }
 
-    BufferFormat GetBufferFormat()
-    {
-        switch (Config.Profile)
-        {
-        case CodecProfile::H264_HIGH_444: case CodecProfile::HEVC_MAIN_444:
-            return BufferFormat::YUV444_8;
-        case CodecProfile::HEVC_MAIN10:
-            return BufferFormat::YUV420_16;
-        case CodecProfile::HEVC_MAIN10_444: case CodecProfile::HEVC_LOSSLESS:
-            return BufferFormat::YUV444_16;
-        default:
-            return BufferFormat::NV12;
-        }
-    }
+    BufferFormat GetBufferFormat() { return GetProfileBufferFormat(Config.Profile); }
 
     void Init(uint sizeX, uint sizeY, uint rateNum, uint rateDen, RCPtr<GpuByteBuffer> buffer) override
     {
@@ -469,7 +477,6 @@ public:
 
         // get a frame        
         CurrentFrame = AcquireFrame();
-        CurrentFrame->Time = time;
        
         // copy intermediate texture -> frame
         auto fi = GetFormatInfo(GetBufferFormat(), SizeX, SizeY);
@@ -493,12 +500,54 @@ public:
         // submit frame
         NVERR(Nvenc.nvEncMapInputResource(Encoder, &CurrentFrame->Map));
 
-        EncodeFrame();
+        EncodeFrame(time);
     }
 
-    void DuplicateFrame() override
+    void SubmitFrame(ReadOnlySpan<uint8> frame, double time) override
     {
-        EncodeFrame();
+        ReleaseFrame(CurrentFrame);
+
+        CurrentFrame = AcquireFrame();
+
+        // copy CPU memory -> frame
+        auto fi = GetFormatInfo(GetBufferFormat(), SizeX, SizeY);
+        ASSERT(frame.Len() >= (size_t)fi.pitch * fi.lines);
+        CUDA_MEMCPY2D copy =
+        {
+            .srcMemoryType = CU_MEMORYTYPE_HOST,
+            .srcHost = frame.Ptr(),
+            .srcPitch = fi.pitch,
+            .dstMemoryType = CU_MEMORYTYPE_DEVICE,
+            .dstDevice = CurrentFrame->Buffer,
+            .dstPitch = fi.pitch,
+            .WidthInBytes = fi.pitch,
+            .Height = fi.lines,
+        };
+        CUDAERR(Cuda->cuMemcpy2D(&copy));
+
+        NVERR(Nvenc.nvEncMapInputResource(Encoder, &CurrentFrame->Map));
+
+        EncodeFrame(time);
+    }
+
+    void DuplicateFrame(double time) override
+    {
+        EncodeFrame(time);
+    }
+
+    void RepeatFrame() override { Repeats++; }
+
+    void ForceKeyframe() override
+    {
+        ForceIDR = true;
+        Repeats = 0;
+    }
+
+    void Drain() override
+    {
+        // without lookahead or B frames every frame comes out as soon as it's encoded
+        while (!EncodingBuffers.IsEmpty())
+            Thread::Sleep(1);
     }
 
     void Flush() override
@@ -514,7 +563,7 @@ public:
         }
     }
 
-    bool BeginGetPacket(uint8*& data, uint& size, uint timeoutMs, double &time) override
+    bool BeginGetPacket(uint8*& data, uint& size, uint timeoutMs, PacketInfo &info) override
     {
         ASSERT(!CurrentBuffer);
         if (EncodingBuffers.IsEmpty() && !EncodeEvent.Wait(timeoutMs))
@@ -536,7 +585,9 @@ public:
             NVERR(Nvenc.nvEncLockBitstream(Encoder, &lock));
             data = (uint8*)lock.bitstreamBufferPtr;
             size = lock.bitstreamSizeInBytes;
-            time = CurrentBuffer->frame->Time;
+            info.Time = CurrentBuffer->time;
+            info.Keyframe = lock.pictureType == NV_ENC_PIC_TYPE_IDR;
+            info.Skipped = CurrentBuffer->skipped;
             return true;
         }
 
@@ -554,4 +605,11 @@ public:
 
 };
 
+bool IsNVENCAvailable()
+{
+    // there needs to be CUDA, NVENC and the output needs to be on a GPU that has them
+    CUdevice device = 0;
+    return LoadNVENC() && Cuda->cuD3D11GetDevice(&device, (IDXGIAdapter*)GetAdapter()) == CUDA_SUCCESS;
+}
+
 IEncode* CreateEncodeNVENC(const CaptureConfig &cfg, bool isHdr) { return new Encode_NVENC(cfg.CodecCfg, isHdr); }
@@ -0,0 +1,245 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include <SDKDDKVer.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <string.h>
+
+#include "types.h"
+#include "system.h"
+#include "filewriter.h"
+
+FileWriter* FileWriter::Create(const char* path, const FileWriterPara& para)
+{
+    // unbuffered needs to read back partial sectors
+    DWORD access = para.Unbuffered ? GENERIC_WRITE | GENERIC_READ : GENERIC_WRITE;
+    DWORD flags = para.Unbuffered ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN;
+    HANDLE h = CreateFile(path, access, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | flags, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    if (para.Preallocate)
+    {
+        // only reserves the space, the file size stays 0. If the disk's too full, never mind.
+        FILE_ALLOCATION_INFO info = {};
+        info.AllocationSize.QuadPart = (LONGLONG)para.Preallocate;
+        SetFileInformationByHandle(h, FileAllocationInfo, &info, sizeof(info));
+    }
+
+    return new FileWriter(h, para);
+}
+
+FileWriter::FileWriter(void* handle, const FileWriterPara& para) : Handle(handle), Unbuffered(para.Unbuffered)
+{
+    Capacity = (Max(para.BufferSize, SECTOR) + SECTOR - 1) & ~(SECTOR - 1);
+    for (auto& buf : Buffers)
+    {
+        buf.Mem = (uint8*)VirtualAlloc(nullptr, Capacity, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (!buf.Mem)
+            Fatal("Could not allocate %u MB of file write buffers\n", Capacity >> 20);
+        if (&buf != Buffers)
+            Free.Enqueue(&buf);
+    }
+    Sector = (uint8*)VirtualAlloc(nullptr, SECTOR, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+    Cur = Buffers;
+    Start(0);
+
+    WriterThread = new Thread(Bind(this, &FileWriter::WriterThreadFunc));
+}
+
+FileWriter::~FileWriter()
+{
+    // there's always room in the queue for the last buffer
+    if (Cur->End > Cur->Begin)
+    {
+        Size = Max(Size, Cur->Pos + Cur->End);
+        Pending.Enqueue(Cur);
+        PendingEvent.Fire();
+    }
+    delete WriterThread;
+
+    // unbuffered writes went up to the next sector, and preallocated space is still there
+    FILE_END_OF_FILE_INFO eof = {};
+    eof.EndOfFile.QuadPart = (LONGLONG)Size;
+    SetFileInformationByHandle(Handle, FileEndOfFileInfo, &eof, sizeof(eof));
+    FILE_ALLOCATION_INFO alloc = {};
+    alloc.AllocationSize.QuadPart = (LONGLONG)Size;
+    SetFileInformationByHandle(Handle, FileAllocationInfo, &alloc, sizeof(alloc));
+    CloseHandle(Handle);
+
+    for (auto& buf : Buffers)
+        VirtualFree(buf.Mem, 0, MEM_RELEASE);
+    VirtualFree(Sector, 0, MEM_RELEASE);
+}
+
+bool FileWriter::Write(const void* data, uint64 size)
+{
+    const uint8* src = (const uint8*)data;
+    while (size)
+    {
+        if (Cur->At == Capacity)
+        {
+            uint64 next = Cur->Pos + Capacity;
+            Submit();
+            Start(next);
+        }
+
+        uint n = (uint)Min<uint64>(size, Capacity - Cur->At);
+        memcpy(Cur->Mem + Cur->At, src, n);
+        Cur->At += n;
+        Cur->End = Max(Cur->End, Cur->At);
+        src += n;
+        size -= n;
+    }
+    return !Failed;
+}
+
+bool FileWriter::Seek(uint64 pos)
+{
+    // within what we've got in the buffer, just move the cursor
+    if (pos >= Cur->Pos + Cur->Begin && pos <= Cur->Pos + Cur->End)
+        Cur->At = (uint)(pos - Cur->Pos);
+    else
+    {
+        Submit();
+        Start(pos);
+    }
+    return !Failed;
+}
+
+void FileWriter::Flush()
+{
+    uint64 pos = Tell();
+    Submit();
+    Start(pos);
+}
+
+FileWriterStats FileWriter::GetStats() const
+{
+    double tps = (double)GetTicksPerSecond();
+    return
+    {
+        .Written = AtomicLoad(Written),
+        .BusyTime = AtomicLoad(BusyTicks) / tps,
+        .StallTime = AtomicLoad(StallTicks) / tps,
+    };
+}
+
+// hands the current buffer to the writer thread (if there's anything in it) and gets a free one
+void FileWriter::Submit()
+{
+    if (Cur->End == Cur->Begin)
+        return;
+
+    Size = Max(Size, Cur->Pos + Cur->End);
+    Pending.Enqueue(Cur);
+    PendingEvent.Fire();
+
+    int64 t0 = GetTicks();
+    bool stalled = false;
+    while (!Free.Dequeue(Cur))
+    {
+        FreeEvent.Wait(10);
+        stalled = true;
+    }
+    if (stalled)
+        AtomicStore(StallTicks, StallTicks + (uint64)(GetTicks() - t0));
+}
+
+void FileWriter::Start(uint64 pos)
+{
+    Cur->Pos = Unbuffered ? pos & ~(uint64)(SECTOR - 1) : pos;
+    Cur->Begin = Cur->End = Cur->At = (uint)(pos - Cur->Pos);
+}
+
+bool FileWriter::WriteBuffer(Buffer* buf)
+{
+    if (!Unbuffered)
+        return WriteAt(buf->Pos + buf->Begin, buf->Mem + buf->Begin, buf->End - buf->Begin);
+
+    // whole sectors only, so fill in around our data with what's on the disk already
+    uint end = (buf->End + SECTOR - 1) & ~(SECTOR - 1);
+    if (buf->Begin)
+    {
+        if (!ReadSector(buf->Pos, Sector))
+            return false;
+        memcpy(buf->Mem, Sector, buf->Begin);
+    }
+    if (buf->End < end)
+    {
+        uint last = end - SECTOR;
+        if (!ReadSector(buf->Pos + last, Sector))
+            return false;
+        memcpy(buf->Mem + buf->End, Sector + (buf->End - last), end - buf->End);
+    }
+
+    if (!WriteAt(buf->Pos, buf->Mem, end))
+        return false;
+    DiskEnd = Max(DiskEnd, buf->Pos + end);
+    return true;
+}
+
+bool FileWriter::WriteAt(uint64 pos, const void* data, uint size)
+{
+    OVERLAPPED ov = {};
+    ov.Offset = (DWORD)pos;
+    ov.OffsetHigh = (DWORD)(pos >> 32);
+
+    int64 t0 = GetTicks();
+    DWORD done = 0;
+    bool ok = WriteFile(Handle, data, size, &done, &ov) && done == size;
+    AtomicStore(BusyTicks, BusyTicks + (uint64)(GetTicks() - t0));
+
+    if (ok)
+        AtomicStore(Written, Written + size);
+    else
+        DPrintF("Writing %u bytes at %llu failed (%08x)\n", size, pos, GetLastError());
+    return ok;
+}
+
+bool FileWriter::ReadSector(uint64 pos, uint8* into)
+{
+    if (pos >= DiskEnd)
+    {
+        memset(into, 0, SECTOR);
+        return true;
+    }
+
+    OVERLAPPED ov = {};
+    ov.Offset = (DWORD)pos;
+    ov.OffsetHigh = (DWORD)(pos >> 32);
+    DWORD done = 0;
+    if (!ReadFile(Handle, into, SECTOR, &done, &ov))
+        return false;
+    memset(into + done, 0, SECTOR - done);
+    return true;
+}
+
+void FileWriter::WriterThreadFunc(Thread& thread)
+{
+    // keep going after being told to stop until everything's written
+    for (;;)
+    {
+        bool running = thread.IsRunning();
+        Buffer* buf;
+        if (!Pending.Dequeue(buf))
+        {
+            if (!running)
+                break;
+            PendingEvent.Wait(10);
+            continue;
+        }
+
+        // after an error, just hand the buffers back so nobody waits forever
+        if (!Failed && !WriteBuffer(buf))
+            Failed = true;
+
+        Free.Enqueue(buf);
+        FreeEvent.Fire();
+    }
+}
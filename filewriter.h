@@ -0,0 +1,92 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#pragma once
+
+#include "types.h"
+#include "system.h"
+
+struct FileWriterPara
+{
+    uint BufferSize = 8 << 20;  // bytes per buffer, gets rounded up to whole sectors
+    bool Unbuffered = false;    // bypass the OS file cache
+    uint64 Preallocate = 0;     // bytes to reserve on disk up front
+};
+
+struct FileWriterStats
+{
+    uint64 Written;     // bytes that went to the disk
+    double BusyTime;    // seconds spent writing
+    double StallTime;   // seconds Write() had to wait for a free buffer
+};
+
+// Writes a file through two big sector aligned buffers: one gets filled by the
+// caller while a writer thread puts the other one on disk. Seeking is allowed
+// (muxers like to patch headers at the end), but anything outside the current
+// buffer costs a flush. In unbuffered mode, partially written sectors get read
+// back and merged before writing, and the file gets cut to its real size at
+// the end.
+class FileWriter
+{
+public:
+    // returns nullptr if the file can't be created
+    static FileWriter* Create(const char* path, const FileWriterPara& para);
+
+    ~FileWriter();  // writes everything that's left and closes the file
+
+    // both return false if writing to the disk failed
+    bool Write(const void* data, uint64 size);
+    bool Seek(uint64 pos);
+
+    // hands what's in the buffer to the writer thread right away (doesn't wait for it)
+    void Flush();
+
+    uint64 Tell() const { return Cur->Pos + Cur->At; }
+    uint64 GetSize() const { return Max(Size, Cur->Pos + Cur->End); }
+    FileWriterStats GetStats() const;
+
+private:
+    static constexpr uint SECTOR = 4096;    // covers 512 byte and 4K disks
+    static constexpr int BUFFERS = 2;
+
+    struct Buffer
+    {
+        uint8* Mem;
+        uint64 Pos;     // file position of Mem[0]; sector aligned if unbuffered
+        uint Begin;     // valid bytes are Mem[Begin..End)
+        uint End;
+        uint At;        // write cursor
+    };
+
+    FileWriter(void* handle, const FileWriterPara& para);
+
+    void Submit();
+    void Start(uint64 pos);
+    bool WriteBuffer(Buffer* buf);
+    bool WriteAt(uint64 pos, const void* data, uint size);
+    bool ReadSector(uint64 pos, uint8* into);
+    void WriterThreadFunc(Thread& thread);
+
+    void* Handle;
+    bool Unbuffered;
+    uint Capacity = 0;      // bytes per buffer
+
+    Buffer Buffers[BUFFERS] = {};
+    Buffer* Cur = nullptr;
+    uint64 Size = 0;        // of everything submitted so far
+    uint8* Sector = nullptr;
+    uint64 DiskEnd = 0;     // how far the writer thread has written (whole sectors if unbuffered)
+
+    Queue<Buffer*, BUFFERS> Pending;
+    Queue<Buffer*, BUFFERS> Free;
+    ThreadEvent PendingEvent;
+    ThreadEvent FreeEvent;
+    Thread* WriterThread = nullptr;
+    volatile bool Failed = false;
+
+    uint64 Written = 0;
+    uint64 BusyTicks = 0;
+    uint64 StallTicks = 0;
+};
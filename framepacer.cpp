@@ -0,0 +1,104 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include "types.h"
+#include "framepacer.h"
+
+void FramePacer::Reset(uint rateNum, uint rateDen, double time)
+{
+    WaitFirst = true;
+    RateNum = rateNum;
+    RateDen = rateDen;
+    FrameDuration = (double)rateDen / rateNum;
+    LastFrameTime = time;
+    LastFrameCount = 0;
+    Duplicated = 0;
+    Over = 0;
+    FPS = 0;
+    Count = {};
+}
+
+FramePacer::Decision FramePacer::Frame(double time, uint64 frameCount)
+{
+    Decision d = {};
+
+    int deltaFrames = (int)(frameCount - LastFrameCount);
+    LastFrameCount = frameCount;
+    LastFrameTime = time;
+    Count.Frames++;
+
+    if (WaitFirst)
+    {
+        WaitFirst = false;
+        d.First = true;
+    }
+    else
+    {
+        // the refresh counter says how many frames have passed; whatever Idle()
+        // already duplicated counts against that
+        int dup = Max(1, deltaFrames) - 1 - Duplicated;
+
+        if (dup < 0)
+        {
+            Over -= dup;
+            dup = 0;
+        }
+        else
+        {
+            int doover = Min(dup, Over);
+            dup -= doover;
+            Over -= doover;
+            Count.Corrected += doover;
+        }
+
+        d.Duplicates = dup;
+        Count.Duplicated += dup;
+
+        if (deltaFrames)
+            UpdateFPS(deltaFrames);
+    }
+
+    d.Submit = deltaFrames != 0;
+    if (d.Submit)
+        Count.Submitted++;
+
+    Duplicated = 0;
+    return d;
+}
+
+uint FramePacer::Idle(double time)
+{
+    if (WaitFirst)
+        return 0;
+
+    // if more than a certain time has passed without a new image, assume a skipped frame
+    uint dups = 0;
+    while (time - LastFrameTime > 2.5 * FrameDuration)
+    {
+        if (Over)
+        {
+            Over--;
+            Count.Corrected++;
+        }
+        else
+        {
+            dups++;
+            Duplicated++;
+        }
+
+        LastFrameTime += FrameDuration;
+        UpdateFPS(Duplicated + 1.0);
+    }
+
+    Count.Duplicated += dups;
+    return dups;
+}
+
+void FramePacer::UpdateFPS(double frames)
+{
+    double curfps = (double)RateNum / ((double)RateDen * frames);
+    if (!FPS) FPS = curfps;
+    FPS += 0.03 * (curfps - FPS);
+}
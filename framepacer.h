@@ -0,0 +1,60 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#pragma once
+
+#include "types.h"
+
+// Decides how many times a captured frame has to be duplicated so the encoded
+// video keeps a constant frame rate, from the refresh counter of each present
+// and from how long nothing new has been presented.
+// Doesn't touch anything but its own state so it can be fed from traces, too.
+class FramePacer
+{
+public:
+    struct Decision
+    {
+        bool First;         // first frame since Reset(), start outputting from here
+        bool Submit;        // encode this frame (false if it's not a new refresh)
+        uint Duplicates;    // duplicate the last encoded frame this many times before
+    };
+
+    struct Counters
+    {
+        uint64 Frames;      // frames that went in
+        uint64 Submitted;
+        uint64 Duplicated;
+        uint64 Corrected;   // duplicates taken back because a late frame arrived after all
+    };
+
+    // start a new stream; time is that of the frame that triggered the (re)init
+    void Reset(uint rateNum, uint rateDen, double time);
+
+    // a frame was presented at refresh #frameCount
+    Decision Frame(double time, uint64 frameCount);
+
+    // nothing was presented, returns # of frames to duplicate now
+    uint Idle(double time);
+
+    // false until the first frame after Reset()
+    bool IsRunning() const { return !WaitFirst; }
+
+    double GetFPS() const { return FPS; }
+    const Counters& GetCounters() const { return Count; }
+
+private:
+    bool WaitFirst = true;
+    uint RateNum = 0;
+    uint RateDen = 1;
+    double FrameDuration = 0;
+    double LastFrameTime = 0;
+    uint64 LastFrameCount = 0;
+    int Duplicated = 0;     // # of duplicates since the last frame
+    int Over = 0;           // # of duplicates too many that need to be made up for
+    double FPS = 0;
+    Counters Count = {};
+
+    void UpdateFPS(double frames);
+};
@@ -0,0 +1,379 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "types.h"
+#include "system.h"
+#include "graphics.h"
+#include "framesource.h"
+
+//---------------------------------------------------------------------------
+// screen output via DXGI
+//---------------------------------------------------------------------------
+
+class FrameSource_DXGI : public IFrameSource
+{
+public:
+    bool AcquireFrame(int timeoutMs, CaptureInfo& info) override { return CaptureFrame(timeoutMs, info); }
+    void ReleaseFrame() override { ::ReleaseFrame(); }
+};
+
+IFrameSource* CreateFrameSourceDXGI() { return new FrameSource_DXGI(); }
+
+//---------------------------------------------------------------------------
+// CPU side frames, paced like a screen would
+//---------------------------------------------------------------------------
+
+static uint GetBytesPerPixel(PixelFormat fmt)
+{
+    switch (fmt)
+    {
+    case PixelFormat::BGRA8: case PixelFormat::RGB10A2: return 4;
+    case PixelFormat::RGBA16F: return 8;
+    default: Fatal("frame source: unsupported pixel format %d\n", (int)fmt);
+    }
+}
+
+static uint16 FloatToHalf(float f)
+{
+    union { float f; uint u; } v = { .f = f };
+    uint sign = (v.u >> 16) & 0x8000;
+    int exp = (int)((v.u >> 23) & 0xff) - 127 + 15;
+    uint mant = v.u & 0x7fffff;
+    if (exp <= 0) return (uint16)sign;
+    if (exp >= 31) return (uint16)(sign | 0x7c00);
+    return (uint16)(sign | (exp << 10) | ((mant + 0x1000) >> 13));
+}
+
+class FrameSource_CPU : public IFrameSource
+{
+protected:
+    FrameSourcePara Para;
+    Array<RCPtr<Buffer>> Frames;
+
+    int64 Freq = 0;
+    int64 StartTicks = 0;
+    double PeriodTicks = 0;
+    uint64 Refresh = 0;
+    uint64 Delivered = 0;
+
+    explicit FrameSource_CPU(const FrameSourcePara& para) : Para(para)
+    {
+        Freq = GetTicksPerSecond();
+        PeriodTicks = (double)Freq * Para.RateDen / Para.RateNum;
+    }
+
+    int64 RefreshTicks(uint64 n) const { return StartTicks + (int64)((double)n * PeriodTicks); }
+
+    bool Skipped(uint64 n) const { return Para.SkipEvery && (n % Para.SkipEvery) == Para.SkipEvery - 1; }
+
+public:
+    bool AcquireFrame(int timeoutMs, CaptureInfo& info) override
+    {
+        ASSERT(Frames.Len());
+
+        if (!StartTicks)
+            StartTicks = GetTicks();
+
+        uint64 next = Refresh + 1;
+        while (Skipped(next))
+            next++;
+
+        int64 time;
+        if (Para.Realtime)
+        {
+            // wait for the next refresh, like a screen would
+            int64 now = GetTicks();
+            int64 deadline = now + (int64)timeoutMs * Freq / 1000;
+            int64 due = RefreshTicks(next);
+            if (due > deadline)
+            {
+                if (timeoutMs > 0) Thread::Sleep(timeoutMs);
+                return false;
+            }
+
+            while ((now = GetTicks()) < due)
+                Thread::Sleep((due - now) * 1000 > 2 * Freq ? 1 : 0);
+
+            // if we fell behind, report the latest refresh and leave the gap to the consumer
+            uint64 latest = (uint64)((double)(now - StartTicks) / PeriodTicks);
+            if (latest > next)
+                next = latest;
+            while (Skipped(next))
+                next--;
+            if (next <= Refresh)
+            {
+                // the one we waited for, so it's not in the future either
+                next = Refresh + 1;
+                while (Skipped(next))
+                    next++;
+            }
+
+            time = RefreshTicks(next);
+        }
+        else
+            time = RefreshTicks(next);
+
+        Refresh = next;
+
+        auto& frame = Frames[Delivered++ % Frames.Len()];
+        info.tex.Clear();
+        info.data = ReadOnlySpan<uint8>(frame->Ptr(), frame->Len());
+        info.pitch = Para.SizeX * GetBytesPerPixel(Para.Format);
+        info.format = Para.Format;
+        info.sizeX = Para.SizeX;
+        info.sizeY = Para.SizeY;
+        info.isHdr = Para.Format == PixelFormat::RGBA16F;
+        info.rateNum = Para.RateNum;
+        info.rateDen = Para.RateDen;
+        info.frameCount = Refresh;
+        info.time = (double)time / (double)Freq;
+        info.presentTicks = time;
+        info.acquireTicks = GetTicks();
+        info.frameComp = 0;
+        info.allDirty = true;
+        info.dirty = ReadOnlySpan<DirtyRect>();
+        return true;
+    }
+
+    void ReleaseFrame() override {}
+};
+
+//---------------------------------------------------------------------------
+// synthetic test pattern
+//---------------------------------------------------------------------------
+
+class FrameSource_Synthetic : public FrameSource_CPU
+{
+    // where the moving box is
+    static DirtyRect Box(uint sx, uint sy, uint frame, uint frames)
+    {
+        uint box = sy / 8;
+        uint bx = (frame * (sx - box)) / Max(frames, 1u);
+        uint by = sy / 2 - box / 2;
+        return { bx, by, bx + box, by + box };
+    }
+
+    // color bars, a gradient, a box moving to the right and the frame number in binary
+    static Vec3 Pattern(uint x, uint y, uint sx, uint sy, uint frame, uint frames)
+    {
+        static const Vec3 bars[] = { {1,1,1}, {1,1,0}, {0,1,1}, {0,1,0}, {1,0,1}, {1,0,0}, {0,0,1}, {0,0,0} };
+
+        DirtyRect box = Box(sx, sy, frame, frames);
+        if (x >= box.x0 && x < box.x1 && y >= box.y0 && y < box.y1)
+            return Vec3(1, 0.5f, 0);
+
+        uint bit = x / Max(sy / 32, 1u);
+        if (y < sy / 32 && bit < 16)
+            return Vec3(((frame >> bit) & 1) ? 1.f : 0.f);
+
+        if (y >= 3 * sy / 4)
+            return Vec3((float)x / (float)(sx - 1));
+
+        return bars[(8 * x) / sx] * 0.75f;
+    }
+
+    Array<DirtyRect> Dirty;
+
+public:
+    explicit FrameSource_Synthetic(const FrameSourcePara& para) : FrameSource_CPU(para)
+    {
+        uint bpp = GetBytesPerPixel(Para.Format);
+        uint nframes = Max(Para.Variations, 1u);
+        for (uint f = 0; f < nframes; f++)
+        {
+            RCPtr<Buffer> frame = new Buffer((size_t)Para.SizeX * Para.SizeY * bpp);
+            for (uint y = 0; y < Para.SizeY; y++)
+            {
+                uint8* line = frame->Ptr() + (size_t)y * Para.SizeX * bpp;
+                for (uint x = 0; x < Para.SizeX; x++)
+                {
+                    Vec3 c = Pattern(x, y, Para.SizeX, Para.SizeY, f, nframes);
+                    switch (Para.Format)
+                    {
+                    case PixelFormat::BGRA8:
+                        ((uint*)line)[x] = (uint)(c.z * 255 + 0.5f) | ((uint)(c.y * 255 + 0.5f) << 8) | ((uint)(c.x * 255 + 0.5f) << 16) | 0xff000000u;
+                        break;
+                    case PixelFormat::RGB10A2:
+                        ((uint*)line)[x] = (uint)(c.x * 1023 + 0.5f) | ((uint)(c.y * 1023 + 0.5f) << 10) | ((uint)(c.z * 1023 + 0.5f) << 20) | 0xc0000000u;
+                        break;
+                    case PixelFormat::RGBA16F:
+                    {
+                        // scRGB, with the highlights going a bit over SDR white
+                        uint16* px = (uint16*)line + 4 * x;
+                        c = c * 2.5f;
+                        px[0] = FloatToHalf(c.x);
+                        px[1] = FloatToHalf(c.y);
+                        px[2] = FloatToHalf(c.z);
+                        px[3] = FloatToHalf(1);
+                        break;
+                    }
+                    }
+                }
+            }
+            Frames += frame;
+        }
+    }
+
+    bool AcquireFrame(int timeoutMs, CaptureInfo& info) override
+    {
+        if (!FrameSource_CPU::AcquireFrame(timeoutMs, info))
+            return false;
+
+        // the box moved, and the frame number changed. All of it for the first frame.
+        if (Para.DirtyRects && Delivered > 1)
+        {
+            uint frames = Frames.Len();
+            uint cur = (Delivered - 1) % frames;
+            uint last = (Delivered - 2) % frames;
+            Dirty.Clear();
+            if (cur != last)
+            {
+                uint sx = Para.SizeX, sy = Para.SizeY;
+                Dirty += Box(sx, sy, last, frames);
+                Dirty += Box(sx, sy, cur, frames);
+                Dirty += DirtyRect { 0, 0, Min(16 * Max(sy / 32, 1u), sx), sy / 32 };
+            }
+            info.allDirty = false;
+            info.dirty = ReadOnlySpan<DirtyRect>(Dirty.Ptr(), Dirty.Len());
+        }
+        return true;
+    }
+};
+
+IFrameSource* CreateFrameSourceSynthetic(const FrameSourcePara& para) { return new FrameSource_Synthetic(para); }
+
+//---------------------------------------------------------------------------
+// files: YUV4MPEG2 (8 bits, converted to BGRA8) or raw frames
+//---------------------------------------------------------------------------
+
+class FrameSource_File : public FrameSource_CPU
+{
+    static bool ReadAll(Stream* s, void* ptr, uint64 len)
+    {
+        uint64 done = 0, read;
+        while (done < len && (read = s->Read((uint8*)ptr + done, len - done)))
+            done += read;
+        return done == len;
+    }
+
+    static String ReadLine(Stream* s)
+    {
+        char line[1024];
+        int len = 0;
+        char c;
+        while (len < 1023 && s->Read(&c, 1) == 1 && c != '\n')
+            line[len++] = c;
+        line[len] = 0;
+        return line;
+    }
+
+    static uint8 Sat(float v) { return (uint8)Clamp(v + 0.5f, 0.f, 255.f); }
+
+    void LoadY4M(Stream* s)
+    {
+        String header = ReadLine(s);
+        if (strncmp(header, "YUV4MPEG2", 9))
+            Fatal("frame source: not a YUV4MPEG2 file\n");
+
+        uint cshiftX = 1, cshiftY = 1;
+        bool mono = false;
+        for (const char* p = header; *p; p++)
+        {
+            if (*p != ' ') continue;
+            p++;
+            switch (*p)
+            {
+            case 'W': Para.SizeX = (uint)atoi(p + 1); break;
+            case 'H': Para.SizeY = (uint)atoi(p + 1); break;
+            case 'F':
+                Para.RateNum = (uint)atoi(p + 1);
+                if (const char* d = strchr(p, ':')) Para.RateDen = (uint)atoi(d + 1);
+                break;
+            case 'C':
+                if (!strncmp(p + 1, "444", 3)) cshiftX = cshiftY = 0;
+                else if (!strncmp(p + 1, "422", 3)) cshiftY = 0;
+                else if (!strncmp(p + 1, "mono", 4)) mono = true;
+                if (const char* hb = strpbrk(p + 1, "p ")) if (*hb == 'p' && hb[1] >= '0' && hb[1] <= '9') // eg. C420p10
+                    Fatal("frame source: only 8 bit YUV4MPEG2 files are supported\n");
+                break;
+            }
+        }
+
+        ASSERT(Para.SizeX && Para.SizeY && Para.RateNum && Para.RateDen);
+        Para.Format = PixelFormat::BGRA8;
+        PeriodTicks = (double)Freq * Para.RateDen / Para.RateNum;
+
+        uint cx = (Para.SizeX + cshiftX) >> cshiftX;
+        uint cy = (Para.SizeY + cshiftY) >> cshiftY;
+        size_t ysize = (size_t)Para.SizeX * Para.SizeY;
+        size_t csize = mono ? 0 : (size_t)cx * cy;
+        Array<uint8> yuv;
+        yuv.SetSize(ysize + 2 * csize);
+
+        size_t frameSize = ysize * 4;
+        size_t budget = (size_t)Para.MaxMemoryMB << 20;
+        while ((Frames.Len() + 1) * frameSize <= budget || !Frames.Len())
+        {
+            String fh = ReadLine(s);
+            if (strncmp(fh, "FRAME", 5) || !ReadAll(s, yuv.Ptr(), yuv.Len()))
+                break;
+
+            // Rec.709 limited range to RGB
+            RCPtr<Buffer> frame = new Buffer(frameSize);
+            for (uint y = 0; y < Para.SizeY; y++)
+            {
+                const uint8* yl = yuv.Ptr() + (size_t)y * Para.SizeX;
+                const uint8* ul = yuv.Ptr() + ysize + (size_t)(y >> cshiftY) * cx;
+                const uint8* vl = ul + csize;
+                uint* out = (uint*)(frame->Ptr() + (size_t)y * Para.SizeX * 4);
+                for (uint x = 0; x < Para.SizeX; x++)
+                {
+                    float Y = 1.164f * (yl[x] - 16.f);
+                    float U = mono ? 0 : ul[x >> cshiftX] - 128.f;
+                    float V = mono ? 0 : vl[x >> cshiftX] - 128.f;
+                    out[x] = Sat(Y + 2.112f * U) | (Sat(Y - 0.213f * U - 0.533f * V) << 8) | (Sat(Y + 1.793f * V) << 16) | 0xff000000u;
+                }
+            }
+            Frames += frame;
+        }
+    }
+
+    void LoadRaw(Stream* s)
+    {
+        size_t frameSize = (size_t)Para.SizeX * Para.SizeY * GetBytesPerPixel(Para.Format);
+        size_t budget = (size_t)Para.MaxMemoryMB << 20;
+        while ((Frames.Len() + 1) * frameSize <= budget || !Frames.Len())
+        {
+            RCPtr<Buffer> frame = new Buffer(frameSize);
+            if (!ReadAll(s, frame->Ptr(), frameSize))
+                break;
+            Frames += frame;
+        }
+    }
+
+public:
+    FrameSource_File(const char* filename, const FrameSourcePara& para) : FrameSource_CPU(para)
+    {
+        Stream* s = OpenFile(filename);
+
+        size_t len = strlen(filename);
+        if (len > 4 && !_stricmp(filename + len - 4, ".y4m"))
+            LoadY4M(s);
+        else
+            LoadRaw(s);
+
+        delete s;
+
+        if (!Frames.Len())
+            Fatal("frame source: %s doesn't contain a single complete frame\n", filename);
+        DPrintF("frame source: %d frames of %dx%d from %s\n", (int)Frames.Len(), Para.SizeX, Para.SizeY, filename);
+    }
+};
+
+IFrameSource* CreateFrameSourceFile(const char* filename, const FrameSourcePara& para) { return new FrameSource_File(filename, para); }
@@ -0,0 +1,40 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#pragma once
+
+#include "types.h"
+#include "graphics.h"
+
+// Source of frames for ScreenCapture. The default one duplicates a screen output
+// via DXGI, the others produce frames on the CPU (CaptureInfo::data) so the
+// rest of the pipeline can be run and benchmarked without a screen.
+class IFrameSource
+{
+public:
+    virtual ~IFrameSource() {}
+
+    // get next frame, returns false on timeout. Call ReleaseFrame() when done with it.
+    virtual bool AcquireFrame(int timeoutMs, CaptureInfo& info) = 0;
+    virtual void ReleaseFrame() = 0;
+};
+
+struct FrameSourcePara
+{
+    uint SizeX = 1920;                          // synthetic and raw files only
+    uint SizeY = 1080;
+    PixelFormat Format = PixelFormat::BGRA8;    // synthetic and raw files: BGRA8, RGB10A2 or RGBA16F (=HDR)
+    uint RateNum = 60;                          // refresh rate (Y4M files bring their own)
+    uint RateDen = 1;
+    bool Realtime = true;                       // present at the refresh rate, or as fast as frames get consumed
+    uint SkipEvery = 0;                         // leave out every nth present to provoke duplicates (0: never)
+    uint Variations = 8;                        // synthetic: number of different frames to cycle through
+    bool DirtyRects = false;                    // synthetic: say which parts changed from one frame to the next, like DXGI does
+    uint MaxMemoryMB = 2048;                    // files: stop preloading frames after this much memory
+};
+
+IFrameSource* CreateFrameSourceDXGI();
+IFrameSource* CreateFrameSourceSynthetic(const FrameSourcePara& para);
+IFrameSource* CreateFrameSourceFile(const char* filename, const FrameSourcePara& para); // .y4m or raw
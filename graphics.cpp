@@ -11,10 +11,12 @@
 // Windows Header Files
 #include <windows.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "system.h"
 #include "graphics.h"
 #include "math3d.h"
+#include "refreshclock.h"
 
 // from system.cpp
 //static HWND hWnd;
@@ -66,7 +68,7 @@ D3D_FEATURE_LEVEL FeatureLevel;
 
 RCPtr<ID3D11SamplerState> SmplWrap;
 
-static double captureFrameCount = 0;
+static RefreshClock refreshClock;
 static int64 lastFrameTime = 0;
 
 static DXGI_FORMAT GetDXGIFormat(PixelFormat fmt)
@@ -345,6 +347,7 @@ struct GpuBuffer::Priv
     Usage usage;
     GpuBuffer* gb;
     RCPtr<ID3D11Buffer> buf;
+    RCPtr<ID3D11Buffer> staging; // for reading back
     SR sr;
 
     operator ID3D11Buffer* () { if (!buf) gb->Commit(); return buf; }
@@ -377,7 +380,7 @@ struct GpuBuffer::Priv
 GpuBuffer::GpuBuffer(Type type, Usage usage) { P = new Priv(this, type, usage); }
 GpuBuffer::~GpuBuffer() { delete P; }
 
-void GpuBuffer::Reset() { P->buf.Clear(); }
+void GpuBuffer::Reset() { P->buf.Clear(); P->staging.Clear(); }
 
 void GpuBuffer::Upload(const void* data, uint size, uint stride, uint totalsize)
 {
@@ -439,6 +442,31 @@ ShaderResource::SR& GpuBuffer::GetSR(bool write, uint count)
 
 RCPtr<ID3D11Buffer> GpuBuffer::GetBuffer() const { return P->buf; }
 
+void ReadBuffer(GpuBuffer* buffer, Span<uint8> into)
+{
+    auto& p = *buffer->P;
+    ID3D11Buffer* buf = p;
+
+    D3D11_BUFFER_DESC desc;
+    buf->GetDesc(&desc);
+    if (!p.staging)
+    {
+        desc.Usage = D3D11_USAGE_STAGING;
+        desc.BindFlags = 0;
+        desc.MiscFlags = 0;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+        desc.StructureByteStride = 0;
+        DXERR(Dev->CreateBuffer(&desc, nullptr, p.staging));
+    }
+
+    Ctx->CopyResource(p.staging, buf);
+
+    D3D11_MAPPED_SUBRESOURCE map;
+    DXERR(Ctx->Map(p.staging, 0, D3D11_MAP_READ, 0, &map));
+    memcpy(into.Ptr(), map.pData, Min<size_t>(into.Len(), desc.ByteWidth));
+    Ctx->Unmap(p.staging, 0);
+}
+
 template<typename T> uint MakeLayout(D3D11_INPUT_ELEMENT_DESC* desc);
 
 static constexpr D3D11_INPUT_ELEMENT_DESC MakeVBDesc(const char* semantic, uint index, DXGI_FORMAT format, uint offset, uint slot = 0)
@@ -762,7 +790,7 @@ RCPtr<Texture> CreateTexture(const TexturePara& para, const void* data)
         .ArraySize = 1,
         .Format = GetDXGIFormat(para.format),
         .SampleDesc = { .Count = 1 },
-        .Usage = D3D11_USAGE_IMMUTABLE,
+        .Usage = data ? D3D11_USAGE_IMMUTABLE : D3D11_USAGE_DEFAULT,
         .BindFlags = D3D11_BIND_SHADER_RESOURCE,
     };
 
@@ -771,10 +799,15 @@ RCPtr<Texture> CreateTexture(const TexturePara& para, const void* data)
         .pSysMem = data,
         .SysMemPitch = para.sizeX * GetBitsPerPixel(para.format) / 8,
     };
-    DXERR(Dev->CreateTexture2D(&tdesc, &id, tex->P->tex));
+    DXERR(Dev->CreateTexture2D(&tdesc, data ? &id : nullptr, tex->P->tex));
     return tex;
 }
 
+void UpdateTexture(Texture* tex, const void* data, uint pitch)
+{
+    Ctx->UpdateSubresource(tex->P->tex, 0, nullptr, data, pitch, 0);
+}
+
 static Array<Texture::Priv> RTPool;
 static Array<Texture::Priv> lastRTPool;
 
@@ -883,7 +916,8 @@ void InitD3D(int outputIndex)
 {
     timeBeginPeriod(1);
 
-    Output = AllOutputs[outputIndex];
+    // no outputs (eg. on a headless build box): we can still convert frames from other sources
+    Output = (size_t)outputIndex < AllOutputs.Len() ? AllOutputs[outputIndex] : OutputDef{};
    
     // create device and upgrade
     const D3D_FEATURE_LEVEL levels[] = { D3D_FEATURE_LEVEL_12_1, D3D_FEATURE_LEVEL_12_0, D3D_FEATURE_LEVEL_11_1, D3D_FEATURE_LEVEL_11_0 };
@@ -893,11 +927,14 @@ void InitD3D(int outputIndex)
  #endif
     RCPtr<ID3D11Device> dev0;
     RCPtr<ID3D11DeviceContext> ctx0;
-    DXERR(D3D11CreateDevice(Output.Adapter, Output.Adapter.IsValid() ? D3D_DRIVER_TYPE_UNKNOWN : D3D_DRIVER_TYPE_HARDWARE , NULL, flags, levels, _countof(levels), D3D11_SDK_VERSION, dev0, &FeatureLevel, ctx0));
+    HRESULT hr = D3D11CreateDevice(Output.Adapter, Output.Adapter.IsValid() ? D3D_DRIVER_TYPE_UNKNOWN : D3D_DRIVER_TYPE_HARDWARE, NULL, flags, levels, _countof(levels), D3D11_SDK_VERSION, dev0, &FeatureLevel, ctx0);
+    if (FAILED(hr) && !Output.Adapter.IsValid())
+        hr = D3D11CreateDevice(NULL, D3D_DRIVER_TYPE_WARP, NULL, flags, levels, _countof(levels), D3D11_SDK_VERSION, dev0, &FeatureLevel, ctx0);
+    DXERR(hr);
     Dev = dev0;
     Ctx = ctx0;
 
-    captureFrameCount = 0;
+    refreshClock = RefreshClock();
     lastFrameTime = 0;
     
     /*
@@ -956,7 +993,9 @@ RCPtr<IDXGIAdapter> GetAdapter() { return Output.Adapter; }
 static RCPtr<Texture> capTex;
 static DXGI_OUTPUT_DESC1 outdesc;
 static DXGI_OUTDUPL_DESC odd;
-static double totalError = 0;
+static Array<uint8> metaData;         // move and dirty rects from DXGI
+static Array<DirtyRect> dirtyRects;
+static bool dirtyLost = true;         // a frame got thrown away, so the next one can't say what changed
 
 static const DXGI_FORMAT scanoutFormats[] = {
     DXGI_FORMAT_R16G16B16A16_UINT,
@@ -987,7 +1026,7 @@ bool CaptureFrame(int timeoutMs, CaptureInfo& ci)
 
         Dupl->GetDesc(&odd);
         Output.Output->GetDesc1(&outdesc);
-        totalError = 0;
+        refreshClock.Reset((double)odd.ModeDesc.RefreshRate.Denominator / (double)odd.ModeDesc.RefreshRate.Numerator);
         //printf("new dupl %dx%d @ %d:%d\n", odd.ModeDesc.Width, odd.ModeDesc.Height, odd.ModeDesc.RefreshRate.Numerator, odd.ModeDesc.RefreshRate.Denominator);
     }
 
@@ -1007,6 +1046,7 @@ bool CaptureFrame(int timeoutMs, CaptureInfo& ci)
         if (hr == DXGI_ERROR_ACCESS_LOST || hr == DXGI_ERROR_INVALID_CALL)
         {
             DPrintF("Lost display interface!\n");
+            dirtyLost = true;
             // we lost the interface or it has somehow become invalid, bail and try again next time
             capTex.Clear();
             Dupl.Clear();
@@ -1046,44 +1086,73 @@ bool CaptureFrame(int timeoutMs, CaptureInfo& ci)
     if (delta < 0)
     {
         DPrintF("Negative delta!\n");
+        dirtyLost = true;
         ReleaseFrame();
         return false;
     }
 
-    double fdelta = delta * odd.ModeDesc.RefreshRate.Numerator / odd.ModeDesc.RefreshRate.Denominator;
-    double fdi = round(fdelta);
-    double error = fdelta - fdi;
-    totalError += error;
-    int comp = 0;
-    if (totalError >= 0.75)
-    {
-        comp = 1;
-        totalError -= 1;
-    }
-    if (totalError <= -0.75)
-    {
-        comp = -1;
-        totalError += 1;
-    }
-    captureFrameCount += fdi + comp;
+    uint64 frameCount = refreshClock.Update((double)info.LastPresentTime.QuadPart / (double)qpf.QuadPart);
+    int comp = refreshClock.GetCorrection();
 
-    DPrintF("fd %.3f (%.3f, total %.3f) comp %d\n", fdi, error, totalError, comp);
+    DPrintF("fc %llu (phase %.3f, period %.4fms) comp %d\n", frameCount, refreshClock.GetPhaseError(), 1000 * refreshClock.GetPeriod(), comp);
 
     // create/invalidate texture object
     RCPtr<ID3D11Texture2D> tex = frame;
     if (tex.IsValid() && capTex.IsValid() && (ID3D11Texture2D*)tex != (ID3D11Texture2D*)capTex->P->tex)
         capTex.Clear();
     if (!capTex.IsValid())
+    {
         capTex = CreateTexture(tex);
+        dirtyLost = true;
+    }
+
+    // what changed since the last frame: the destinations of moved parts, and the dirty rects.
+    // Those are in the unrotated desktop, so on rotated screens everything counts as changed.
+    bool allDirty = dirtyLost || odd.Rotation != DXGI_MODE_ROTATION_IDENTITY;
+    dirtyRects.Clear();
+    if (!allDirty && info.TotalMetadataBufferSize)
+    {
+        metaData.SetSize(info.TotalMetadataBufferSize);
+        UINT size = 0;
+        if (SUCCEEDED(Dupl->GetFrameMoveRects((UINT)metaData.Len(), (DXGI_OUTDUPL_MOVE_RECT*)metaData.Ptr(), &size)))
+        {
+            auto moves = (const DXGI_OUTDUPL_MOVE_RECT*)metaData.Ptr();
+            for (uint i = 0; i < size / sizeof(DXGI_OUTDUPL_MOVE_RECT); i++)
+            {
+                const RECT& r = moves[i].DestinationRect;
+                dirtyRects += DirtyRect { (uint)r.left, (uint)r.top, (uint)r.right, (uint)r.bottom };
+            }
+        }
+        else
+            allDirty = true;
+
+        if (SUCCEEDED(Dupl->GetFrameDirtyRects((UINT)metaData.Len(), (RECT*)metaData.Ptr(), &size)))
+        {
+            auto rects = (const RECT*)metaData.Ptr();
+            for (uint i = 0; i < size / sizeof(RECT); i++)
+                dirtyRects += DirtyRect { (uint)rects[i].left, (uint)rects[i].top, (uint)rects[i].right, (uint)rects[i].bottom };
+        }
+        else
+            allDirty = true;
+    }
+    dirtyLost = false;
 
     ci.tex = capTex;
+    ci.data = {};
+    ci.pitch = 0;
+    ci.format = capTex->para.format;
     ci.sizeX = ci.tex->para.sizeX;
     ci.sizeY = ci.tex->para.sizeY;
     ci.isHdr = (outdesc.ColorSpace == DXGI_COLOR_SPACE_RGB_FULL_G2084_NONE_P2020);
     ci.rateNum = odd.ModeDesc.RefreshRate.Numerator;
     ci.rateDen = odd.ModeDesc.RefreshRate.Denominator;
-    ci.frameCount = (uint64)round(captureFrameCount);
+    ci.frameCount = frameCount;
     ci.time = (double)info.LastPresentTime.QuadPart / (double)qpf.QuadPart;
+    ci.presentTicks = info.LastPresentTime.QuadPart;
+    ci.acquireTicks = t2.QuadPart;
+    ci.frameComp = comp;
+    ci.allDirty = allDirty;
+    ci.dirty = ReadOnlySpan<DirtyRect>(dirtyRects.Ptr(), dirtyRects.Len());
     return true;
 }
 
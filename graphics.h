@@ -289,9 +289,18 @@ public:
 // screen capturing
 //---------------------------------------------------------------------------
 
+// part of a captured frame, in pixels, x1/y1 exclusive
+struct DirtyRect
+{
+    uint x0, y0, x1, y1;
+};
+
 struct CaptureInfo
 {
-    RCPtr<Texture> tex;
+    RCPtr<Texture> tex;         // captured image on the GPU, or...
+    ReadOnlySpan<uint8> data;   // ... on the CPU (if tex isn't set)
+    uint pitch;                 // bytes per line for CPU data
+    PixelFormat format;
     uint sizeX;
     uint sizeY;
     bool isHdr;
@@ -299,6 +308,11 @@ struct CaptureInfo
     uint rateDen;
     uint64 frameCount;
     double time;
+    int64 presentTicks;         // raw timer ticks of the present
+    int64 acquireTicks;         // raw timer ticks when we got hold of the frame
+    int frameComp;              // correction that went into frameCount for this frame
+    bool allDirty;              // anything might have changed since the last frame, or...
+    ReadOnlySpan<DirtyRect> dirty; // ... only these parts (none: the frame is the same as the last one)
 };
 
 bool CaptureFrame(int timeoutMs, CaptureInfo &info);
@@ -317,7 +331,9 @@ void ExitD3D();
 RCPtr<IDXGIAdapter> GetAdapter();
 
 RCPtr<Texture> LoadImg(const char *filename);
-RCPtr<Texture> CreateTexture(const TexturePara& para, const void* data);
+RCPtr<Texture> CreateTexture(const TexturePara& para, const void* data); // data==nullptr: updatable texture
+void UpdateTexture(Texture* tex, const void* data, uint pitch);
+void ReadBuffer(GpuBuffer* buffer, Span<uint8> into); // waits for the GPU to finish writing it
 
 struct ShaderDefine
 {
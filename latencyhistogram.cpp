@@ -0,0 +1,77 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include <math.h>
+
+#include "types.h"
+#include "latencyhistogram.h"
+
+uint LatencyHistogram::GetBucket(uint64 us)
+{
+    if (us < SUB)
+        return (uint)us;
+
+    uint top = SUB_BITS;
+    while (top < MAX_BITS && (us >> (top + 1)))
+        top++;
+    if (top >= MAX_BITS)
+        return BUCKETS - 1;
+
+    // which power of two, and where in it
+    return (top - SUB_BITS + 1) * SUB + (uint)((us >> (top - SUB_BITS)) & (SUB - 1));
+}
+
+uint64 LatencyHistogram::GetBucketMax(uint bucket)
+{
+    if (bucket < SUB)
+        return bucket;
+
+    uint shift = bucket / SUB - 1;
+    return ((uint64)(SUB + bucket % SUB + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Reset()
+{
+    for (uint i = 0; i < BUCKETS; i++)
+        AtomicStore(Counts[i], 0);
+    AtomicStore(Count, 0);
+    AtomicStore(Highest, 0);
+}
+
+void LatencyHistogram::Add(uint64 us)
+{
+    uint& c = Counts[GetBucket(us)];
+    AtomicStore(c, c + 1);
+    if (us > Highest)
+        AtomicStore(Highest, us);
+    AtomicStore(Count, Count + 1);
+}
+
+LatencyHistogram::Summary LatencyHistogram::GetSummary() const
+{
+    // take a copy first, so all percentiles come from the same counts
+    uint counts[BUCKETS];
+    uint64 total = 0;
+    for (uint i = 0; i < BUCKETS; i++)
+        total += counts[i] = AtomicLoad(Counts[i]);
+
+    Summary s = { .Count = total, .Max = AtomicLoad(Highest) };
+    if (!total)
+        return s;
+
+    static constexpr double percentiles[] = { 0.5, 0.99, 0.999 };
+    uint64* results[] = { &s.P50, &s.P99, &s.P999 };
+
+    uint64 sum = 0;
+    uint bucket = 0;
+    for (int p = 0; p < 3; p++)
+    {
+        uint64 rank = Max<uint64>((uint64)ceil(percentiles[p] * (double)total), 1);
+        while (sum + counts[bucket] < rank)
+            sum += counts[bucket++];
+        *results[p] = Min(GetBucketMax(bucket), s.Max);
+    }
+    return s;
+}
@@ -0,0 +1,42 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#pragma once
+
+#include "types.h"
+
+// Log-linear histogram of latencies in microseconds, HdrHistogram style: every
+// power of two is split into SUB linear buckets, so each value is known to within
+// 1/SUB over the whole range from 1us to a bit over two minutes, in fixed memory.
+// One writer, any number of readers that never block it. A reader might catch a
+// sample half added, which doesn't matter for percentiles.
+class LatencyHistogram
+{
+public:
+    static constexpr uint SUB_BITS = 4;
+    static constexpr uint SUB = 1 << SUB_BITS;
+    static constexpr uint MAX_BITS = 27;
+    static constexpr uint BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB;
+
+    struct Summary
+    {
+        uint64 Count;
+        uint64 P50, P99, P999, Max;     // in microseconds
+    };
+
+    // writer side
+    void Reset();
+    void Add(uint64 us);
+
+    Summary GetSummary() const;
+
+    static uint GetBucket(uint64 us);
+    static uint64 GetBucketMax(uint bucket);   // largest value that ends up in bucket
+
+private:
+    uint Counts[BUCKETS] = {};
+    uint64 Count = 0;
+    uint64 Highest = 0;
+};
@@ -9,15 +9,39 @@
 #include "audiocapture.h"
 
 struct CaptureConfig;
+struct PacketInfo;
+
+struct OutputStats
+{
+    // mux buffer (see CreateOutputAsync)
+    uint64 Capacity;    // bytes
+    uint64 Queued;      // bytes waiting to be written
+    uint64 HighWater;   // most bytes that were ever waiting
+    uint Dropped;       // video packets that didn't fit, or came after one that didn't
+    uint Stalls;        // times the caller had to wait for space
+
+    // file writer
+    uint64 DiskWritten; // bytes
+    double DiskBusy;    // seconds spent writing
+    double DiskStall;   // seconds the muxer waited for the disk
+
+    // replay buffer
+    uint64 ReplayBytes; // in the buffer
+    double ReplayLength;// seconds in the buffer
+    uint ReplaysSaved;
+};
 
 class IOutput
 {
 public:
     virtual ~IOutput() {}
 
-    virtual void SubmitVideoPacket(const uint8* data, uint size) = 0;
+    virtual void SubmitVideoPacket(const uint8* data, uint size, const PacketInfo& info) = 0;
 
     virtual void SubmitAudio(const uint8* data, uint size) = 0;
+
+    // for outputs that buffer what they write
+    virtual OutputStats GetStats() { return {}; }
 };
 
 struct OutputPara
@@ -28,10 +52,81 @@ struct OutputPara
     uint RateNum;
     uint RateDen;
     bool Hdr;
+    bool Vfr;           // packets go where their capture times say instead of one frame after the other
 
     AudioInfo Audio;
+    ReadOnlySpan<uint8> Header; // codec extradata from the encoder; if empty, it's taken from the first packet
 
     const CaptureConfig* CConfig;
 };
 
+// Where the video packets of a file go on its time line, in units of TimeBaseNum/TimeBaseDen
+// seconds: frames at the nominal rate (a packet can come a few frames after the last one, see
+// PacketInfo::Skipped), or microseconds since the first packet with para.Vfr.
+class VideoClock
+{
+public:
+    uint TimeBaseNum = 1, TimeBaseDen = 1;
+
+    void Init(const OutputPara& para)
+    {
+        Vfr = para.Vfr;
+        SampleRate = para.Audio.SampleRate;
+        TimeBaseNum = Vfr ? 1 : para.RateDen;
+        TimeBaseDen = Vfr ? 1000000 : para.RateNum;
+        FrameLength = Vfr ? Max<int64>(1000000ll * para.RateDen / para.RateNum, 1) : 1;
+    }
+
+    // call for every packet, in order, with its capture time and PacketInfo::Skipped. Returns where it starts.
+    int64 Next(double time, uint skipped)
+    {
+        if (!Frames++)
+            FirstTime = time;
+        int64 pos = Vfr ? (int64)((time - FirstTime) * TimeBaseDen + 0.5) : Last + 1 + skipped;
+        Last = Frames > 1 ? Max(pos, Last + 1) : 0;
+        return Last;
+    }
+
+    uint64 GetFrames() const { return Frames; }
+    int64 GetFrameLength() const { return FrameLength; }
+
+    // where the packets so far end
+    int64 GetEnd() const { return Frames ? Last + FrameLength : 0; }
+
+    // the earliest the next packet can start. Before GetEnd() with para.Vfr, as frames can come quicker than the nominal rate
+    int64 GetNextMin() const { return Frames ? Last + 1 : 0; }
+
+    int64 FromSeconds(double seconds) const { return (int64)(seconds * TimeBaseDen / TimeBaseNum + 0.5); }
+    double ToSeconds(int64 pos) const { return (double)pos * TimeBaseNum / TimeBaseDen; }
+
+    // first audio sample at or after pos, if the audio starts with the first packet
+    uint64 ToSample(int64 pos) const { return (uint64)pos * SampleRate * TimeBaseNum / TimeBaseDen; }
+
+private:
+    bool Vfr = false;
+    uint SampleRate = 0;
+    int64 FrameLength = 1;
+    uint64 Frames = 0;
+    double FirstTime = 0;
+    int64 Last = 0;
+};
+
 IOutput* CreateOutputLibAV(const OutputPara &para);
+IOutput* CreateOutputNull(const OutputPara &para);
+
+// libav output that starts a new file every cfg.SegmentMinutes / cfg.SegmentMB
+IOutput* CreateOutputSegment(const OutputPara &para);
+
+// writes on its own thread, through a buffer of cfg.MuxBufferMB. Takes ownership of output
+IOutput* CreateOutputAsync(IOutput* output, const CaptureConfig& cfg);
+
+class IReplayOutput : public IOutput
+{
+public:
+    // writes what's in the buffer into a file in the background. Returns false if
+    // there's nothing to write yet or the last save is still going
+    virtual bool Save(const String& filename) = 0;
+};
+
+// keeps the last cfg.ReplaySeconds in memory (in at most cfg.ReplayMB) instead of writing a file
+IReplayOutput* CreateOutputReplay(const OutputPara& para);
@@ -0,0 +1,209 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include <string.h>
+
+#include "system.h"
+#include "screencapture.h"
+#include "output.h"
+#include "encode.h"
+
+// Runs another output on its own thread, so a slow disk doesn't hold up the
+// encoder. Packets get copied into a fixed size ring buffer that the mux thread
+// empties; what happens if it runs full is up to the config (wait or drop).
+// Dropping only ever drops video, from the packet that didn't fit until the next
+// keyframe, and the frames in between count as the last one staying on screen.
+class Output_Async : public IOutput
+{
+    enum class Kind : uint { Video, Audio, Wrap };
+
+    struct Header
+    {
+        Kind kind;
+        uint size;
+        PacketInfo info;    // video only
+    };
+
+    IOutput* Output;
+    MuxOverflow Overflow;
+    ThreadLock OutputLock;      // for packets too big for the ring, which go around it
+
+    uint8* Ring = nullptr;
+    uint64 Capacity = 0;
+    uint64 WritePos = 0;        // both only ever increase, the ring offset is pos % Capacity
+    uint64 ReadPos = 0;
+    ThreadEvent DataEvent;
+    ThreadEvent SpaceEvent;
+    Thread* MuxThread = nullptr;
+
+    OutputStats QStats = {};
+    bool DropToKeyframe = false;    // the frames after a dropped one can't be decoded without it
+    uint DroppedFrames = 0;         // frame times since the last video packet that made it
+
+    void DropFrame(const PacketInfo& info)
+    {
+        QStats.Dropped++;
+        DroppedFrames += 1 + info.Skipped;
+        DropToKeyframe = true;
+    }
+
+    void KeepFrame()
+    {
+        DroppedFrames = 0;
+        DropToKeyframe = false;
+    }
+
+    static uint64 Align(uint64 x) { return (x + 7) & ~7ull; }
+
+    void Push(Kind kind, const uint8* data, uint size, const PacketInfo& info = {})
+    {
+        bool video = kind == Kind::Video;
+        if (video && DropToKeyframe && !info.Keyframe)
+        {
+            DropFrame(info);
+            return;
+        }
+
+        // what got dropped before, the last frame that made it stays on for
+        PacketInfo pinfo = info;
+        if (video)
+            pinfo.Skipped += DroppedFrames;
+
+        uint64 need = sizeof(Header) + Align(size);
+        if (need > Capacity)
+        {
+            // wait until everything before it is written, then do it ourselves
+            while (AtomicLoad(ReadPos) != WritePos)
+                SpaceEvent.Wait(10);
+            ScopeLock lock(OutputLock);
+            Submit(kind, data, size, pinfo);
+            if (video)
+                KeepFrame();
+            return;
+        }
+
+        bool stalled = false;
+        for (;;)
+        {
+            uint64 w = WritePos;
+            uint64 used = w - AtomicLoad(ReadPos);
+            uint64 offset = w % Capacity;
+
+            if (offset + need > Capacity)
+            {
+                // doesn't fit before the end, so skip the rest and start over at the beginning
+                uint64 pad = Capacity - offset;
+                if (used + pad <= Capacity)
+                {
+                    *(Header*)(Ring + offset) = { .kind = Kind::Wrap };
+                    AtomicStore(WritePos, w + pad);
+                    DataEvent.Fire();
+                    continue;
+                }
+            }
+            else if (used + need <= Capacity)
+            {
+                *(Header*)(Ring + offset) = { .kind = kind, .size = size, .info = pinfo };
+                memcpy(Ring + offset + sizeof(Header), data, size);
+                AtomicStore(WritePos, w + need);
+                DataEvent.Fire();
+
+                QStats.HighWater = Max(QStats.HighWater, used + need);
+                if (video)
+                    KeepFrame();
+                return;
+            }
+
+            // audio that's missing would shift everything after it, so that always waits
+            if (Overflow == MuxOverflow::Drop && video)
+            {
+                DropFrame(info);
+                return;
+            }
+
+            if (!stalled)
+                QStats.Stalls++;
+            stalled = true;
+            SpaceEvent.Wait(10);
+        }
+    }
+
+    void Submit(Kind kind, const uint8* data, uint size, const PacketInfo& info)
+    {
+        if (kind == Kind::Video)
+            Output->SubmitVideoPacket(data, size, info);
+        else
+            Output->SubmitAudio(data, size);
+    }
+
+    void MuxThreadFunc(Thread& thread)
+    {
+        // keep going after being told to stop until everything's written
+        for (;;)
+        {
+            // look at the stop flag first, so nothing that came in before it gets left behind
+            bool running = thread.IsRunning();
+            uint64 r = ReadPos;
+            if (r == AtomicLoad(WritePos))
+            {
+                if (!running)
+                    break;
+                DataEvent.Wait(10);
+                continue;
+            }
+
+            uint64 offset = r % Capacity;
+            Header h = *(const Header*)(Ring + offset);
+            if (h.kind == Kind::Wrap)
+                r += Capacity - offset;
+            else
+            {
+                ScopeLock lock(OutputLock);
+                Submit(h.kind, Ring + offset + sizeof(Header), h.size, h.info);
+                r += sizeof(Header) + Align(h.size);
+            }
+
+            AtomicStore(ReadPos, r);
+            SpaceEvent.Fire();
+        }
+    }
+
+public:
+    Output_Async(IOutput* output, const CaptureConfig& cfg) : Output(output), Overflow(cfg.OnMuxOverflow)
+    {
+        Capacity = Align((uint64)Max(cfg.MuxBufferMB, 1u) << 20);
+        Ring = new uint8[Capacity + sizeof(Header)];  // a Wrap header can start right before the end
+        QStats.Capacity = Capacity;
+        MuxThread = new Thread(Bind(this, &Output_Async::MuxThreadFunc));
+    }
+
+    ~Output_Async()
+    {
+        delete MuxThread;
+        delete Output;
+        delete[] Ring;
+    }
+
+    void SubmitVideoPacket(const uint8* data, uint size, const PacketInfo& info) override { Push(Kind::Video, data, size, info); }
+    void SubmitAudio(const uint8* data, uint size) override { Push(Kind::Audio, data, size); }
+
+    OutputStats GetStats() override
+    {
+        // the output can change its insides while writing (eg. open a new file), so not at the same time
+        OutputStats stats;
+        {
+            ScopeLock lock(OutputLock);
+            stats = Output->GetStats();
+        }
+        stats.Capacity = QStats.Capacity;
+        stats.HighWater = QStats.HighWater;
+        stats.Dropped = QStats.Dropped;
+        stats.Stalls = QStats.Stalls;
+        stats.Queued = WritePos - AtomicLoad(ReadPos);
+        return stats;
+    }
+};
+
+IOutput* CreateOutputAsync(IOutput* output, const CaptureConfig& cfg) { return new Output_Async(output, cfg); }
@@ -6,6 +6,8 @@
 #include "system.h"
 #include "screencapture.h"
 #include "output.h"
+#include "encode.h"
+#include "filewriter.h"
 
 extern "C"
 {
@@ -52,19 +54,99 @@ private:
     uint ResampleBytesPerSample = 0;
     uint ResampleFill = 0;
 
-    int FrameNo = 0;
+    VideoClock Clock;
+    int64 LastPts = -1;         // in the stream's time base
     int64 AudioWritten = 0;
 
+    bool Fragmented = false;
+    int64 FragmentLength = 0;   // in Clock's time base, like these
+    int64 FragmentStart = 0;
+    int64 FramePos = 0;
+
+    FileWriter* Writer = nullptr;
+
+    // libavformat's writes end up in our FileWriter
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+    static int WritePacket(void* opaque, const uint8_t* buf, int size)
+#else
+    static int WritePacket(void* opaque, uint8_t* buf, int size)
+#endif
+    {
+        return ((FileWriter*)opaque)->Write(buf, size) ? size : AVERROR(EIO);
+    }
+
+    static int64_t SeekPacket(void* opaque, int64_t offset, int whence)
+    {
+        FileWriter* writer = (FileWriter*)opaque;
+        switch (whence & ~AVSEEK_FORCE)
+        {
+        case AVSEEK_SIZE: return (int64_t)writer->GetSize();
+        case SEEK_SET: break;
+        case SEEK_CUR: offset += (int64_t)writer->Tell(); break;
+        case SEEK_END: offset += (int64_t)writer->GetSize(); break;
+        default: return AVERROR(EINVAL);
+        }
+        if (offset < 0)
+            return AVERROR(EINVAL);
+        return writer->Seek((uint64)offset) ? offset : AVERROR(EIO);
+    }
+
+    void OpenIO()
+    {
+        const CaptureConfig& cfg = *Para.CConfig;
+        if (!cfg.WriteBufferMB)
+        {
+            AVERR(avio_open(&Context->pb, Para.filename, AVIO_FLAG_WRITE));
+            return;
+        }
+
+        FileWriterPara wpara =
+        {
+            .BufferSize = cfg.WriteBufferMB << 20,
+            .Unbuffered = cfg.UnbufferedIO,
+            .Preallocate = (uint64)cfg.PreallocateMB << 20,
+        };
+        Writer = FileWriter::Create(Para.filename, wpara);
+        if (!Writer)
+            Fatal("Could not create %s\n", (const char*)Para.filename);
+
+        // the muxer only copies into a small buffer, the big writes happen in the FileWriter
+        const int ioSize = 256 * 1024;
+        uint8* ioBuffer = (uint8*)av_malloc(ioSize);
+        Context->pb = avio_alloc_context(ioBuffer, ioSize, 1, Writer, nullptr, WritePacket, SeekPacket);
+        if (!Context->pb)
+            Fatal("Could not allocate IO context\n");
+        Context->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    void CloseIO()
+    {
+        if (!Writer)
+        {
+            avio_close(Context->pb);
+            return;
+        }
+
+        avio_flush(Context->pb);
+        av_freep(&Context->pb->buffer);
+        avio_context_free(&Context->pb);
+        delete Writer;
+        Writer = nullptr;
+    }
+
     void InitVideo(const uint8 *firstFrame, int firstFrameSize)
     {
         VideoStream = avformat_new_stream(Context, 0);
         VideoStream->id = 0;
-        VideoStream->time_base.den = VideoStream->avg_frame_rate.num = Para.RateNum;
-        VideoStream->time_base.num = VideoStream->avg_frame_rate.den = Para.RateDen;
+        VideoStream->time_base.den = Clock.TimeBaseDen;
+        VideoStream->time_base.num = Clock.TimeBaseNum;
+        VideoStream->avg_frame_rate.num = Para.RateNum;
+        VideoStream->avg_frame_rate.den = Para.RateDen;
 
         auto codecpar = VideoStream->codecpar;
         codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
-        codecpar->codec_id = Para.CConfig->CodecCfg.Profile >= CodecProfile::HEVC_MAIN ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264;
+        auto profile = Para.CConfig->CodecCfg.Profile;
+        codecpar->codec_id = profile == CodecProfile::FFV1 ? AV_CODEC_ID_FFV1 : profile >= CodecProfile::HEVC_MAIN ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264;
         codecpar->bit_rate = Para.CConfig->CodecCfg.UseBitrateControl == BitrateControl::CBR ? Para.CConfig->CodecCfg.BitrateParameter * 1000ull : 0;
         codecpar->width = Para.SizeX;
         codecpar->height = Para.SizeY;
@@ -91,9 +173,10 @@ private:
 
         // For h.264 and HEVC, some of the muxers need the first frame
         // in the extradata during encode, so make a copy        
-        codecpar->extradata = (uint8*)av_malloc(firstFrameSize);
-        codecpar->extradata_size = firstFrameSize;
-        memcpy(codecpar->extradata, firstFrame, firstFrameSize);
+        ReadOnlySpan<uint8> extra = Para.Header.Len() ? Para.Header : ReadOnlySpan<uint8>(firstFrame, firstFrameSize);
+        codecpar->extradata = (uint8*)av_mallocz(extra.Len() + AV_INPUT_BUFFER_PADDING_SIZE);
+        codecpar->extradata_size = (int)extra.Len();
+        memcpy(codecpar->extradata, extra.Ptr(), extra.Len());
     }
 
     void InitAudio()
@@ -163,6 +246,17 @@ private:
         }
     }
 
+    // everything up to here becomes its own moof/mdat and goes to the disk
+    void FlushFragment()
+    {
+        AVERR(av_interleaved_write_frame(Context, nullptr));
+        AVERR(av_write_frame(Context, nullptr));
+        avio_flush(Context->pb);
+        if (Writer)
+            Writer->Flush();
+        FragmentStart = FramePos;
+    }
+
     static void OnLog(void*, int level, const char* format, va_list args)
     {
         static char buffer[4096];
@@ -187,7 +281,13 @@ public:
         static const char* const formats[] = { "mp4", "mov", "matroska" };
 
         AVERR(avformat_alloc_output_context2(&Context, nullptr, formats[(int)para.CConfig->UseContainer] , para.filename));
-        AVERR(avio_open(&Context->pb, para.filename, AVIO_FLAG_WRITE));
+        OpenIO();
+
+        // mkv is fine as it is
+        const CaptureConfig& cfg = *para.CConfig;
+        Fragmented = cfg.Fragmented && cfg.UseContainer != Container::Mkv;
+        Clock.Init(para);
+        FragmentLength = Max(Clock.FromSeconds(cfg.FragmentSeconds), Clock.GetFrameLength());
 
         Packet = av_packet_alloc();
         Frame = av_frame_alloc();     
@@ -207,7 +307,7 @@ public:
         if (!AudioContext || AudioWritten>0) // mkv muxer crashes otherwise...
             AVERR(av_write_trailer(Context));
 
-        avio_close(Context->pb);
+        CloseIO();
 
         avformat_free_context(Context);
         avcodec_free_context(&AudioContext);
@@ -218,29 +318,58 @@ public:
         av_log_set_callback(nullptr);
     }
 
-    void SubmitVideoPacket(const uint8* data, uint size) override
+    OutputStats GetStats() override
+    {
+        OutputStats stats = {};
+        if (Writer)
+        {
+            FileWriterStats ws = Writer->GetStats();
+            stats.DiskWritten = ws.Written;
+            stats.DiskBusy = ws.BusyTime;
+            stats.DiskStall = ws.StallTime;
+        }
+        return stats;
+    }
+
+    void SubmitVideoPacket(const uint8* data, uint size, const PacketInfo& info) override
     {
         if (!VideoStream)
         {
             InitVideo(data, size);
             InitAudio();
-            AVERR(avformat_write_header(Context, nullptr));
+
+            // we cut the fragments ourselves, see below
+            AVDictionary* options = nullptr;
+            if (Fragmented)
+                av_dict_set(&options, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+            AVERR(avformat_write_header(Context, &options));
+            av_dict_free(&options);
         }
 
-        AVRational tb = { .num = (int)Para.RateDen, .den = (int)Para.RateNum };
+        // start a new fragment with the first keyframe after FragmentSeconds, or anywhere after twice that
+        FramePos = Clock.Next(info.Time, info.Skipped);
+        if (Fragmented)
+        {
+            int64 length = FramePos - FragmentStart;
+            if (length >= FragmentLength && (info.Keyframe || length >= 2 * FragmentLength))
+                FlushFragment();
+        }
 
-        // set up packet
+        AVRational tb = { .num = (int)Clock.TimeBaseNum, .den = (int)Clock.TimeBaseDen };
+
+        // set up packet. The muxer may have picked a coarser time base (mkv: ms), where
+        // frames that were captured close together must not end up on the same tick.
         Packet->stream_index = VideoStream->index;
         Packet->data = (uint8*)data;
         Packet->size = size;
-        Packet->dts = Packet->pts = av_rescale_q(FrameNo, tb, VideoStream->time_base);
-        Packet->duration = av_rescale_q(1, tb, VideoStream->time_base);
+        Packet->dts = Packet->pts = Max(av_rescale_q(FramePos, tb, VideoStream->time_base), LastPts + 1);
+        Packet->duration = Max(av_rescale_q(Clock.GetFrameLength(), tb, VideoStream->time_base), (int64)1);
+        Packet->flags = info.Keyframe ? AV_PKT_FLAG_KEY : 0;
+        LastPts = Packet->pts;
 
         // write packet
         AVERR(av_interleaved_write_frame(Context, Packet));
         av_packet_unref(Packet);
-
-        FrameNo++;
     }
 
     void SubmitAudio(const uint8* data, uint size) override
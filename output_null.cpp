@@ -0,0 +1,17 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include "system.h"
+#include "output.h"
+
+// throws everything away, for measuring the pipeline without the muxer and disk
+class Output_Null : public IOutput
+{
+public:
+    void SubmitVideoPacket(const uint8* data, uint size, const PacketInfo& info) override {}
+    void SubmitAudio(const uint8* data, uint size) override {}
+};
+
+IOutput* CreateOutputNull(const OutputPara& para) { return new Output_Null(); }
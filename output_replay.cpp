@@ -0,0 +1,295 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include <string.h>
+
+#include "system.h"
+#include "screencapture.h"
+#include "output.h"
+#include "encode.h"
+
+// Doesn't write anything, but keeps the last cfg.ReplaySeconds of packets (and the
+// raw audio that goes with them) in a ring buffer of cfg.ReplayMB. The ring always
+// starts at a keyframe: whole GOPs get thrown out at the old end to make room.
+// Audio that's ahead of the video waits until the video catches up, so it never
+// ends up in front of the keyframe it belongs after.
+// Save() copies what's in there, a bit with every packet that comes in after it (and
+// whatever is about to be thrown out), and then writes it to a file on its own thread.
+class Output_Replay : public IReplayOutput
+{
+    enum class Kind : uint { Video, Audio, Wrap };
+
+    struct Header
+    {
+        Kind kind;
+        uint size;
+        PacketInfo info;    // video only
+        uint64 pos;         // where on the Clock (video) or first sample (audio)
+    };
+
+    struct Gop
+    {
+        uint64 offset;      // of its keyframe in the ring
+        int64 pos;          // on the Clock
+    };
+
+    OutputPara Para;
+    Array<uint8> FirstPacket;       // has the codec header if the encoder doesn't give it to us separately
+
+    uint8* Ring = nullptr;
+    uint64 Capacity = 0;
+    uint64 WritePos = 0;            // both only ever increase, the ring offset is pos % Capacity
+    uint64 ReadPos = 0;
+    Array<Gop> Gops;
+    int64 MaxLength = 0;
+
+    VideoClock Clock;
+    uint64 AudioPos = 0;            // samples that went into the ring (or got thrown away) so far
+    Array<uint8> HeldAudio;         // samples from AudioPos on that are ahead of the video
+    bool HaveKeyframe = false;      // nothing goes in before the first keyframe, or after the GOP got thrown out
+
+    // the save in progress
+    static constexpr uint64 COPY_STEP = 16 << 20;   // bytes to copy per packet, so big buffers don't hold up the encoder
+    Thread* SaveThread = nullptr;
+    uint8* Snapshot = nullptr;      // as big as the ring, once there was a save
+    uint64 SnapshotSize = 0;
+    uint64 CopyPos = 0;             // ring position of what's still left to copy
+    uint64 CopyEnd = 0;
+    bool Copying = false;
+    String SaveName;
+    uint64 SaveStartSample = 0;
+    volatile bool Saving = false;
+    uint Saved = 0;
+
+    static uint64 Align(uint64 x) { return (x + 7) & ~7ull; }
+
+    void DropGop()
+    {
+        uint64 next = Gops.Len() > 1 ? Gops[1].offset : WritePos;
+
+        // the save needs it first
+        if (Copying)
+            CopySnapshot(next);
+
+        ReadPos = next;
+        if (Gops.Len() == 1)
+            HaveKeyframe = false;
+        Gops.RemAt(0);
+    }
+
+    // copies the saved part of the ring up to at least pos into the snapshot, and starts writing once it's all there
+    void CopySnapshot(uint64 pos)
+    {
+        while (CopyPos < CopyEnd && CopyPos < pos)
+        {
+            uint64 offset = CopyPos % Capacity;
+            const Header& h = *(const Header*)(Ring + offset);
+            if (h.kind == Kind::Wrap)
+            {
+                CopyPos += Capacity - offset;
+                continue;
+            }
+
+            uint64 size = sizeof(Header) + Align(h.size);
+            memcpy(Snapshot + SnapshotSize, Ring + offset, size);
+            SnapshotSize += size;
+            CopyPos += size;
+        }
+
+        if (CopyPos >= CopyEnd)
+        {
+            Copying = false;
+            SaveThread = new Thread(Bind(this, &Output_Replay::SaveThreadFunc));
+        }
+    }
+
+    // returns where the entry went, or false if it doesn't fit even with everything else thrown out
+    bool Push(Kind kind, const uint8* data, uint size, const PacketInfo& info, uint64 pos, uint64& at)
+    {
+        uint64 need = sizeof(Header) + Align(size);
+        if (need > Capacity)
+        {
+            while (Gops.Len())
+                DropGop();
+            HaveKeyframe = false;
+            return false;
+        }
+
+        for (;;)
+        {
+            uint64 offset = WritePos % Capacity;
+            uint64 pad = offset + need > Capacity ? Capacity - offset : 0;
+            if (pad && WritePos == ReadPos)
+            {
+                // empty anyway, just start over at the beginning
+                ReadPos = WritePos += pad;
+                continue;
+            }
+
+            if (WritePos - ReadPos + pad + need <= Capacity)
+            {
+                if (pad)
+                {
+                    *(Header*)(Ring + offset) = { .kind = Kind::Wrap };
+                    WritePos += pad;
+                    offset = 0;
+                }
+                *(Header*)(Ring + offset) = { .kind = kind, .size = size, .info = info, .pos = pos };
+                memcpy(Ring + offset + sizeof(Header), data, size);
+                at = WritePos;
+                WritePos += need;
+                return true;
+            }
+
+            // make room. If that throws out the GOP this packet belongs to, wait for the next one
+            DropGop();
+            if (!HaveKeyframe && !(kind == Kind::Video && info.Keyframe))
+                return false;
+        }
+    }
+
+    // puts the held audio up to the end of the video into the ring
+    void ReleaseAudio()
+    {
+        const uint bps = Para.Audio.BytesPerSample;
+        uint64 videoEnd = Clock.ToSample(Clock.GetEnd());
+        uint64 n = AudioPos < videoEnd ? Min<uint64>(HeldAudio.Len() / bps, videoEnd - AudioPos) : 0;
+        if (!n)
+            return;
+
+        uint64 at;
+        if (HaveKeyframe)
+            Push(Kind::Audio, HeldAudio.Ptr(), (uint)(n * bps), {}, AudioPos, at);
+        AudioPos += n;
+
+        size_t rest = HeldAudio.Len() - (size_t)(n * bps);
+        memmove(HeldAudio.Ptr(), HeldAudio.Ptr() + n * bps, rest);
+        HeldAudio.SetSize(rest);
+    }
+
+    void SaveThreadFunc(Thread& thread)
+    {
+        // goes through to the end even if told to stop, so the file is complete
+        OutputPara para = Para;
+        para.filename = SaveName;
+        if (!para.Header.Len())
+            para.Header = ReadOnlySpan<uint8>(FirstPacket.Ptr(), FirstPacket.Len());
+        IOutput* output = CreateOutputLibAV(para);
+
+        const uint bps = Para.Audio.BytesPerSample;
+        for (uint64 p = 0; p < SnapshotSize; )
+        {
+            const Header& h = *(const Header*)(Snapshot + p);
+            const uint8* data = Snapshot + p + sizeof(Header);
+            p += sizeof(Header) + Align(h.size);
+
+            if (h.kind == Kind::Video)
+                output->SubmitVideoPacket(data, h.size, h.info);
+            else
+            {
+                // cut off what's from before the first frame
+                uint64 samples = h.size / bps;
+                uint64 skip = h.pos < SaveStartSample ? Min(SaveStartSample - h.pos, samples) : 0;
+                if (skip < samples)
+                    output->SubmitAudio(data + skip * bps, (uint)((samples - skip) * bps));
+            }
+        }
+
+        delete output;
+        Saving = false;
+    }
+
+public:
+    Output_Replay(const OutputPara& para) : Para(para)
+    {
+        const CaptureConfig& cfg = *para.CConfig;
+        Capacity = Align((uint64)Max(cfg.ReplayMB, 1u) << 20);
+        Ring = new uint8[Capacity + sizeof(Header)];  // a Wrap header can start right before the end
+        Clock.Init(para);
+        MaxLength = Max((int64)(cfg.ReplaySeconds * Clock.TimeBaseDen / Clock.TimeBaseNum), Clock.GetFrameLength());
+    }
+
+    ~Output_Replay()
+    {
+        if (Copying)
+            CopySnapshot(CopyEnd);
+        delete SaveThread;
+        delete[] Snapshot;
+        delete[] Ring;
+    }
+
+    void SubmitVideoPacket(const uint8* data, uint size, const PacketInfo& info) override
+    {
+        if (!FirstPacket.Len() && !Para.Header.Len())
+            FirstPacket = ReadOnlySpan<uint8>(data, size);
+
+        if (Copying)
+            CopySnapshot(CopyPos + COPY_STEP);
+
+        int64 pos = Clock.Next(info.Time, info.Skipped);
+        if (info.Keyframe)
+            HaveKeyframe = true;
+        if (!HaveKeyframe)
+            return;
+
+        uint64 at;
+        if (!Push(Kind::Video, data, size, info, pos, at))
+            return;
+
+        if (info.Keyframe)
+        {
+            Gops += Gop { .offset = at, .pos = pos };
+            HaveKeyframe = true;
+        }
+
+        // drop the oldest GOP if the ones after it are long enough
+        while (Gops.Len() > 1 && Clock.GetEnd() - Gops[1].pos >= MaxLength)
+            DropGop();
+
+        if (HeldAudio.Len())
+            ReleaseAudio();
+    }
+
+    void SubmitAudio(const uint8* data, uint size) override
+    {
+        HeldAudio += ReadOnlySpan<uint8>(data, size);
+        ReleaseAudio();
+    }
+
+    OutputStats GetStats() override
+    {
+        OutputStats stats = {};
+        stats.ReplayBytes = WritePos - ReadPos;
+        stats.ReplayLength = Gops.Len() ? Clock.ToSeconds(Clock.GetEnd() - Gops[0].pos) : 0;
+        stats.ReplaysSaved = Saved;
+        return stats;
+    }
+
+    bool Save(const String& filename) override
+    {
+        if (Saving || !Gops.Len())
+            return false;
+        delete SaveThread;
+        SaveThread = nullptr;
+
+        // copying it all at once would hold up the encoder for a while with a big buffer,
+        // so it happens bit by bit with the next packets (see CopySnapshot())
+        if (!Snapshot)
+            Snapshot = new uint8[Capacity];
+        SnapshotSize = 0;
+        CopyPos = ReadPos;
+        CopyEnd = WritePos;
+        Copying = true;
+
+        SaveName = filename;
+        SaveStartSample = Clock.ToSample(Gops[0].pos);
+        Saving = true;
+        Saved++;
+        CopySnapshot(CopyPos + COPY_STEP);
+        return true;
+    }
+};
+
+IReplayOutput* CreateOutputReplay(const OutputPara& para) { return new Output_Replay(para); }
@@ -0,0 +1,206 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include <string.h>
+
+#include "system.h"
+#include "screencapture.h"
+#include "output.h"
+#include "encode.h"
+
+// Splits a recording into several files (name_part001.mov, name_part002.mov, ...)
+// by length and/or size, while the encoder just keeps going. A new file can only
+// start at a keyframe, so it starts at the first one after the length limit, or
+// at the last one where the next GOP would still fit under the size limit.
+// Audio gets cut at exactly the sample the new file's first frame starts at:
+// audio that's ahead of the video is held back until the video catches up, and
+// if it's behind, the previous file stays open until it has all of its audio.
+class Output_Segment : public IOutput
+{
+    OutputPara Para;
+    String BaseName;
+    String Extension;
+    uint PartNo = 0;
+
+    IOutput* Current = nullptr;
+    IOutput* Previous = nullptr;    // waiting for its audio up to PreviousEnd
+    Array<uint8> FirstPacket;       // has the codec header if the encoder doesn't give it to us separately
+
+    VideoClock Clock;               // since the start of the recording
+    int64 SegmentStart = 0;
+    int64 SegmentLength = 0;        // 0: no length limit
+    uint64 SegmentBytes = 0;
+    uint64 MaxSegmentBytes = 0;     // 0: no size limit
+    uint64 GopBytes = 0;
+    uint64 MaxGopBytes = 0;
+
+    bool HasAudio = false;
+    uint64 AudioPos = 0;            // samples handed to the outputs so far
+    uint64 PreviousEnd = 0;
+    Array<uint8> HeldAudio;         // samples from AudioPos on that haven't gone out yet
+
+    void Open(int64 start)
+    {
+        OutputPara para = Para;
+        para.filename = String::PrintF("%s_part%03u%s", (const char*)BaseName, ++PartNo, (const char*)Extension);
+        if (!para.Header.Len())
+            para.Header = ReadOnlySpan<uint8>(FirstPacket.Ptr(), FirstPacket.Len());
+        Current = CreateOutputLibAV(para);
+
+        SegmentStart = start;
+        SegmentBytes = 0;
+    }
+
+    bool NeedSplit(int64 pos) const
+    {
+        // not before the last file has got all its audio
+        int64 length = pos - SegmentStart;
+        if (!length || Previous)
+            return false;
+        if (SegmentLength && length >= SegmentLength)
+            return true;
+        return MaxSegmentBytes && SegmentBytes + MaxGopBytes > MaxSegmentBytes;
+    }
+
+    void Split(int64 pos)
+    {
+        Previous = Current;
+        PreviousEnd = Clock.ToSample(pos);
+        Open(pos);
+
+        if (!HasAudio)
+        {
+            delete Previous;
+            Previous = nullptr;
+        }
+    }
+
+    // hands out held audio: to the previous file up to its end, then to the current one up to the video
+    void ReleaseAudio()
+    {
+        const uint bps = Para.Audio.BytesPerSample;
+        uint64 held = HeldAudio.Len() / bps;
+        uint64 sent = 0;
+
+        if (Previous)
+        {
+            uint64 n = Min(held, PreviousEnd - AudioPos);
+            if (n)
+                Previous->SubmitAudio(HeldAudio.Ptr(), (uint)(n * bps));
+            sent = n;
+            AudioPos += n;
+
+            if (AudioPos < PreviousEnd)
+            {
+                Consume(sent * bps);
+                return;
+            }
+            delete Previous;
+            Previous = nullptr;
+        }
+
+        // not past where the next packet could start, as that might be where the next file begins
+        uint64 videoEnd = Clock.ToSample(Clock.GetNextMin());
+        if (AudioPos < videoEnd)
+        {
+            uint64 n = Min(held - sent, videoEnd - AudioPos);
+            if (n)
+            {
+                Current->SubmitAudio(HeldAudio.Ptr() + sent * bps, (uint)(n * bps));
+                SegmentBytes += n * bps;
+                GopBytes += n * bps;
+            }
+            sent += n;
+            AudioPos += n;
+        }
+
+        Consume(sent * bps);
+    }
+
+    void Consume(uint64 bytes)
+    {
+        if (!bytes)
+            return;
+        size_t rest = HeldAudio.Len() - (size_t)bytes;
+        memmove(HeldAudio.Ptr(), HeldAudio.Ptr() + bytes, rest);
+        HeldAudio.SetSize(rest);
+    }
+
+public:
+    Output_Segment(const OutputPara& para) : Para(para)
+    {
+        const CaptureConfig& cfg = *para.CConfig;
+        Clock.Init(para);
+        SegmentLength = (int64)(cfg.SegmentMinutes * 60.0 * Clock.TimeBaseDen / Clock.TimeBaseNum);
+        MaxSegmentBytes = (uint64)cfg.SegmentMB << 20;
+        HasAudio = para.Audio.Format != AudioFormat::None;
+
+        const char* name = para.filename;
+        const char* dot = strrchr(name, '.');
+        if (!dot || strpbrk(dot, "\\/"))
+            dot = name + strlen(name);
+        BaseName = String(ReadOnlySpan<char>(name, dot - name));
+        Extension = dot;
+    }
+
+    ~Output_Segment()
+    {
+        // whatever audio is left goes into the last file
+        if (Current && HasAudio)
+        {
+            if (Previous)
+            {
+                uint64 n = Min<uint64>(HeldAudio.Len() / Para.Audio.BytesPerSample, PreviousEnd - AudioPos);
+                Previous->SubmitAudio(HeldAudio.Ptr(), (uint)(n * Para.Audio.BytesPerSample));
+                Consume(n * Para.Audio.BytesPerSample);
+            }
+            if (HeldAudio.Len())
+                Current->SubmitAudio(HeldAudio.Ptr(), (uint)HeldAudio.Len());
+        }
+
+        delete Previous;
+        delete Current;
+    }
+
+    void SubmitVideoPacket(const uint8* data, uint size, const PacketInfo& info) override
+    {
+        if (info.Keyframe)
+        {
+            MaxGopBytes = Max(MaxGopBytes, GopBytes);
+            GopBytes = 0;
+        }
+
+        int64 pos = Clock.Next(info.Time, info.Skipped);
+        if (!Current)
+        {
+            if (!Para.Header.Len())
+                FirstPacket = ReadOnlySpan<uint8>(data, size);
+            Open(pos);
+        }
+        else if (info.Keyframe && NeedSplit(pos))
+            Split(pos);
+
+        Current->SubmitVideoPacket(data, size, info);
+        SegmentBytes += size;
+        GopBytes += size;
+
+        if (HasAudio)
+            ReleaseAudio();
+    }
+
+    void SubmitAudio(const uint8* data, uint size) override
+    {
+        if (!HasAudio)
+            return;
+
+        HeldAudio += ReadOnlySpan<uint8>(data, size);
+        if (Current)
+            ReleaseAudio();
+    }
+
+    OutputStats GetStats() override { return Current ? Current->GetStats() : OutputStats(); }
+};
+
+IOutput* CreateOutputSegment(const OutputPara& para) { return new Output_Segment(para); }
@@ -0,0 +1,70 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#include <math.h>
+
+#include "types.h"
+#include "refreshclock.h"
+
+void RefreshClock::Reset(double nominalPeriod)
+{
+    ASSERT(nominalPeriod > 0);
+    Nominal = Period = nominalPeriod;
+    Locked = false;
+    PhaseError = 0;
+    Correction = 0;
+}
+
+uint64 RefreshClock::Update(double t)
+{
+    ASSERT(Nominal > 0);
+
+    // plain rounding, for reference and for (re)starting
+    int64 rounded = HaveLast ? (int64)round((t - LastT) / Nominal) : 0;
+
+    if (!Locked)
+    {
+        // continue counting from wherever we were before the Reset()
+        AnchorN = LastN + Max<int64>(rounded, 0);
+        AnchorT = t;
+        Locked = true;
+    }
+    else
+    {
+        // where are we relative to the predicted refresh grid?
+        double pos = (t - AnchorT) / Period;
+        int64 dn = (int64)round(pos);
+
+        // never go backwards; several presents within one refresh get the same index
+        dn = Max<int64>(dn, (int64)LastN - (int64)AnchorN);
+        double err = pos - (double)dn;
+
+        if (dn > 0)
+        {
+            // move the anchor to the predicted time of this refresh, pulled towards the
+            // measurement (phase), and adjust the period by the error per refresh (frequency)
+            double predicted = AnchorT + dn * Period;
+            AnchorT = predicted + KP * err * Period;
+            AnchorN += dn;
+
+            // presents close to halfway between two refreshes might have been rounded the wrong
+            // way, so don't let them pull the frequency
+            if (fabs(err) < 0.25)
+                Period += KI * err * Period / (double)dn;
+            Period = Clamp(Period, Nominal * (1 - MAX_DEVIATION), Nominal * (1 + MAX_DEVIATION));
+        }
+
+        PhaseError = err;
+    }
+
+    uint64 n = AnchorN + (uint64)Max<int64>((int64)round((t - AnchorT) / Period), 0);
+    n = Max(n, LastN);
+    Correction = HaveLast ? (int)((int64)(n - LastN) - rounded) : 0;
+
+    LastT = t;
+    LastN = n;
+    HaveLast = true;
+    return n;
+}
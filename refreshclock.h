@@ -0,0 +1,44 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#pragma once
+
+#include "types.h"
+
+// Recovers the actual refresh clock of a screen from present timestamps and
+// turns them into refresh indices. The refresh rate a display reports can be
+// off from the real scanout clock by enough that rounding the deltas drifts,
+// so this tracks phase and period with a PI loop, starting from the reported
+// (nominal) period and staying within a few percent of it.
+class RefreshClock
+{
+public:
+    // start over with a new nominal period (in seconds). Frame indices keep counting up.
+    void Reset(double nominalPeriod);
+
+    // index of the refresh a present at time t (in seconds) belongs to. Never goes backwards.
+    uint64 Update(double t);
+
+    double GetPeriod() const { return Period; }
+    double GetNominalPeriod() const { return Nominal; }
+    double GetPhaseError() const { return PhaseError; }     // of the last present, in refreshes
+    int GetCorrection() const { return Correction; }        // last index step minus the plainly rounded delta
+
+private:
+    static constexpr double KP = 0.1;           // phase gain
+    static constexpr double KI = 0.005;         // frequency gain
+    static constexpr double MAX_DEVIATION = 0.02;
+
+    double Nominal = 0;
+    double Period = 0;
+    bool Locked = false;        // have we got an anchor since Reset()?
+    bool HaveLast = false;
+    double AnchorT = 0;         // estimated time of refresh #AnchorN
+    uint64 AnchorN = 0;
+    double LastT = 0;
+    uint64 LastN = 0;
+    double PhaseError = 0;
+    int Correction = 0;
+};
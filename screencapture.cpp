@@ -4,6 +4,7 @@
 //
 
 #include <math.h>
+#include <string.h>
 
 #include "types.h"
 #include "system.h"
@@ -11,31 +12,201 @@
 
 #include "audiocapture.h"
 #include "colormath.h"
+#include "colorconvert.h"
 #include "encode.h"
 #include "output.h"
+#include "framesource.h"
+#include "framepacer.h"
+#include "dirtytiles.h"
+#include "capturetrace.h"
+#include "latencyhistogram.h"
 
 #include "ScreenCapture.h"
 
 #include "resource.h"
 
+// Per frame stats at several resolutions: level n has one entry per 2^n frames.
+// Written by one thread, read by any. Every level only keeps its last SIZE entries,
+// so the full history is always available at the coarser levels. The frames that
+// don't fill a whole entry of a level yet get read as one more, shorter entry.
+class FrameStatsPyramid
+{
+public:
+    static constexpr uint LEVELS = 24;
+    static constexpr uint SIZE = 1024;
+
+    void Restart()
+    {
+        for (uint l = 0; l < LEVELS; l++)
+        {
+            Levels[l].Restart();
+            HavePending[l] = false;
+        }
+        Tails.Write({});
+    }
+
+    void Push(const CaptureStats::Frame& frame)
+    {
+        CaptureStats::FrameRange range = { frame, frame, frame };
+        for (uint l = 0; l < LEVELS; l++)
+        {
+            Levels[l].Push(range);
+            if (l == LEVELS - 1)
+                break;
+
+            // every second entry completes one of the next level
+            if (!HavePending[l])
+            {
+                Pending[l] = range;
+                HavePending[l] = true;
+                break;
+            }
+            HavePending[l] = false;
+            range = Combine(Pending[l], 1, range, 1);
+        }
+
+        // the unfinished entry of a level is made of the pending ones below it
+        Tail tail = {};
+        for (uint l = 1; l < LEVELS; l++)
+        {
+            tail.Range[l] = tail.Range[l - 1];
+            tail.Frames[l] = tail.Frames[l - 1];
+            if (HavePending[l - 1])
+            {
+                uint n = 1u << (l - 1);
+                tail.Range[l] = tail.Frames[l] ? Combine(tail.Range[l], tail.Frames[l], Pending[l - 1], n) : Pending[l - 1];
+                tail.Frames[l] += n;
+            }
+        }
+        Tails.Write(tail);
+    }
+
+    uint Read(uint maxPoints, Array<CaptureStats::FrameRange>& into) const
+    {
+        maxPoints = Clamp(maxPoints, 1u, SIZE);
+        Tail tail = Tails.Read();
+        for (uint l = 0; l < LEVELS; l++)
+        {
+            auto& level = Levels[l];
+            uint64 entries = level.GetHead() - level.GetStart() + (tail.Frames[l] ? 1 : 0);
+            if (entries <= maxPoints || l == LEVELS - 1)
+            {
+                level.Read(0, into);
+                if (tail.Frames[l])
+                    into += tail.Range[l];
+                return 1u << l;
+            }
+        }
+        return 0;
+    }
+
+private:
+    struct Tail
+    {
+        CaptureStats::FrameRange Range[LEVELS];
+        uint Frames[LEVELS];        // 0: none
+    };
+
+    HistoryRing<CaptureStats::FrameRange, SIZE> Levels[LEVELS];
+    CaptureStats::FrameRange Pending[LEVELS] = {};
+    bool HavePending[LEVELS] = {};
+    SeqLocked<Tail> Tails;
+
+    // a and b being the stats of na and nb frames
+    static CaptureStats::FrameRange Combine(const CaptureStats::FrameRange& a, uint na, const CaptureStats::FrameRange& b, uint nb)
+    {
+        double wa = (double)na / (na + nb), wb = 1 - wa;
+        return
+        {
+            .Min = { Min(a.Min.FPS, b.Min.FPS), Min(a.Min.AVSkew, b.Min.AVSkew), Min(a.Min.Bitrate, b.Min.Bitrate) },
+            .Max = { Max(a.Max.FPS, b.Max.FPS), Max(a.Max.AVSkew, b.Max.AVSkew), Max(a.Max.Bitrate, b.Max.Bitrate) },
+            .Mean = { a.Mean.FPS * wa + b.Mean.FPS * wb, a.Mean.AVSkew * wa + b.Mean.AVSkew * wb, a.Mean.Bitrate * wa + b.Mean.Bitrate * wb },
+        };
+    }
+};
+
 class ScreenCapture : public IScreenCapture
 {
     CaptureConfig Config;
 
+    IFrameSource* Source = nullptr;
     IEncode* encoder = nullptr;
     IAudioCapture* audioCapture = nullptr;
     AudioInfo audioInfo = {};
     Thread* processThread = nullptr;
     Thread* captureThread = nullptr;
+    CaptureTraceWriter* trace = nullptr;
+    String filename;
     uint sizeX = 0, sizeY = 0, rateNum = 0, rateDen = 0;
     PixelFormat pixfmt = PixelFormat::None;
     bool isHdr = false;
 
-    CaptureStats Stats = {};
+    CaptureStats Stats = {}; // owned by the process thread, readers get PublishedStats
+    SeqLocked<CaptureStats> PublishedStats;
+    HistoryRing<CaptureStats::Frame, 16384> FrameHistory;
+    FrameStatsPyramid FramePyramid;
+    uint framesCaptured = 0;
+    uint framesDuplicated = 0;
+    uint framesStatic = 0;
+    uint framesDeduped = 0;
+    uint framesRepeated = 0;
+    uint framesHashed = 0;
+    int64 hashTicks = 0;        // what hashing the framesHashed took
+    uint64 tilesConverted = 0;  // out of tilesTotal, over all captured frames
+    uint64 tilesTotal = 0;
+    volatile bool recording = false;
+    volatile bool saveReplay = false;
+    int64 startTicks = 0;   // when we decided to record, for the time to the first packet
+    double outputStart = 0; // capture time of the first frame of the current file
+    double lastSubmitted = 0; // capture time of the last frame that went to the encoder
+    uint repeats = 0;       // duplicates of it since then that didn't get encoded (see DuplicateFrame())
+    FramePacer Pacer;
     double avSkew = 0;
-    double fps = 0;
     double bitrate = 0;
 
+    // timestamps of every frame handed to the encoder, from the capture to the process thread
+    struct FrameTiming
+    {
+        double Time;        // as submitted to the encoder, to find the packet it ends up in
+        int64 Present;      // ticks; 0 for duplicated frames
+        int64 Acquire;
+        int64 Convert;
+        int64 Submit;
+    };
+    Queue<FrameTiming, 64> Timings;
+    LatencyHistogram StageLatency[CaptureStats::STAGES];
+    int64 ticksPerSecond = 0;
+
+    void AddLatency(CaptureStats::Stage stage, int64 from, int64 to)
+    {
+        StageLatency[(int)stage].Add((uint64)Max<int64>(to - from, 0) * 1000000 / ticksPerSecond);
+    }
+
+    void ResetLatency()
+    {
+        FrameTiming t;
+        while (Timings.Dequeue(t)) {}
+        for (auto& h : StageLatency)
+            h.Reset();
+    }
+
+    void AddPacketLatency(double time, int64 packetTicks, int64 writtenTicks)
+    {
+        // timings older than the packet belong to frames we'll never see, and if the
+        // queue was full when this one got submitted there's none for it at all
+        FrameTiming t;
+        while (Timings.Peek(t) && t.Time < time)
+            Timings.Dequeue(t);
+        if (!Timings.Peek(t) || t.Time != time)
+            return;
+        Timings.Dequeue(t);
+
+        AddLatency(CaptureStats::Stage::Encode, t.Submit, packetTicks);
+        AddLatency(CaptureStats::Stage::Mux, packetTicks, writtenTicks);
+        if (t.Present)
+            AddLatency(CaptureStats::Stage::Total, t.Present, writtenTicks);
+    }
+
     void CalcVU(const uint8 *ptr, uint size)
     {
         uint ch = audioInfo.Channels;
@@ -65,20 +236,23 @@ class ScreenCapture : public IScreenCapture
             Stats.VU[i] = -1;        
     }
 
-    void ProcessThreadFunc(Thread& thread)
+    String MakeFilename(const char* suffix = "")
     {
         static const char* const extensions[] = { "mp4", "mov", "mkv" };
 
         String prefix = Config.Directory + "\\" + Config.NamePrefix;
 
         auto systime = GetSystemTime();
-        auto filename = String::PrintF("%s_%04d-%02d-%02d_%02d.%02d.%02d_%dx%d_%.4gfps.%s",
-            (const char*)prefix,
+        return String::PrintF("%s%s_%04d-%02d-%02d_%02d.%02d.%02d_%dx%d_%.4gfps.%s",
+            (const char*)prefix, suffix,
             systime.year, systime.month, systime.day, systime.hour, systime.minute, systime.second,
             sizeX, sizeY, (double)rateNum / rateDen,
             extensions[(int)Config.UseContainer]
         );
+    }
 
+    void ProcessThreadFunc(Thread& thread)
+    {
         audioInfo = audioCapture ? audioCapture->GetInfo() : AudioInfo{ .Format = AudioFormat::None };
 
         OutputPara para =
@@ -89,12 +263,19 @@ class ScreenCapture : public IScreenCapture
             .RateNum = rateNum,
             .RateDen = rateDen,
             .Hdr = isHdr,
+            .Vfr = Config.VariableFrameRate,
             .Audio = audioInfo,
+            .Header = encoder->GetHeader(),
             .CConfig = &Config,
         };
 
         Stats = {};
-        Stats.Filename = filename;
+        Stats.SetupTime = setupTime;
+        Stats.SetupCached = setupCached;
+        if (Config.ReplaySeconds <= 0)
+            strncpy_s(Stats.Filename, filename, _TRUNCATE);
+        Stats.FirstFrame = FrameHistory.Restart();
+        FramePyramid.Restart();
         Stats.FPS = (double)rateNum / rateDen;
         Stats.SizeX = sizeX;
         Stats.SizeY = sizeY;
@@ -107,9 +288,17 @@ class ScreenCapture : public IScreenCapture
         case PixelFormat::RGBA16F: Stats.Fmt = CaptureStats::CaptureFormat::P16F; break;
         default: Stats.Fmt = CaptureStats::CaptureFormat::Unknown;
         }
+        PublishedStats.Write(Stats);
         
         
-        IOutput* output = CreateOutputLibAV(para);
+        // the replay buffer writes its files on its own thread anyway
+        IReplayOutput* replay = Config.ReplaySeconds > 0 ? CreateOutputReplay(para) : nullptr;
+        IOutput* output = replay ? replay
+            : Config.NullOutput ? CreateOutputNull(para)
+            : (Config.SegmentMinutes > 0 || Config.SegmentMB) ? CreateOutputSegment(para)
+            : CreateOutputLibAV(para);
+        if (Config.MuxBufferMB && !replay)
+            output = CreateOutputAsync(output, Config);
 
         const uint audioSize = para.Audio.BytesPerSample * (para.Audio.SampleRate / 10);
         uint8* audioData = new uint8[audioSize];
@@ -127,37 +316,66 @@ class ScreenCapture : public IScreenCapture
 
         int frameCount = 0;
         uint totalBytes = 0;
+        const double startTime = outputStart;
+        const double frameTime = (double)rateDen / rateNum;
 
-        while (thread.IsRunning())
+        auto sendAudio = [&]()
         {
+            double audioTime = 0;
+            uint audio = audioCapture->Read(audioData, audioSize, audioTime);
+            if (audio)
+            {
+                output->SubmitAudio(audioData, audio);
+                aTimeSent += (double)audio / ((double)para.Audio.BytesPerSample * para.Audio.SampleRate);
+                CalcVU(audioData, audio);
+            }
+        };
+
+        for (;;)
+        {
+            // look at the stop flag first, so the packets still in the encoder make it into the file
+            bool running = thread.IsRunning();
+            bool gotPacket = false;
+
             uint8* data;
             uint size;
 
-            double videoTime;
-            while (encoder->BeginGetPacket(data, size, 2, videoTime))
+            PacketInfo info;
+            while (encoder->BeginGetPacket(data, size, running ? 2 : 50, info))
             {
-                output->SubmitVideoPacket(data, size);
+                gotPacket = true;
+
+                // StopOutput() drains the encoder, so nothing from the last file should be left in it, but if it is, it goes
+                if (info.Time < startTime)
+                {
+                    encoder->EndGetPacket();
+                    continue;
+                }
+
+                int64 packetTicks = GetTicks();
+                output->SubmitVideoPacket(data, size, info);
+                AddPacketLatency(info.Time, packetTicks, GetTicks());
                 encoder->EndGetPacket();
-                vTimeSent += (double)rateDen / rateNum;
 
                 if (firstVideo)
                 {
-                    firstVideoTime = videoTime;
+                    Stats.StartDelay = (GetTicks() - startTicks) * 1000.0 / ticksPerSecond;
+                    firstVideoTime = info.Time;
                     firstVideo = false;
                     if (audioCapture)
                         audioCapture->JumpToTime(firstVideoTime);
                 }
 
+                // with variable frame rate, the frame lasts until the next one comes, which we don't know yet.
+                // Otherwise the last one might have been repeated a few times before this one.
+                if (Config.VariableFrameRate)
+                    vTimeSent = info.Time - firstVideoTime + frameTime;
+                else
+                    vTimeSent += (1 + (frameCount ? info.Skipped : 0)) * frameTime;
+
                 if (audioCapture)
                 {
-                    double audioTime = 0;
-                    uint audio = audioCapture->Read(audioData, audioSize, audioTime);
-                    if (audio)
-                    {
-                        output->SubmitAudio(audioData, audio);
-                        aTimeSent += (double)audio / ((double)para.Audio.BytesPerSample * para.Audio.SampleRate);
-                        CalcVU(audioData, audio);
-                    }
+                    sendAudio();
                     avSkew += 0.03 * (aTimeSent - vTimeSent - avSkew);
                 }
 
@@ -176,11 +394,43 @@ class ScreenCapture : public IScreenCapture
 
                 double br = (8. * size * rateNum) / (1000. * rateDen);
                 bitrate += 0.03 * (br  - bitrate);
-                Stats.AvgBitrate = (8. * (double)totalBytes * rateNum) / (1000. * frameCount * rateDen);
+                Stats.Time = vTimeSent;
+                Stats.AvgBitrate = 8. * (double)totalBytes / (1000. * Stats.Time);
                 Stats.MaxBitrate = Max(Stats.MaxBitrate, bitrate);
-                Stats.Time = (double)frameCount * rateDen / rateNum;
-                Stats.Frames += CaptureStats::Frame{ .FPS = fps, .AVSkew = avSkew, .Bitrate = bitrate };
-            }        
+
+                auto ostats = output->GetStats();
+                Stats.MuxQueued = ostats.Queued;
+                Stats.MuxHighWater = ostats.HighWater;
+                Stats.MuxCapacity = ostats.Capacity;
+                Stats.MuxDropped = ostats.Dropped;
+                Stats.MuxStalls = ostats.Stalls;
+                Stats.DiskWritten = ostats.DiskWritten;
+                Stats.DiskBusy = ostats.DiskBusy;
+                Stats.DiskStall = ostats.DiskStall;
+                Stats.ReplayBytes = ostats.ReplayBytes;
+                Stats.ReplayLength = ostats.ReplayLength;
+                Stats.ReplaysSaved = ostats.ReplaysSaved;
+
+                if (saveReplay && replay)
+                {
+                    String name = MakeFilename("_replay");
+                    if (replay->Save(name))
+                        strncpy_s(Stats.Filename, name, _TRUNCATE);
+                    saveReplay = false;
+                }
+
+                CaptureStats::Frame frame = { .FPS = Pacer.GetFPS(), .AVSkew = avSkew, .Bitrate = bitrate };
+                FrameHistory.Push(frame);
+                FramePyramid.Push(frame);
+                PublishedStats.Write(Stats);
+            }
+
+            if (!running && !gotPacket)
+                break;
+
+            // no new frames doesn't mean no sound, and the audio capture only buffers so much
+            if (!gotPacket && !firstVideo && audioCapture && Config.VariableFrameRate)
+                sendAudio();
         }
 
         if (Config.BlinkScrollLock && scrlOn)
@@ -199,222 +449,451 @@ class ScreenCapture : public IScreenCapture
         uint scale;           // upscale factor, only when UPSCALE is defined
         uint _pad[1];
         Mat44 colormatrix;    // convert to ST 2020 and normalize to 10000 nits
+        Vec4 pqcoeffs[ST2084Approx::OCTAVES];
+        uint tiling;          // only convert the tiles in the tile list
+        uint _pad2;
+        uint groupsX, groupsY; // size of the input in thread groups
     };
 
-    void CaptureThreadFunc(Thread& thread)
+    // closes the current file after everything that was submitted for it is written.
+    // The encoder stays as it is, ready to start the next file with a keyframe.
+    void StopOutput()
     {
-        bool first = true;
-        int duplicated = 0;
-        int over = 0;
-        double lastFrameTime = GetTime();
-        double ltf2 = lastFrameTime;
-        double frameDuration = 0;
-        uint upscale = 1;
-
-        double vInSkew = 0;
-        uint64 lastFrameCount = 0;
-
-        Mat44 yuvMatrix;
+        if (!processThread)
+            return;
+
+        // if the last frame stayed on until now, the file only knows that from a packet after it,
+        // so the last repeat gets encoded after all (at the time it would have been captured)
+        if (repeats)
+        {
+            double time = lastSubmitted + repeats * (double)rateDen / rateNum;
+            repeats--;
+            EncodeDuplicate(time);
+        }
+
+        // what's still in the encoder (eg. in a software encoder's lookahead) belongs into this file
+        encoder->Drain();
+        Delete(processThread);
+        Delete(trace);
+        encoder->ForceKeyframe();
+    }
+
+    // tells the encoder how long the last frame stayed on. With variable frame rate the times say that.
+    void SendRepeats()
+    {
+        if (!Config.VariableFrameRate)
+            for (uint i = 0; i < repeats; i++)
+                encoder->RepeatFrame();
+        repeats = 0;
+    }
+
+    void EncodeDuplicate(double time)
+    {
+        SendRepeats();
+        encoder->DuplicateFrame(time);
+        Timings.Enqueue({ .Time = time, .Submit = GetTicks() });
+    }
+
+    // with DuplicateMode::Repeat or VariableFrameRate, the last frame just stays on screen longer instead
+    void DuplicateFrame()
+    {
+        AtomicInc(framesDuplicated);
+        if (Config.VariableFrameRate || Config.Duplicates == DuplicateMode::Repeat)
+        {
+            repeats++;
+            AtomicInc(framesRepeated);
+            return;
+        }
+        EncodeDuplicate(lastSubmitted);
+    }
+
+    // everything that depends on the screen mode. The last one stays around after
+    // switching modes (see cfg.SessionCacheMB), so switching back is cheap.
+    struct Session
+    {
+        // what the screen looks like
+        uint scrSizeX, scrSizeY;
+        uint rateNum, rateDen;
+        PixelFormat format;
+        bool isHdr;
+
+        uint sizeX, sizeY;  // what gets encoded
+        uint upscale;
+        IEncode* encoder;
         RCPtr<GpuByteBuffer> outBuffer;
+        RCPtr<Texture> uploadTex; // for frames that come from the CPU
+        RCPtr<Shader> shader;
+        ConvertPara convert;
+        DirtyTiles dirty;   // of the screen, what needs to be converted again in outBuffer
+        RCPtr<Shader> hashShader;       // for textures, CPU frames get hashed on the CPU
+        RCPtr<GpuByteBuffer> hashBuffer;
 
-        uint scrSizeX = 0, scrSizeY = 0;
+        uint64 memory;      // video memory it takes, roughly
+        uint64 lastUsed;
+
+        bool Matches(const CaptureInfo& info) const
+        {
+            return scrSizeX == info.sizeX && scrSizeY == info.sizeY && rateNum == info.rateNum && rateDen == info.rateDen && format == info.format && isHdr == info.isHdr;
+        }
+    };
+
+    // NVENC only allows a few sessions at a time on consumer cards, and we might not be the only ones
+    // using it (OBS, Discord, ...), so there's only ever one idle session next to the one in use
+    static constexpr uint MAX_SESSIONS = 2;
+
+    Array<Session*> Sessions;
+    uint64 sessionUses = 0;
+    double setupTime = 0;   // ms it took to get the current session ready
+    bool setupCached = false;
+
+    void DeleteSession(Session* s)
+    {
+        delete s->encoder;
+        delete s;
+    }
+
+    // throws out the least recently used sessions until there's room for one that takes needMemory
+    void TrimSessions(uint64 needMemory)
+    {
+        uint64 budget = (uint64)Config.SessionCacheMB << 20;
+        for (;;)
+        {
+            uint64 used = needMemory;
+            int lru = -1;
+            for (uint i = 0; i < Sessions.Len(); i++)
+            {
+                used += Sessions[i]->memory;
+                if (lru < 0 || Sessions[i]->lastUsed < Sessions[lru]->lastUsed)
+                    lru = (int)i;
+            }
+            if (lru < 0 || (used <= budget && Sessions.Len() < MAX_SESSIONS))
+                return;
+
+            DeleteSession(Sessions[lru]);
+            Sessions.RemAt(lru);
+        }
+    }
+
+    Session* GetSession(const CaptureInfo& info)
+    {
+        for (auto s : Sessions)
+            if (s->Matches(info))
+            {
+                s->lastUsed = ++sessionUses;
+                setupCached = true;
+                return s;
+            }
+
+        Session* s = new Session
+        {
+            .scrSizeX = info.sizeX,
+            .scrSizeY = info.sizeY,
+            .rateNum = info.rateNum,
+            .rateDen = info.rateDen,
+            .format = info.format,
+            .isHdr = info.isHdr,
+            .sizeX = info.sizeX,
+            .sizeY = info.sizeY,
+            .upscale = 1,
+        };
+
+        if (Config.Upscale)
+        {
+            while (s->sizeY * s->upscale < Config.UpscaleTo)
+                s->upscale++;
+            s->sizeX *= s->upscale;
+            s->sizeY *= s->upscale;
+        }
+
+        // the conversion buffer, the encoder's input and reference frames
+        auto fmt = GetProfileBufferFormat(Config.CodecCfg.Profile);
+        auto fi = GetFormatInfo(fmt, s->sizeX, s->sizeY);
+        s->memory = 8ull * fi.lines * fi.pitch;
+        TrimSessions(s->memory);
+
+        s->encoder = CreateEncode(Config, s->isHdr);
+        fmt = s->encoder->GetBufferFormat();
+        fi = GetFormatInfo(fmt, s->sizeX, s->sizeY);
+        s->outBuffer = new GpuByteBuffer(fi.lines * fi.pitch, GpuBuffer::Usage::GpuOnly);
+        s->convert = MakeConvertPara(s->format, s->sizeX, s->sizeY, s->upscale, fmt, s->isHdr, Config.FastPQ);
+        s->dirty.Init(s->scrSizeX, s->scrSizeY);
+
+        auto source = LoadResource(IDR_COLORCONVERT, TEXTFILE);
+        ShaderDefine defines[] =
+        {
+            "OUTFORMAT", String::PrintF("%d", (int)fmt),
+            "UPSCALE", s->upscale > 1 ? "1":"0",
+            "HDR", s->convert.Hdr ? "1" : "0",
+            "FASTPQ", s->convert.FastPQ ? "1" : "0",
+        };
+
+        s->shader = CompileShader(Shader::Type::Compute, source.Cast<char>(), "csc", "colorconvert.hlsl", defines);
+
+        if (!info.tex)
+            s->uploadTex = CreateTexture({ .sizeX = info.sizeX, .sizeY = info.sizeY, .format = info.format }, nullptr);
+        else if (Config.DedupeFrames)
+        {
+            s->hashShader = CompileShader(Shader::Type::Compute, source.Cast<char>(), "tilehash", "colorconvert.hlsl", defines);
+            s->hashBuffer = new GpuByteBuffer(8 * s->dirty.GetTileCount(), GpuBuffer::Usage::GpuOnly);
+        }
+
+        s->encoder->Init(s->sizeX, s->sizeY, s->rateNum, s->rateDen, s->outBuffer);
+
+        s->lastUsed = ++sessionUses;
+        Sessions += s;
+        setupCached = false;
+        return s;
+    }
+
+    static RCPtr<StructuredBuffer<uint>> MakeTileBuffer(const Array<uint>& tiles)
+    {
+        RCPtr<StructuredBuffer<uint>> buffer = new StructuredBuffer<uint>(tiles.Len());
+        memcpy(buffer->BeginLoad().Ptr(), tiles.Ptr(), tiles.Len() * sizeof(uint));
+        buffer->EndLoad(tiles.Len());
+        return buffer;
+    }
+
+    // takes the dirty tiles whose content is the same as when they were last converted
+    // off the list. Returns true if that leaves none, so the frame is the same as the last one.
+    // Textures get hashed on the GPU, and reading that back waits for it to finish.
+    bool DedupeTiles(Session* session, const CaptureInfo& info, Array<uint>& tiles, Array<uint64>& hashes)
+    {
+        int64 start = GetTicks();
+        tiles.Clear();
+        session->dirty.GetDirty(tiles);
+        hashes.SetSize(tiles.Len());
+
+        if (info.tex)
+        {
+            CBindings bind;
+            bind.res[0] = info.tex;
+            bind.res[1] = MakeTileBuffer(tiles);
+            bind.uav[0] = session->hashBuffer;
+            Dispatch(session->hashShader, bind, tiles.Len(), 1, 1);
+            ReadBuffer(session->hashBuffer, Span<uint8>((uint8*)hashes.Ptr(), hashes.Len() * sizeof(uint64)));
+        }
+        else
+            HashTiles(info.data.Ptr(), info.pitch, info.sizeX, info.sizeY, info.format, tiles, hashes.Ptr());
+
+        bool same = !session->dirty.KeepChanged(tiles, hashes.Ptr());
+        hashTicks += GetTicks() - start;
+        AtomicInc(framesHashed);
+        return same;
+    }
+
+    void CaptureThreadFunc(Thread& thread)
+    {
+        Session* session = nullptr;
+        uint idleDups = 0;
+        Array<uint> tiles;
+        Array<uint64> hashes;
 
         while (thread.IsRunning())
         {
             bool record = !Config.RecordOnlyFullscreen || IsFullscreen();
-            Stats.Recording = record;
+            recording = record;
 
             CaptureInfo info;
-            if (CaptureFrame(2, info))
+            if (Source->AcquireFrame(2, info))
             {
                 double time = GetTime();
-                double deltaf = (time - ltf2) * (double)info.rateNum / info.rateDen;                
-
-                lastFrameTime = ltf2 = time;
 
                 if (!record)
                 {
-                    Delete(processThread);
-                    Delete(encoder);
-                    scrSizeX = scrSizeY = 0;
-                    ReleaseFrame();
-                    for (int i = 0; i < 32; i++)
-                        if (Stats.VU[i] > 0)
-                            Stats.VU[i] = 0;
-                    continue;
-                }
-
-                if (scrSizeX != info.sizeX || scrSizeY != info.sizeY || rateNum != info.rateNum || rateDen != info.rateDen || pixfmt != info.tex->para.format || isHdr != info.isHdr)
-                {
-                    // (re)init encoder and processing thread, starts new output file
-                    scrSizeX = sizeX = info.sizeX;
-                    scrSizeY = sizeY = info.sizeY;
-                    rateNum = info.rateNum;
-                    rateDen = info.rateDen;
-                    pixfmt = info.tex->para.format;
-                    isHdr = info.isHdr;
-                    frameDuration = (double)info.rateDen / info.rateNum;
-
-                    upscale = 1;
-                    if (Config.Upscale)
+                    // stand by with everything set up, so we're back quickly when recording resumes
+                    if (processThread)
                     {
-                        while (sizeY * upscale < Config.UpscaleTo)
-                            upscale++;
-                        sizeX *= upscale;
-                        sizeY *= upscale;
+                        StopOutput();
+                        Pacer.Reset(rateNum, rateDen, time);
                     }
+                    startTicks = 0;
+                    setupTime = 0;
+                    setupCached = false;
+                    if (session)
+                        session->dirty.MarkAll();
+                    Source->ReleaseFrame();
+                    continue;
+                }
 
-                    if (encoder)
-                        encoder->Flush();
-
-                    Delete(processThread);
-                    Delete(encoder);
-
-                    encoder = CreateEncodeNVENC(Config, isHdr);
+                if (!startTicks)
+                    startTicks = GetTicks();
 
-                    auto fmt = encoder->GetBufferFormat();
-                    auto fi = GetFormatInfo(fmt, sizeX, sizeY);
-                    outBuffer = new GpuByteBuffer(fi.lines * fi.pitch, GpuBuffer::Usage::GpuOnly);
-                   
-                    auto source = LoadResource(IDR_COLORCONVERT, TEXTFILE);
-                    ShaderDefine defines[] =
-                    {
-                        "OUTFORMAT", String::PrintF("%d", (int)fmt),
-                        "UPSCALE", upscale > 1 ? "1":"0",
-                        "HDR", (isHdr && pixfmt == PixelFormat::RGBA16F) ? "1" : "0",
-                    };
-                 
-                    Shader = CompileShader(Shader::Type::Compute, source.Cast<char>(), "csc", "colorconvert.hlsl", defines);
-
-                    switch (fmt)
-                    {
-                    case IEncode::BufferFormat::BGRA8: 
-                        yuvMatrix = {}; 
-                        break;
-                    default:
-                        yuvMatrix = MakeRGB2YUV44(isHdr ? Rec2020 : Rec709, fi.ymin, fi.ymax, fi.uvmin, fi.uvmax);
-                    }
-                    yuvMatrix = yuvMatrix * Mat44::Scale(fi.amp);
-                    
-                    encoder->Init(sizeX, sizeY, rateNum, rateDen, outBuffer);
-                    first = true;
-                    duplicated = 0;
-                    over = 0;
-
-                    lastFrameCount = 0;
+                if (!session || !session->Matches(info))
+                {
+                    // switch encoder and processing thread to the new mode, starts new output file.
+                    // StopOutput() drains the old encoder into its file, so it's empty when it gets put aside or deleted
+                    startTicks = GetTicks();
+                    StopOutput();
+
+                    session = GetSession(info);
+                    session->dirty.MarkAll();
+                    encoder = session->encoder;
+                    sizeX = session->sizeX;
+                    sizeY = session->sizeY;
+                    rateNum = session->rateNum;
+                    rateDen = session->rateDen;
+                    pixfmt = session->format;
+                    isHdr = session->isHdr;
+
+                    setupTime = (GetTicks() - startTicks) * 1000.0 / ticksPerSecond;
+                    Pacer.Reset(rateNum, rateDen, time);
                 }
                 else
                 {
-                    int deltaFrames = (int)(info.frameCount - lastFrameCount);
-                    ASSERT(deltaFrames < 0x8000000000000000);
-                    lastFrameCount = info.frameCount;
+                    auto pace = Pacer.Frame(time, info.frameCount);
+
+                    // remember what changed even if this frame doesn't get converted
+                    if (Config.ConvertDirtyOnly && !pace.First)
+                        session->dirty.Mark(info);
+                    else
+                        session->dirty.MarkAll();
 
                     // Encode frame
-                    if (first)
+                    if (pace.First)
                     {
-                        first = false;
+                        filename = MakeFilename();
+                        if (Config.WriteTrace)
+                        {
+                            CaptureTraceHeader th;
+                            th.TicksPerSecond = GetTicksPerSecond();
+                            th.RateNum = rateNum;
+                            th.RateDen = rateDen;
+                            th.SizeX = session->scrSizeX;
+                            th.SizeY = session->scrSizeY;
+                            trace = new CaptureTraceWriter(filename + ".trace", th);
+                        }
+                        framesCaptured = framesDuplicated = framesStatic = framesDeduped = framesRepeated = framesHashed = 0;
+                        tilesConverted = tilesTotal = 0;
+                        hashTicks = 0;
+                        ResetLatency();
+                        outputStart = info.time;
                         processThread = new Thread(Bind(this, &ScreenCapture::ProcessThreadFunc));
                     }
-                    else
-                    {
-                        int dup = Max(1, deltaFrames) - 1 - duplicated;
 
-                        if (dup < 0)
-                        {
-                            over -= dup;
-                            dup = 0;
-                        }
-                        else
-                        {
-                            int doover = Min(dup, over);
-                            dup -= doover;
-                            over -= doover;
-                        }
+                    if (trace)
+                    {
+                        trace->Write({
+                            .PresentTicks = info.presentTicks,
+                            .FrameCount = info.frameCount,
+                            .AcquireTicks = (uint)Clamp<int64>(info.acquireTicks - info.presentTicks, 0, 0xffffffff),
+                            .Compensation = (int16)info.frameComp,
+                            .Duplicates = (uint16)Min(pace.Duplicates, 0xffffu),
+                            .IdleDuplicates = (uint16)Min(idleDups, 0xffffu),
+                            .Flags = (uint8)((pace.Submit ? CaptureTraceRecord::SUBMITTED : 0) | (pace.First ? CaptureTraceRecord::FIRST : 0)),
+                        });
+                    }
+                    idleDups = 0;
 
-                        for (int i = 0; i < dup; i++)
-                        {
-                            encoder->DuplicateFrame();
-                            AtomicInc(Stats.FramesDuplicated);
-                        }
+                    for (uint i = 0; i < pace.Duplicates; i++)
+                        DuplicateFrame();
+                  
+                    // the screen says something changed, but maybe it only got drawn again the same way
+                    bool deduped = false;
+                    if (pace.Submit && !pace.First && Config.DedupeFrames && session->dirty.GetDirtyCount())
+                        deduped = DedupeTiles(session, info, tiles, hashes);
 
-                        if (deltaFrames)
-                        {
-                            double curfps = (double)info.rateNum / ((double)info.rateDen * deltaFrames);
-                            if (!fps) fps = curfps;
-                            fps += 0.03 * (curfps - fps);
-                        }
+                    if (pace.Submit && !session->dirty.GetDirtyCount())
+                    {
+                        // nothing changed since the last conversion, so it's the same frame again
+                        tilesTotal += session->dirty.GetTileCount();
+                        DuplicateFrame();
+                        AtomicInc(deduped ? framesDeduped : framesStatic);
                     }
-                  
-                    if (deltaFrames)
+                    else if (pace.Submit)
                     {
-                        constexpr auto hdrConvertMatrix = Mat44(Rec709.GetConvertTo(Rec2020) * Mat33::Scale(80.f / 10000.0f), Vec3(0)).Transpose();
-
                         auto fi = GetFormatInfo(encoder->GetBufferFormat(), sizeX, sizeY);
 
+                        // only the tiles that changed, unless that's all of them
+                        uint up = session->upscale;
+                        uint groupsX = (sizeX / up + 7) / 8, groupsY = (sizeY / up + 7) / 8;
+                        uint dirtyTiles = session->dirty.GetDirtyCount();
+                        bool tiled = dirtyTiles < session->dirty.GetTileCount() && dirtyTiles * 8 <= 65535;
+                        tilesConverted += dirtyTiles;
+                        tilesTotal += session->dirty.GetTileCount();
+
+                        tiles.Clear();
+                        session->dirty.Take(tiles);
+                        RCPtr<StructuredBuffer<uint>> tileBuffer;
+                        if (tiled)
+                            tileBuffer = MakeTileBuffer(tiles);
+
                         // color space conversion
                         CBuffer<CbConvert> cb;
-                        cb->yuvmatrix = yuvMatrix.Transpose();
+                        cb->yuvmatrix = session->convert.YuvMatrix.Transpose();
                         cb->pitch = fi.pitch;
                         cb->height = sizeY;
-                        cb->scale = upscale;
-                        cb->colormatrix = hdrConvertMatrix;
+                        cb->scale = session->upscale;
+                        cb->colormatrix = session->convert.ColorMatrix.Transpose();
+                        memcpy(cb->pqcoeffs, GetST2084Approx().Coeffs, sizeof(cb->pqcoeffs));
+                        cb->tiling = tiled;
+                        cb->groupsX = groupsX;
+                        cb->groupsY = groupsY;
+
+                        if (!info.tex)
+                            UpdateTexture(session->uploadTex, info.data.Ptr(), info.pitch);
 
                         CBindings bind;
-                        bind.res[0] = info.tex;
-                        bind.uav[0] = outBuffer;
+                        bind.res[0] = info.tex.IsValid() ? info.tex : session->uploadTex;
+                        bind.res[1] = tileBuffer;
+                        bind.uav[0] = session->outBuffer;
                         bind.cb[0] = &cb;
 
-                        Dispatch(Shader, bind, (sizeX + 7) / 8, (sizeY + 7) / 8, 1);
+                        // upscaling goes over the source pixels, see colorconvert.hlsl
+                        if (tiled)
+                            Dispatch(session->shader, bind, 8 * tiles.Len(), 8, 1);
+                        else
+                            Dispatch(session->shader, bind, groupsX, groupsY, 1);
+                        int64 convertTicks = GetTicks();
 
+                        SendRepeats();
                         encoder->SubmitFrame(info.time);
-                        AtomicInc(Stats.FramesCaptured);
+                        AtomicInc(framesCaptured);
+
+                        FrameTiming timing =
+                        {
+                            .Time = info.time,
+                            .Present = info.presentTicks,
+                            .Acquire = info.acquireTicks,
+                            .Convert = convertTicks,
+                            .Submit = GetTicks(),
+                        };
+                        AddLatency(CaptureStats::Stage::Acquire, timing.Present, timing.Acquire);
+                        AddLatency(CaptureStats::Stage::Convert, timing.Acquire, timing.Convert);
+                        AddLatency(CaptureStats::Stage::Submit, timing.Convert, timing.Submit);
+                        Timings.Enqueue(timing);
+                        lastSubmitted = info.time;
                     }
                 }
-                ReleaseFrame();
-
-                // (it's that easy)
-                duplicated = 0;
+                Source->ReleaseFrame();
             }
 
-            if (encoder && !first)
+            if (encoder && Pacer.IsRunning())
             {
-                // if more than a certain time has passed without a new image, assume a skipped frame
-                double time = GetTime();
-                while (time - lastFrameTime > 2.5 * frameDuration)
-                {
-                    if (over)
-                    {
-                        over--;
-                    }
-                    else
-                    {
-                        encoder->DuplicateFrame();
-                        AtomicInc(Stats.FramesDuplicated);
-                        duplicated++;
-                    }
-
-                    lastFrameTime += frameDuration;
-                    double curfps = (double)info.rateNum / ((double)info.rateDen * (duplicated + 1.0));
-                    fps += 0.03 * (curfps - fps);
-                }
+                uint dup = Pacer.Idle(GetTime());
+                idleDups += dup;
+                for (uint i = 0; i < dup; i++)
+                    DuplicateFrame();
             }
         }
 
-        if (encoder)
-            encoder->Flush();
-
-        delete processThread;
-        delete encoder;
-       
+        StopOutput();
+        for (auto s : Sessions)
+            DeleteSession(s);
+        Sessions.Clear();
+        encoder = nullptr;
     }
 
 public:
 
-    RCPtr<Shader> Shader;
-
-    ScreenCapture(const CaptureConfig& cfg) : Config(cfg)
+    ScreenCapture(const CaptureConfig& cfg, IFrameSource* source) : Config(cfg)
     {
+        // mp4 can't hold FFV1, and the muxer would only find out when writing the header
+        if (Config.CodecCfg.Profile == CodecProfile::FFV1 && Config.UseContainer == Container::Mp4)
+            Config.UseContainer = Container::Mov;
+
         InitD3D(Config.OutputIndex);
+        ticksPerSecond = GetTicksPerSecond();
+        Source = source ? source : CreateFrameSourceDXGI();
        
         if (Config.CaptureAudio)
             audioCapture = CreateAudioCaptureWASAPI(Config);
@@ -422,17 +901,48 @@ public:
 
         for (int i = 0; i < 32; i++)
             Stats.VU[i] = i ? -1.0f : 0.0f;
+        PublishedStats.Write(Stats);
     }
 
     ~ScreenCapture()
     {
         delete captureThread;
         delete audioCapture;
+        delete Source;
         ExitD3D();
     }
 
-    const CaptureStats &GetStats() override { return Stats; }
+    CaptureStats GetStats() override
+    {
+        CaptureStats stats = PublishedStats.Read();
+        stats.Recording = recording;
+        stats.FramesCaptured = framesCaptured;
+        stats.FramesDuplicated = framesDuplicated;
+        stats.FramesStatic = framesStatic;
+        stats.FramesDeduped = framesDeduped;
+        stats.FramesRepeated = framesRepeated;
+        stats.HashTime = framesHashed ? 1000.0 * hashTicks / ((double)ticksPerSecond * framesHashed) : 0;
+        stats.TilesConverted = tilesTotal ? (double)tilesConverted / tilesTotal : 0;
+
+        for (int i = 0; i < CaptureStats::STAGES; i++)
+        {
+            auto s = StageLatency[i].GetSummary();
+            stats.Latencies[i] = { .Count = s.Count, .P50 = s.P50 / 1000.f, .P99 = s.P99 / 1000.f, .P999 = s.P999 / 1000.f, .Max = s.Max / 1000.f };
+        }
+
+        // the process thread is gone while we're paused, so the levels won't fall by themselves
+        if (!recording)
+            for (int i = 0; i < 32; i++)
+                if (stats.VU[i] > 0)
+                    stats.VU[i] = 0;
+        return stats;
+    }
+
+    uint64 GetFrames(uint64 cursor, Array<CaptureStats::Frame>& into) override { return FrameHistory.Read(cursor, into); }
+    uint GetFrameRanges(uint maxPoints, Array<CaptureStats::FrameRange>& into) override { return FramePyramid.Read(maxPoints, into); }
+
+    void SaveReplay() override { saveReplay = true; }
 };
 
 
-IScreenCapture* CreateScreenCapture(const CaptureConfig& config) { return new ScreenCapture(config); }
\ No newline at end of file
+IScreenCapture* CreateScreenCapture(const CaptureConfig& config, IFrameSource* source) { return new ScreenCapture(config, source); }
\ No newline at end of file
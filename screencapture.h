@@ -18,18 +18,45 @@ enum class CodecProfile
     HEVC_MAIN_444,
     HEVC_MAIN10_444,
     HEVC_LOSSLESS,
+    FFV1,           // lossless, software only, needs .mov or .mkv (.mp4 turns into .mov)
 };
 
 enum class BitrateControl { CBR, CONSTQP, };
 enum class Container { Mp4, Mov, Mkv };
 enum class AudioCodec { PCM_S16, PCM_F32, MP3, AAC };
 enum class FrameConfig { I, IP, /* IBP, IBBP, */ };
+enum class VideoEncoder { Auto, NVENC, LibAV, Null };
+enum class NullPattern { Constant, Keyframes, Trace };
+enum class MuxOverflow { Block, Drop };
+enum class DuplicateMode { Encode, Repeat };
 
-JSON_DEFINE_ENUM(CodecProfile, "h264_main", "h264_high", "h264_high_444", "hevc_main", "hevc_main10", "hevc_main_444", "hevc_main10_444", "hevc_lossless")
+JSON_DEFINE_ENUM(CodecProfile, "h264_main", "h264_high", "h264_high_444", "hevc_main", "hevc_main10", "hevc_main_444", "hevc_main10_444", "hevc_lossless", "ffv1")
 JSON_DEFINE_ENUM(BitrateControl, "cbr", "constqp")
 JSON_DEFINE_ENUM(Container, "mp4", "mov", "mkv")
 JSON_DEFINE_ENUM(AudioCodec, "pcm_s16", "pcm_f32", "mp3", "aac")
 JSON_DEFINE_ENUM(FrameConfig, "i", "ip" )
+JSON_DEFINE_ENUM(VideoEncoder, "auto", "nvenc", "libav", "null")
+JSON_DEFINE_ENUM(NullPattern, "constant", "keyframes", "trace")
+JSON_DEFINE_ENUM(DuplicateMode, "encode", "repeat")
+JSON_DEFINE_ENUM(MuxOverflow, "block", "drop")
+
+// fake packets instead of encoding, to measure what everything else costs
+struct NullEncoderConfig
+{
+    NullPattern Pattern = NullPattern::Constant;
+    uint PacketSize = 40000;        // bytes
+    uint KeyframeSize = 400000;     // bytes, first frame of every GOP with the Keyframes pattern
+    float LatencyMs = 0;            // from submitting a frame until its packet comes out
+    String SizeTrace;               // Trace pattern: text file with a packet size per line, gets looped
+
+    JSON_BEGIN();
+        JSON_ENUM(Pattern);
+        JSON_VALUE(PacketSize);
+        JSON_VALUE(KeyframeSize);
+        JSON_VALUE(LatencyMs);
+        JSON_VALUE(SizeTrace);
+    JSON_END();
+};
 
 struct VideoCodecConfig
 {
@@ -41,12 +68,19 @@ struct VideoCodecConfig
     FrameConfig FrameCfg = FrameConfig::IP;
     uint GopSize = 60; // 0: auto
 
+    VideoEncoder UseEncoder = VideoEncoder::Auto; // auto: NVENC if there's an NVIDIA GPU, libavcodec otherwise
+    String SoftwarePreset = "veryfast"; // x264/x265 speed preset for the libavcodec encoder
+    NullEncoderConfig NullCfg;
+
     JSON_BEGIN();
         JSON_ENUM(Profile);
         JSON_ENUM(UseBitrateControl);
         JSON_VALUE(BitrateParameter);
         JSON_ENUM(FrameCfg);
         JSON_VALUE(GopSize);
+        JSON_ENUM(UseEncoder);
+        JSON_VALUE(SoftwarePreset);
+        JSON_VALUE(NullCfg);
     JSON_END();
 };
 
@@ -57,6 +91,19 @@ struct CaptureConfig
     String NamePrefix = "capture";
     Container UseContainer = Container::Mov;
     bool BlinkScrollLock = true;
+    bool WriteTrace = false; // write frame timing into a .trace file next to the recording
+    bool NullOutput = false; // throw all packets away instead of writing a file (for benchmarking)
+    uint MuxBufferMB = 256; // packets waiting to be written by the mux thread; 0: write right away
+    MuxOverflow OnMuxOverflow = MuxOverflow::Block; // if the buffer runs full: wait, or drop video until the next keyframe
+    uint WriteBufferMB = 8; // the file gets written in chunks of this size by its own thread; 0: let libavformat write it
+    bool UnbufferedIO = false; // bypass the OS file cache (with WriteBufferMB > 0)
+    uint PreallocateMB = 0; // reserve this much disk space when creating a file, so it doesn't end up scattered over the disk (with WriteBufferMB > 0)
+    bool Fragmented = false; // mp4/mov: write the file in self-contained fragments, so it stays playable if the capture dies and stopping doesn't have to write a huge index
+    float FragmentSeconds = 2; // fragment length; they start at keyframes if possible
+    float SegmentMinutes = 0; // start a new file (at a keyframe) after this long; 0: never
+    uint SegmentMB = 0; // start a new file (at a keyframe) before it gets bigger than this; 0: no limit
+    float ReplaySeconds = 0; // don't record, but keep this much in memory and save it on a hotkey (Win+F10); 0: off
+    uint ReplayMB = 1024; // memory for the replay buffer; if it runs full, it holds less than ReplaySeconds
 
     // video settings
     uint OutputIndex = 0; // 0: default
@@ -64,6 +111,12 @@ struct CaptureConfig
     uint UpscaleTo = 2160;
     VideoCodecConfig CodecCfg;
     bool RecordOnlyFullscreen = true;
+    bool FastPQ = true; // HDR: approximate the PQ curve (off by 1/15 of a 10 bit code at most) instead of calculating it exactly
+    bool ConvertDirtyOnly = true; // only color convert the parts of the screen that changed, and encode frames where nothing did as duplicates
+    bool DedupeFrames = false; // hash what changed, so parts drawn again the same way count as unchanged
+    DuplicateMode Duplicates = DuplicateMode::Encode; // encode duplicated frames again, or let the last frame stay on longer in the file (frames can then be several frame times long, but stay on the frame rate's grid)
+    bool VariableFrameRate = false; // don't encode duplicated frames at all, and write every frame at its capture time instead of at a constant rate
+    uint SessionCacheMB = 1024; // keep the encoder for the last screen mode around, so switching back is quick, if it takes less than roughly this much video memory; 0: off
 
     // audio settings
     bool CaptureAudio = true;
@@ -76,11 +129,30 @@ struct CaptureConfig
         JSON_VALUE(NamePrefix)
         JSON_ENUM(UseContainer)
         JSON_VALUE(BlinkScrollLock)
+        JSON_VALUE(WriteTrace)
+        JSON_VALUE(NullOutput)
+        JSON_VALUE(MuxBufferMB)
+        JSON_ENUM(OnMuxOverflow)
+        JSON_VALUE(WriteBufferMB)
+        JSON_VALUE(UnbufferedIO)
+        JSON_VALUE(PreallocateMB)
+        JSON_VALUE(Fragmented)
+        JSON_VALUE(FragmentSeconds)
+        JSON_VALUE(SegmentMinutes)
+        JSON_VALUE(SegmentMB)
+        JSON_VALUE(ReplaySeconds)
+        JSON_VALUE(ReplayMB)
         JSON_VALUE(OutputIndex)
         JSON_VALUE(Upscale)
         JSON_VALUE(UpscaleTo)
         JSON_VALUE(CodecCfg)
         JSON_VALUE(RecordOnlyFullscreen)
+        JSON_VALUE(FastPQ)
+        JSON_VALUE(ConvertDirtyOnly)
+        JSON_VALUE(DedupeFrames)
+        JSON_ENUM(Duplicates)
+        JSON_VALUE(VariableFrameRate)
+        JSON_VALUE(SessionCacheMB)
         JSON_VALUE(CaptureAudio)
         JSON_VALUE(AudioOutputIndex)
         JSON_ENUM(UseAudioCodec)
@@ -100,6 +172,33 @@ struct CaptureStats
         double Bitrate;
     };
 
+    // a run of frames, downsampled
+    struct FrameRange
+    {
+        Frame Min;
+        Frame Max;
+        Frame Mean;
+    };
+
+    // where the time goes between a present on screen and its packet being in the file.
+    // Timestamps are taken on the CPU, so GPU work shows up in whichever stage waits for it.
+    enum class Stage
+    {
+        Acquire,    // present -> frame acquired
+        Convert,    // -> color conversion dispatched
+        Submit,     // -> handed to the encoder
+        Encode,     // -> packet out of the encoder
+        Mux,        // -> packet handed to the output (queued, with a mux buffer)
+        Total,      // present -> packet written
+    };
+    static constexpr int STAGES = 6;
+
+    struct Latency
+    {
+        uint64 Count;
+        float P50, P99, P999, Max;  // in milliseconds
+    };
+
     bool Recording;
 
     int SizeX;
@@ -110,15 +209,39 @@ struct CaptureStats
     double FPS;
     double AvgBitrate;
     double MaxBitrate;
-    Array<Frame> Frames = Array<Frame>((size_t)40000);
+    uint64 FirstFrame;      // cursor of the current file's first entry in the frame history (see IScreenCapture::GetFrames)
+    double StartDelay;      // ms from deciding to record until the first packet went out
+    double SetupTime;       // ms of that it took to set up for a new screen mode (0 if there wasn't one)
+    bool SetupCached;       // ... using an encoder that was still around from earlier
 
     uint FramesCaptured;
-    uint FramesDuplicated;      
+    uint FramesDuplicated;
+    uint FramesStatic;          // of the duplicated ones: nothing on the screen changed, so no need to convert and encode it
+    uint FramesDeduped;         // of the duplicated ones: the screen said something changed, but the hashes didn't
+    uint FramesRepeated;        // of the duplicated ones: not encoded, the last frame just stays on longer
+    double TilesConverted;      // how much of the screen got converted per captured frame, on average
+    double HashTime;            // ms it took to hash a frame, on average
+
+    Latency Latencies[STAGES];  // of the current file; duplicated frames only count for Encode and Mux
+
+    uint64 MuxQueued;           // bytes waiting to be written
+    uint64 MuxHighWater;
+    uint64 MuxCapacity;
+    uint MuxDropped;            // video packets lost because the mux buffer was full
+    uint MuxStalls;             // times encoding had to wait for it
+
+    uint64 DiskWritten;         // bytes of the current file that are on disk
+    double DiskBusy;            // seconds spent writing them
+    double DiskStall;           // seconds the muxer had to wait for the disk
+
+    uint64 ReplayBytes;         // in the replay buffer
+    double ReplayLength;        // seconds in the replay buffer
+    uint ReplaysSaved;
 
     float VU[32] = { -1.f };
     float VUPeak[32] = { -1.f };
 
-    String Filename;
+    char Filename[260];
 };
 
 
@@ -127,8 +250,23 @@ class IScreenCapture
 public:
     virtual ~IScreenCapture() {}
 
-    virtual const CaptureStats &GetStats() = 0;
+    // snapshot of the current state, cheap enough to call for every repaint
+    virtual CaptureStats GetStats() = 0;
+
+    // appends the per frame stats since cursor (0: as far back as they go) to into,
+    // returns the cursor for the next call
+    virtual uint64 GetFrames(uint64 cursor, Array<CaptureStats::Frame>& into) = 0;
+
+    // per frame stats of the whole current file, downsampled to at most maxPoints entries
+    // (and more than maxPoints/2, as soon as there are enough frames). Returns the # of frames per entry;
+    // the last one can have fewer.
+    virtual uint GetFrameRanges(uint maxPoints, Array<CaptureStats::FrameRange>& into) = 0;
+
+    // with a replay buffer (cfg.ReplaySeconds): write what's in it to a new file
+    virtual void SaveReplay() = 0;
 };
 
-// run a screen capture instance
-IScreenCapture* CreateScreenCapture(const CaptureConfig& config);
\ No newline at end of file
+class IFrameSource;
+
+// run a screen capture instance. Takes ownership of the frame source (default: screen output via DXGI)
+IScreenCapture* CreateScreenCapture(const CaptureConfig& config, IFrameSource* source = nullptr);
\ No newline at end of file
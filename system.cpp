@@ -50,6 +50,14 @@ const char* LastErrorString() { return ErrorString(GetLastError()); }
 
 uint AtomicInc(uint& a) { return InterlockedIncrement(&a); }
 uint AtomicDec(uint& a) { return InterlockedDecrement(&a); }
+uint AtomicAdd(uint& a, uint add) { return (uint)InterlockedAdd((volatile LONG*)&a, (LONG)add); }
+
+// aligned 32 and 64 bit accesses are atomic on x64, and volatile gives us acquire/release (/volatile:ms)
+uint AtomicLoad(const uint& a) { return *(const volatile uint*)&a; }
+void AtomicStore(uint& a, uint v) { *(volatile uint*)&a = v; }
+uint64 AtomicLoad(const uint64& a) { return *(const volatile uint64*)&a; }
+void AtomicStore(uint64& a, uint64 v) { *(volatile uint64*)&a = v; }
+void AtomicFence() { MemoryBarrier(); }
 
 //----------------------------------------------------------------------------------------------
 //----------------------------------------------------------------------------------------------
@@ -64,6 +72,13 @@ int64 GetTicks()
     return pc.QuadPart;
 }
 
+int64 GetTicksPerSecond()
+{
+    LARGE_INTEGER pf;
+    QueryPerformanceFrequency(&pf);
+    return pf.QuadPart;
+}
+
 double GetTime()
 {
     if (!perfFreq)
@@ -470,6 +485,194 @@ void Thread::Sleep(int ms)
     ::Sleep(ms);
 }
 
+//----------------------------------------------------------------------------------------------
+
+struct ThreadPool::Priv
+{
+    struct Worker
+    {
+        Priv* Pool = nullptr;
+        GROUP_AFFINITY Affinity = {};
+        ThreadEvent Start;
+        Thread* Thr = nullptr;
+
+        void ThreadFunc(Thread& thread)
+        {
+            if (Affinity.Mask)
+                SetThreadGroupAffinity(GetCurrentThread(), &Affinity, nullptr);
+            InLoop = true;
+
+            for (;;)
+            {
+                Start.Wait();
+                if (!thread.IsRunning())
+                    break;
+                Pool->Work();
+                if (!AtomicDec(Pool->Busy))
+                    Pool->Done.Fire();
+            }
+        }
+    };
+
+    Array<Worker*> Workers;
+    GROUP_AFFINITY CallerAffinity = {};     // the core left free for the thread that starts a loop
+    ThreadLock Lock;        // one loop at a time
+    ThreadEvent Done;
+
+    // the current loop
+    const Func<void(uint, uint)>* Job = nullptr;
+    uint Size = 0;
+    uint Grain = 1;
+    uint Chunks = 0;
+    uint Next = 0;
+    uint Busy = 0;          // workers that haven't finished yet
+
+    static thread_local bool InLoop;
+
+    void Work()
+    {
+        for (;;)
+        {
+            uint chunk = AtomicInc(Next) - 1;
+            if (chunk >= Chunks)
+                break;
+            uint begin = chunk * Grain;
+            (*Job)(begin, Min(begin + Grain, Size));
+        }
+    }
+
+    // one entry per physical core (with all of its logical processors), the ones on our own NUMA node first
+    static void GetCores(Array<GROUP_AFFINITY>& cores)
+    {
+        DWORD len = 0;
+        GetLogicalProcessorInformationEx(RelationAll, nullptr, &len);
+        Array<uint8> buffer;
+        buffer.SetSize(len);
+        if (!len || !GetLogicalProcessorInformationEx(RelationAll, (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)buffer.Ptr(), &len))
+            return;
+
+        Array<GROUP_AFFINITY> found, nodes;
+        for (DWORD offset = 0; offset < len; )
+        {
+            auto info = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)(buffer.Ptr() + offset);
+            if (info->Relationship == RelationProcessorCore)
+                found += info->Processor.GroupMask[0];
+            else if (info->Relationship == RelationNumaNode)
+                nodes += info->NumaNode.GroupMask;
+            offset += info->Size;
+        }
+
+        auto nodeOf = [&](WORD group, KAFFINITY mask)
+        {
+            for (uint i = 0; i < nodes.Len(); i++)
+                if (nodes[i].Group == group && (nodes[i].Mask & mask))
+                    return (int)i;
+            return 0;
+        };
+
+        PROCESSOR_NUMBER self = {};
+        GetCurrentProcessorNumberEx(&self);
+        int ownNode = nodeOf(self.Group, (KAFFINITY)1 << self.Number);
+
+        for (int n = -1; n < Max((int)nodes.Len(), 1); n++)
+            for (auto& core : found)
+            {
+                int node = nodeOf(core.Group, core.Mask);
+                if (n < 0 ? node == ownNode : (node == n && node != ownNode))
+                    cores += core;
+            }
+    }
+};
+
+thread_local bool ThreadPool::Priv::InLoop = false;
+
+ThreadPool::ThreadPool(uint workers)
+{
+    P = new Priv;
+    Array<GROUP_AFFINITY> cores;
+    Priv::GetCores(cores);
+    if (workers == ~0u)
+        workers = Max((uint)cores.Len(), 1u) - 1;
+
+    // the first core is for whoever starts a loop (see ParallelFor()), so the workers start at the next one
+    if (cores.Len())
+        P->CallerAffinity = cores[0];
+    for (uint i = 0; i < workers; i++)
+    {
+        auto w = new Priv::Worker;
+        w->Pool = P;
+        if (i + 1 < cores.Len())
+            w->Affinity = cores[i + 1];
+        w->Thr = new Thread(Bind(w, &Priv::Worker::ThreadFunc));
+        P->Workers += w;
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    // the workers look at the stop flag after getting woken up
+    for (auto w : P->Workers)
+    {
+        w->Thr->Terminate();
+        w->Start.Fire();
+    }
+    for (auto w : P->Workers)
+    {
+        delete w->Thr;
+        delete w;
+    }
+    delete P;
+}
+
+uint ThreadPool::GetThreadCount() const
+{
+    return (uint)P->Workers.Len() + 1;
+}
+
+void ThreadPool::ParallelFor(uint size, uint grain, const Func<void(uint, uint)>& func, uint maxThreads)
+{
+    grain = Max(grain, 1u);
+    uint chunks = (uint)(((uint64)size + grain - 1) / grain);
+    uint workers = Min(Min((uint)P->Workers.Len(), Max(maxThreads, 1u) - 1), chunks ? chunks - 1 : 0);
+    if (!workers || Priv::InLoop)
+    {
+        for (uint chunk = 0; chunk < chunks; chunk++)
+            func(chunk * grain, Min(chunk * grain + grain, size));
+        return;
+    }
+
+    ScopeLock lock(P->Lock);
+    P->Job = &func;
+    P->Size = size;
+    P->Grain = grain;
+    P->Chunks = chunks;
+    P->Next = 0;
+    P->Busy = workers;
+    for (uint i = 0; i < workers; i++)
+        P->Workers[i]->Start.Fire();
+
+    // the calling thread could be on any core, including one of the workers', so
+    // it goes onto the one left free for it while it helps out
+    GROUP_AFFINITY oldAffinity = {};
+    bool moved = P->CallerAffinity.Mask && SetThreadGroupAffinity(GetCurrentThread(), &P->CallerAffinity, &oldAffinity);
+
+    Priv::InLoop = true;
+    P->Work();
+    Priv::InLoop = false;
+
+    if (moved)
+        SetThreadGroupAffinity(GetCurrentThread(), &oldAffinity, nullptr);
+
+    P->Done.Wait();
+    P->Job = nullptr;
+}
+
+ThreadPool& GetThreadPool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
 //----------------------------------------------------------------------------------------------
 //----------------------------------------------------------------------------------------------
 
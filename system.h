@@ -19,6 +19,7 @@ struct ScreenMode
 // -------------------------------------------------------------------------------
 
 int64 GetTicks(); // raw timer ticks
+int64 GetTicksPerSecond(); // raw timer frequency
 double GetTime(); // time since program start in seconds
 
 struct SystemTime {
@@ -160,6 +161,35 @@ private:
 
 // -------------------------------------------------------------------------------
 
+// Worker threads for splitting loops over many independent pieces of work (eg.
+// bands of lines of a frame) across cores. There's one worker per physical core,
+// except one that the calling thread moves to while it helps out. Workers stay on their
+// core, and the cores on the caller's NUMA node come first, so loops that use
+// fewer threads don't have to go across nodes.
+class ThreadPool
+{
+public:
+    ThreadPool(uint workers = ~0u); // ~0u: one per core, minus one
+    ~ThreadPool();
+
+    // how many threads a loop can run on at most, the calling one included
+    uint GetThreadCount() const;
+
+    // calls func(begin, end) for consecutive ranges of [0, size) that are grain long
+    // (the last one maybe less), on up to maxThreads threads. Returns when all are done.
+    // Loops started from within a loop just run on the calling thread.
+    void ParallelFor(uint size, uint grain, const Func<void(uint, uint)>& func, uint maxThreads = ~0u);
+
+private:
+    struct Priv;
+    Priv* P = nullptr;
+};
+
+// the one everybody shares
+ThreadPool& GetThreadPool();
+
+// -------------------------------------------------------------------------------
+
 // concurrent queue
 template <typename T, int SIZE> class Queue
 {
@@ -205,6 +235,102 @@ private:
     T Buffer[SIZE];
 };
 
+// -------------------------------------------------------------------------------
+
+// Value with one writer and any number of readers that never block the writer;
+// readers retry if a write happened while they were copying. T must be plain data.
+template <typename T> class SeqLocked
+{
+public:
+    void Write(const T& value)
+    {
+        AtomicStore(Seq, Seq + 1);
+        AtomicFence();
+        Value = value;
+        AtomicFence();
+        AtomicStore(Seq, Seq + 1);
+    }
+
+    T Read() const
+    {
+        T value;
+        uint64 seq;
+        do
+        {
+            while ((seq = AtomicLoad(Seq)) & 1) {}
+            AtomicFence();
+            value = Value;
+            AtomicFence();
+        } while (AtomicLoad(Seq) != seq);
+        return value;
+    }
+
+private:
+    uint64 Seq = 0;
+    T Value = {};
+};
+
+// -------------------------------------------------------------------------------
+
+// Fixed size history with one writer and any number of readers that fetch
+// everything since their last visit. Entries get overwritten after SIZE pushes;
+// readers that fall behind that far just miss them. T must be plain data.
+template <typename T, uint SIZE> class HistoryRing
+{
+public:
+    void Push(const T& value)
+    {
+        uint64 head = Head;
+        Items[head % SIZE] = value;
+        AtomicStore(Head, head + 1);
+    }
+
+    // forget everything pushed so far (as far as Read() is concerned), returns the new start cursor
+    uint64 Restart()
+    {
+        AtomicStore(Start, Head);
+        return Head;
+    }
+
+    uint64 GetStart() const { return AtomicLoad(Start); }
+    uint64 GetHead() const { return AtomicLoad(Head); }
+
+    // appends all entries from cursor on to into, returns the cursor for the next call
+    uint64 Read(uint64 cursor, Array<T>& into) const
+    {
+        uint64 head = AtomicLoad(Head);
+        if (cursor > head)
+            cursor = 0; // not one of ours
+        cursor = Max(cursor, AtomicLoad(Start));
+        if (head > SIZE)
+            cursor = Max(cursor, head - SIZE);
+
+        size_t base = into.Len();
+        into.SetSize(base + (size_t)(head - cursor));
+        for (uint64 i = cursor; i < head; i++)
+            into[base + (size_t)(i - cursor)] = Items[i % SIZE];
+
+        // drop whatever the writer overwrote while we were copying, including
+        // the slot it might be writing into right now (that of head2)
+        AtomicFence();
+        uint64 head2 = AtomicLoad(Head);
+        if (head2 + 1 > cursor + SIZE)
+        {
+            size_t lost = (size_t)Min(head2 + 1 - SIZE - cursor, head - cursor);
+            for (size_t i = base + lost; i < into.Len(); i++)
+                into[i - lost] = into[i];
+            into.SetSize(into.Len() - lost);
+        }
+
+        return head;
+    }
+
+private:
+    uint64 Head = 0;
+    uint64 Start = 0;
+    T Items[SIZE];
+};
+
 // -------------------------------------------------------------------------------
 // -------------------------------------------------------------------------------
 
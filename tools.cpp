@@ -0,0 +1,1051 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include "types.h"
+#include "system.h"
+#include "json.h"
+
+#include "screencapture.h"
+#include "framesource.h"
+#include "framepacer.h"
+#include "capturetrace.h"
+#include "refreshclock.h"
+#include "colormath.h"
+#include "colorconvert.h"
+#include "tools.h"
+
+//---------------------------------------------------------------------------
+// command line helpers
+//---------------------------------------------------------------------------
+
+class ToolArgs
+{
+    Array<String> Args;
+
+public:
+    explicit ToolArgs(const char* cmdLine)
+    {
+        const char* p = cmdLine ? cmdLine : "";
+        for (;;)
+        {
+            while (*p == ' ' || *p == '\t') p++;
+            if (!*p) break;
+
+            Array<char> arg;
+            bool quoted = false;
+            while (*p && (quoted || (*p != ' ' && *p != '\t')))
+            {
+                if (*p == '"')
+                    quoted = !quoted;
+                else
+                    arg += *p;
+                p++;
+            }
+            Args += String(ReadOnlySpan<char>(arg));
+        }
+    }
+
+    uint Count() const { return (uint)Args.Len(); }
+    const String& operator[](uint i) const { return Args[i]; }
+
+    static bool IsOption(const char* arg, const char* name) { return arg[0] == '-' && !_stricmp(arg + 1, name); }
+
+    bool Has(const char* name) const
+    {
+        for (auto& a : Args)
+            if (IsOption(a, name))
+                return true;
+        return false;
+    }
+
+    // value of "-name value", or the default
+    String Get(const char* name, const char* def = "") const
+    {
+        for (uint i = 0; i + 1 < Count(); i++)
+            if (IsOption(Args[i], name))
+                return Args[i + 1];
+        return def;
+    }
+
+    double GetNumber(const char* name, double def) const
+    {
+        String v = Get(name);
+        return v.Length() ? atof(v) : def;
+    }
+
+    // "60" or "60000/1001"
+    void GetRate(const char* name, uint& num, uint& den) const
+    {
+        String v = Get(name);
+        if (!v.Length()) return;
+        if (sscanf_s(v, "%u/%u", &num, &den) < 2)
+            den = 1;
+        if (!num || !den)
+            Fatal("invalid rate %s\n", (const char*)v);
+    }
+
+    // arguments that aren't options or their values; flags are the options that don't take a value
+    Array<String> GetFiles(ReadOnlySpan<const char*> flags = {}) const
+    {
+        Array<String> files;
+        for (uint i = 1; i < Count(); i++)
+        {
+            if (Args[i][0] != '-')
+                files += Args[i];
+            else
+            {
+                bool flag = false;
+                for (auto f : flags)
+                    flag |= IsOption(Args[i], f);
+                if (!flag)
+                    i++;
+            }
+        }
+        return files;
+    }
+
+    // "1920x1080"
+    void GetSize(const char* name, uint& x, uint& y) const
+    {
+        String v = Get(name);
+        if (v.Length() && (sscanf_s(v, "%ux%u", &x, &y) < 2 || !x || !y))
+            Fatal("invalid size %s\n", (const char*)v);
+    }
+
+    // pixel format of the synthetic frames
+    PixelFormat GetFormat(const char* name, const char* def) const
+    {
+        String v = Get(name, def);
+        if (!String::Compare(v, "bgra8", true)) return PixelFormat::BGRA8;
+        if (!String::Compare(v, "rgb10a2", true)) return PixelFormat::RGB10A2;
+        if (!String::Compare(v, "rgba16f", true)) return PixelFormat::RGBA16F;
+        Fatal("unknown format %s (bgra8, rgb10a2 or rgba16f)\n", (const char*)v);
+        return PixelFormat::BGRA8;
+    }
+};
+
+static bool LoadConfig(CaptureConfig& config)
+{
+    if (!FileExists("config.json"))
+        return false;
+
+    Array<String> errors;
+    String json = ReadFileUTF8("config.json");
+    if (json.Length() > 0 && !Json::Deserialize(json, config, errors))
+        Fatal(String("Could not read config.json: \n\n") + String::Join(errors, "\n"));
+    return true;
+}
+
+//---------------------------------------------------------------------------
+// bench-pipeline: push frames from a synthetic or file source through the
+// whole capture -> convert -> encode -> mux pipeline
+//---------------------------------------------------------------------------
+
+static const char* const BenchEncoders[] = { "auto", "nvenc", "libav", "null" };
+
+// config and source parameters from the options bench-pipeline and bench-duplicates share
+static void SetupBenchPipeline(const ToolArgs& args, CaptureConfig& config, FrameSourcePara& para)
+{
+    LoadConfig(config);
+    config.Directory = args.Get("out", ".");
+    config.NamePrefix = "bench";
+    config.RecordOnlyFullscreen = false;
+    config.BlinkScrollLock = false;
+    config.CaptureAudio = false;
+
+    args.GetSize("size", para.SizeX, para.SizeY);
+    args.GetRate("rate", para.RateNum, para.RateDen);
+    para.Realtime = !args.Has("fast");
+    para.SkipEvery = (uint)args.GetNumber("skip", 0);
+    para.Variations = (uint)args.GetNumber("variations", para.Variations);
+    para.MaxMemoryMB = (uint)args.GetNumber("maxmem", para.MaxMemoryMB);
+    para.DirtyRects = args.Has("dirty");
+
+    para.Format = args.GetFormat("format", "bgra8");
+
+    // encoder and output; the null ones leave only what the capture loop itself costs
+    String encoder = args.Get("encoder", BenchEncoders[(int)config.CodecCfg.UseEncoder]);
+    int encoderIndex = -1;
+    for (int i = 0; i < 4; i++)
+        if (!String::Compare(encoder, BenchEncoders[i], true))
+            encoderIndex = i;
+    if (encoderIndex < 0)
+        Fatal("unknown encoder %s (auto, nvenc, libav or null)\n", (const char*)encoder);
+    config.CodecCfg.UseEncoder = (VideoEncoder)encoderIndex;
+
+    auto& nullCfg = config.CodecCfg.NullCfg;
+    String packets = args.Get("packets", "constant");
+    if (!String::Compare(packets, "constant", true)) nullCfg.Pattern = NullPattern::Constant;
+    else if (!String::Compare(packets, "keyframes", true)) nullCfg.Pattern = NullPattern::Keyframes;
+    else
+    {
+        nullCfg.Pattern = NullPattern::Trace;
+        nullCfg.SizeTrace = packets;
+    }
+    nullCfg.PacketSize = (uint)args.GetNumber("packetsize", nullCfg.PacketSize);
+    nullCfg.KeyframeSize = (uint)args.GetNumber("keysize", nullCfg.KeyframeSize);
+    nullCfg.LatencyMs = (float)args.GetNumber("latency", nullCfg.LatencyMs);
+    config.NullOutput = args.Has("nullout");
+    config.MuxBufferMB = (uint)args.GetNumber("muxbuffer", config.MuxBufferMB);
+    config.WriteBufferMB = (uint)args.GetNumber("writebuffer", config.WriteBufferMB);
+    config.UnbufferedIO = args.Has("unbuffered");
+    config.PreallocateMB = (uint)args.GetNumber("prealloc", config.PreallocateMB);
+    config.VariableFrameRate = args.Has("vfr");
+    if (args.Has("duplicates"))
+        config.Duplicates = !String::Compare(args.Get("duplicates"), "repeat", true) ? DuplicateMode::Repeat : DuplicateMode::Encode;
+}
+
+static IFrameSource* CreateBenchSource(const ToolArgs& args, const FrameSourcePara& para)
+{
+    String sourceName = args.Get("source", "synthetic");
+    return !String::Compare(sourceName, "synthetic", true)
+        ? CreateFrameSourceSynthetic(para)
+        : CreateFrameSourceFile(sourceName, para);
+}
+
+static int BenchPipeline(const ToolArgs& args)
+{
+    CaptureConfig config;
+    FrameSourcePara para;
+    SetupBenchPipeline(args, config, para);
+    IFrameSource* source = CreateBenchSource(args, para);
+
+    double seconds = args.GetNumber("seconds", 10);
+
+    printf("bench-pipeline: %s, %s, %s, %.3f Hz, %s, %s encoder%s, %g seconds\n", (const char*)args.Get("source", "synthetic"), (const char*)args.Get("format", "bgra8"),
+        para.Realtime ? "realtime" : "as fast as possible", (double)para.RateNum / para.RateDen,
+        config.CodecCfg.Profile == CodecProfile::HEVC_LOSSLESS ? "lossless" : "lossy", BenchEncoders[(int)config.CodecCfg.UseEncoder],
+        config.NullOutput ? ", no output" : "", seconds);
+
+    IScreenCapture* capture = CreateScreenCapture(config, source);
+
+    double start = GetTime();
+    uint lastCaptured = 0;
+    while (GetTime() - start < seconds)
+    {
+        Thread::Sleep(1000);
+        const CaptureStats& stats = capture->GetStats();
+        printf("  %5.1fs: %6u frames (%6.1f/s), %5u duplicated, %8.0f kbit/s\n",
+            GetTime() - start, stats.FramesCaptured, (double)(stats.FramesCaptured - lastCaptured), stats.FramesDuplicated, stats.AvgBitrate);
+        lastCaptured = stats.FramesCaptured;
+    }
+
+    double elapsed = GetTime() - start;
+    const CaptureStats& stats = capture->GetStats();
+    uint captured = stats.FramesCaptured;
+    uint duplicated = stats.FramesDuplicated;
+    uint repeated = stats.FramesRepeated;
+    uint framesStatic = stats.FramesStatic;
+    uint framesDeduped = stats.FramesDeduped;
+    double tilesConverted = stats.TilesConverted;
+    double hashTime = stats.HashTime;
+    int sizeX = stats.SizeX, sizeY = stats.SizeY;
+    String filename = stats.Filename;
+    double bitrate = stats.AvgBitrate;
+    CaptureStats::Latency latencies[CaptureStats::STAGES];
+    memcpy(latencies, stats.Latencies, sizeof(latencies));
+    uint64 muxHighWater = stats.MuxHighWater, muxCapacity = stats.MuxCapacity;
+    uint muxDropped = stats.MuxDropped, muxStalls = stats.MuxStalls;
+    uint64 diskWritten = stats.DiskWritten;
+    double diskBusy = stats.DiskBusy, diskStall = stats.DiskStall;
+    delete capture;
+
+    double written = captured + duplicated;
+    printf("\n%dx%d, %s\n", sizeX, sizeY, (const char*)filename);
+    printf("captured:   %u frames, %.2f fps\n", captured, captured / elapsed);
+    printf("duplicated: %u frames (%.2f%%)\n", duplicated, written ? 100.0 * duplicated / written : 0.0);
+    if (repeated)
+        printf("encoded:    %u frames, %u duplicates just repeated\n", (uint)written - repeated, repeated);
+    if (framesStatic || (tilesConverted > 0 && tilesConverted < 1))
+        printf("dirty:      %u static frames not converted, %.1f%% of the screen converted per frame\n", framesStatic, 100.0 * tilesConverted);
+    if (hashTime > 0)
+        printf("dedupe:     %u frames the same as the last one, %.3f ms per frame hashing\n", framesDeduped, hashTime);
+    printf("throughput: %.1f Mpixel/s\n", (double)captured * sizeX * sizeY / (1000000.0 * elapsed));
+    printf("bitrate:    %.0f kbit/s average\n", bitrate);
+    printf("per frame:  %.1f us\n", written ? 1000000.0 * elapsed / written : 0.0);
+    if (muxCapacity)
+        printf("mux buffer: %.1f of %.0f MB used at most, %u stalls, %u packets dropped\n",
+            muxHighWater / 1048576.0, muxCapacity / 1048576.0, muxStalls, muxDropped);
+    if (diskWritten)
+        printf("disk:       %.0f MB, %.1f MB/s, %.1f MB/s while writing, %.2f s stalled\n",
+            diskWritten / 1048576.0, diskWritten / (1048576.0 * elapsed), diskBusy > 0 ? diskWritten / (1048576.0 * diskBusy) : 0.0, diskStall);
+
+    static const char* const stageNames[] = { "acquire", "convert", "submit", "encode", "mux", "total" };
+    printf("\nlatency (ms)  frames      p50      p99    p99.9      max\n");
+    for (int i = 0; i < CaptureStats::STAGES; i++)
+    {
+        auto& l = latencies[i];
+        printf("  %-8s %10llu %8.2f %8.2f %8.2f %8.2f\n", stageNames[i], l.Count, l.P50, l.P99, l.P999, l.Max);
+    }
+    return 0;
+}
+
+//---------------------------------------------------------------------------
+// bench-duplicates: run the pipeline on a source that leaves out presents, once
+// with the duplicates encoded again and once with the last frame repeated in
+// the file, and compare how much work the encoder got
+//---------------------------------------------------------------------------
+
+static int BenchDuplicates(const ToolArgs& args)
+{
+    double seconds = args.GetNumber("seconds", 10);
+    static const char* const modes[] = { "encode", "repeat" };
+
+    printf("bench-duplicates: %g seconds each\n\n", seconds);
+    printf("mode      in video   encoded  occupancy  encode p50/p99 (ms)   kbit/s\n");
+    for (int m = 0; m < 2; m++)
+    {
+        CaptureConfig config;
+        FrameSourcePara para;
+        SetupBenchPipeline(args, config, para);
+        if (!args.Has("skip"))
+            para.SkipEvery = 2;
+        config.Duplicates = (DuplicateMode)m;
+        config.VariableFrameRate = false;
+
+        IScreenCapture* capture = CreateScreenCapture(config, CreateBenchSource(args, para));
+        double start = GetTime();
+        Thread::Sleep((int)(1000 * seconds));
+        double elapsed = GetTime() - start;
+        const CaptureStats& stats = capture->GetStats();
+        uint written = stats.FramesCaptured + stats.FramesDuplicated;
+        uint encoded = written - stats.FramesRepeated;
+        auto encode = stats.Latencies[(int)CaptureStats::Stage::Encode];
+        double bitrate = stats.AvgBitrate;
+        delete capture;
+
+        // occupancy: how much of the encoder's time at the refresh rate went into this
+        double slots = elapsed * para.RateNum / para.RateDen;
+        printf("%-8s %9u %9u %9.1f%% %9.2f / %-8.2f %9.0f\n", modes[m], written, encoded, slots > 0 ? 100.0 * encoded / slots : 0.0,
+            encode.P50, encode.P99, bitrate);
+    }
+    return 0;
+}
+
+//---------------------------------------------------------------------------
+// replay-pacing: feed recorded present timestamps through the FramePacer and
+// see how many frames it duplicates and how far the output drifts from the
+// screen's refresh cadence
+//---------------------------------------------------------------------------
+
+struct PacingEvent
+{
+    double Time;        // seconds
+    uint64 FrameCount;  // refresh counter
+};
+
+// .trace files as written by the capture, or CSV with one "time,frameCount" line per present
+// (lines that don't start with a number are skipped). Traces bring their own refresh rate.
+static bool LoadPacingTrace(const char* filename, Array<PacingEvent>& events, uint& rateNum, uint& rateDen)
+{
+    CaptureTraceHeader header;
+    Array<CaptureTraceRecord> records;
+    if (ReadCaptureTrace(filename, header, records))
+    {
+        // the pacer gets to see the frames when they've been acquired
+        for (auto& rec : records)
+            events += PacingEvent{ (double)(rec.PresentTicks + rec.AcquireTicks) / (double)header.TicksPerSecond, rec.FrameCount };
+        rateNum = header.RateNum;
+        rateDen = header.RateDen;
+        return events.Len() > 0;
+    }
+
+    if (!FileExists(filename))
+        return false;
+
+    String text = ReadFileUTF8(filename);
+    for (const char* p = text; *p; )
+    {
+        char* end;
+        double time = strtod(p, &end);
+        if (end != p && *end == ',')
+        {
+            uint64 fc = _strtoui64(end + 1, &end, 10);
+            events += PacingEvent{ time, fc };
+        }
+        while (*p && *p != '\n') p++;
+        if (*p) p++;
+    }
+    return events.Len() > 0;
+}
+
+struct PacingResult
+{
+    FramePacer::Counters Counters;
+    int64 Drift;            // output frames minus refreshes covered
+    double CadenceErr;      // mean absolute difference between output and refresh position, in frames
+    int64 MaxCadenceErr;
+};
+
+static PacingResult ReplayPacing(const Array<PacingEvent>& events, uint rateNum, uint rateDen, double pollInterval)
+{
+    // like ScreenCapture: the first frame (re)initializes, and while waiting for the
+    // next one the pacer gets polled every time acquiring a frame times out
+    FramePacer pacer;
+    pacer.Reset(rateNum, rateDen, events[0].Time);
+
+    PacingResult res = {};
+    int64 output = 0;
+    uint64 firstCount = 0;
+    uint64 lastCount = 0;
+    double errSum = 0;
+    for (uint i = 1; i < events.Len(); i++)
+    {
+        auto& ev = events[i];
+        auto d = pacer.Frame(ev.Time, ev.FrameCount);
+        output += d.Duplicates;
+        if (d.First)
+            firstCount = ev.FrameCount;
+        if (d.Submit)
+        {
+            int64 err = output - (int64)(ev.FrameCount - firstCount);
+            errSum += (double)(err < 0 ? -err : err);
+            res.MaxCadenceErr = Max(res.MaxCadenceErr, err < 0 ? -err : err);
+            lastCount = ev.FrameCount;
+            output++;
+        }
+
+        double next = i + 1 < events.Len() ? events[i + 1].Time : ev.Time;
+        double t = ev.Time;
+        do
+        {
+            output += pacer.Idle(t);
+            t += pollInterval;
+        } while (t < next);
+    }
+
+    res.Counters = pacer.GetCounters();
+    res.Drift = output - (int64)(lastCount - firstCount + 1);
+    res.CadenceErr = res.Counters.Submitted ? errSum / res.Counters.Submitted : 0;
+    return res;
+}
+
+static int ReplayPacingTool(const ToolArgs& args)
+{
+    uint rateNum = 60, rateDen = 1;
+    args.GetRate("rate", rateNum, rateDen);
+    double poll = args.GetNumber("poll", 2) / 1000.0;
+
+    auto files = args.GetFiles();
+    if (!files.Len())
+    {
+        printf("replay-pacing: no trace files given\n");
+        return 1;
+    }
+
+    printf("%-40s %8s %8s %8s %8s %8s %8s %8s\n", "trace", "frames", "submit", "dup", "undone", "drift", "err", "maxerr");
+
+    PacingResult total = {};
+    double errSum = 0;
+    uint errors = 0;
+    for (auto& file : files)
+    {
+        Array<PacingEvent> events;
+        uint fileRateNum = rateNum, fileRateDen = rateDen;
+        if (!LoadPacingTrace(file, events, fileRateNum, fileRateDen))
+        {
+            printf("%-40s could not read\n", (const char*)file);
+            errors++;
+            continue;
+        }
+        if (args.Has("rate"))
+        {
+            fileRateNum = rateNum;
+            fileRateDen = rateDen;
+        }
+
+        auto res = ReplayPacing(events, fileRateNum, fileRateDen, poll);
+        auto& c = res.Counters;
+        printf("%-40s %8llu %8llu %8llu %8llu %8lld %8.3f %8lld\n", (const char*)file,
+            c.Frames, c.Submitted, c.Duplicated, c.Corrected, res.Drift, res.CadenceErr, res.MaxCadenceErr);
+
+        total.Counters.Frames += c.Frames;
+        total.Counters.Submitted += c.Submitted;
+        total.Counters.Duplicated += c.Duplicated;
+        total.Counters.Corrected += c.Corrected;
+        total.Drift += res.Drift < 0 ? -res.Drift : res.Drift;
+        total.MaxCadenceErr = Max(total.MaxCadenceErr, res.MaxCadenceErr);
+        errSum += res.CadenceErr * c.Submitted;
+    }
+
+    if (files.Len() > 1)
+    {
+        auto& c = total.Counters;
+        printf("%-40s %8llu %8llu %8llu %8llu %8lld %8.3f %8lld\n", "total (drift: absolute sum)",
+            c.Frames, c.Submitted, c.Duplicated, c.Corrected, total.Drift, c.Submitted ? errSum / c.Submitted : 0, total.MaxCadenceErr);
+    }
+
+    return errors ? 1 : 0;
+}
+
+//---------------------------------------------------------------------------
+// trace2csv: convert .trace files from the capture into CSV
+//---------------------------------------------------------------------------
+
+static int TraceToCSV(const ToolArgs& args)
+{
+    auto files = args.GetFiles();
+    if (!files.Len())
+    {
+        printf("trace2csv: no trace files given\n");
+        return 1;
+    }
+
+    uint errors = 0;
+    for (auto& file : files)
+    {
+        CaptureTraceHeader header;
+        Array<CaptureTraceRecord> records;
+        if (!ReadCaptureTrace(file, header, records) || !records.Len())
+        {
+            printf("%s: not a capture trace\n", (const char*)file);
+            errors++;
+            continue;
+        }
+
+        // times in seconds since the first present; "time" is when the frame was acquired
+        double tps = (double)header.TicksPerSecond;
+        int64 start = records[0].PresentTicks;
+
+        StringBuilder sb;
+        sb += String::PrintF("# %ux%u, %u/%u Hz\n", header.SizeX, header.SizeY, header.RateNum, header.RateDen);
+        sb += "time,frameCount,present,latency_ms,comp,dups,idle_dups,submitted,first\n";
+        for (auto& rec : records)
+        {
+            sb += String::PrintF("%.6f,%llu,%.6f,%.3f,%d,%u,%u,%d,%d\n",
+                (double)(rec.PresentTicks + rec.AcquireTicks - start) / tps,
+                rec.FrameCount,
+                (double)(rec.PresentTicks - start) / tps,
+                1000.0 * rec.AcquireTicks / tps,
+                rec.Compensation, rec.Duplicates, rec.IdleDuplicates,
+                (rec.Flags & CaptureTraceRecord::SUBMITTED) ? 1 : 0,
+                (rec.Flags & CaptureTraceRecord::FIRST) ? 1 : 0);
+        }
+
+        String out = file + ".csv";
+        WriteFileUTF8(sb.ToString(), out);
+        printf("%s: %u frames -> %s\n", (const char*)file, (uint)records.Len(), (const char*)out);
+    }
+
+    return errors ? 1 : 0;
+}
+
+//---------------------------------------------------------------------------
+// bench-refreshclock: run synthetic present timestamp streams (with a refresh
+// rate that's off from the reported one, jitter and missed presents) through
+// RefreshClock and the old rounding heuristic, and compare the refresh indices
+// with the truth
+//---------------------------------------------------------------------------
+
+// what CaptureFrame() did before RefreshClock
+struct LegacyRefreshCounter
+{
+    double Rate = 0;
+    double TotalError = 0;
+    double Count = 0;
+    double LastT = -1;
+
+    uint64 Update(double t)
+    {
+        if (LastT >= 0)
+        {
+            double fdelta = (t - LastT) * Rate;
+            double fdi = round(fdelta);
+            TotalError += fdelta - fdi;
+            int comp = 0;
+            if (TotalError >= 0.75) { comp = 1; TotalError -= 1; }
+            if (TotalError <= -0.75) { comp = -1; TotalError += 1; }
+            Count += fdi + comp;
+        }
+        LastT = t;
+        return (uint64)round(Count);
+    }
+};
+
+struct RefreshScenario
+{
+    double Nominal;     // reported refresh rate
+    double Real;        // actual refresh rate
+    double JitterMs;    // +- uniform
+    double MissPct;     // % of refreshes without a present
+};
+
+struct RefreshResult
+{
+    uint64 Presents;
+    uint64 WrongSteps;  // index step between two presents differs from the truth
+    int64 MaxOffset;    // largest deviation of the index from the truth
+    int64 EndOffset;
+};
+
+static RefreshResult RunRefreshScenario(const RefreshScenario& sc, double seconds, uint64 seed, bool legacy, double* period = nullptr)
+{
+    RefreshClock clock;
+    clock.Reset(1.0 / sc.Nominal);
+    LegacyRefreshCounter old;
+    old.Rate = sc.Nominal;
+
+    uint64 rnd = seed | 1;
+    auto random = [&]() { rnd ^= rnd << 13; rnd ^= rnd >> 7; rnd ^= rnd << 17; return (double)(rnd >> 11) / (double)(1ull << 53); };
+
+    RefreshResult res = {};
+    bool first = true;
+    uint64 firstTrue = 0, firstIdx = 0, lastTrue = 0, lastIdx = 0;
+    uint64 refreshes = (uint64)(seconds * sc.Real);
+    for (uint64 i = 0; i < refreshes; i++)
+    {
+        if (random() * 100 < sc.MissPct)
+            continue;
+
+        // a nice odd start time so we don't get exact doubles
+        double t = 1234.5678 + (double)i / sc.Real + (2 * random() - 1) * sc.JitterMs / 1000;
+        uint64 idx = legacy ? old.Update(t) : clock.Update(t);
+        res.Presents++;
+
+        if (first)
+        {
+            firstTrue = i;
+            firstIdx = idx;
+            first = false;
+        }
+        else if (idx - lastIdx != i - lastTrue)
+            res.WrongSteps++;
+
+        int64 offset = (int64)(idx - firstIdx) - (int64)(i - firstTrue);
+        res.MaxOffset = Max(res.MaxOffset, offset < 0 ? -offset : offset);
+        res.EndOffset = offset;
+        lastTrue = i;
+        lastIdx = idx;
+    }
+
+    if (period)
+        *period = clock.GetPeriod();
+    return res;
+}
+
+static int BenchRefreshClock(const ToolArgs& args)
+{
+    static const RefreshScenario defaults[] =
+    {
+        { 60, 60, 0.1, 0 },
+        { 60, 59.94, 0.1, 0 },
+        { 60, 59.94, 1, 20 },
+        { 144, 143.86, 0.3, 20 },
+        { 144, 144.5, 0.5, 50 },
+        { 120, 119.2, 1, 10 },
+        { 60, 61, 3, 30 },
+        { 60, 59, 3, 30 },
+        { 240, 239.76, 0.2, 60 },
+    };
+
+    Array<RefreshScenario> scenarios;
+    if (args.Has("real"))
+    {
+        RefreshScenario sc =
+        {
+            .Nominal = args.GetNumber("rate", 60),
+            .Real = args.GetNumber("real", 60),
+            .JitterMs = args.GetNumber("jitter", 0.5),
+            .MissPct = args.GetNumber("miss", 20),
+        };
+        scenarios += sc;
+    }
+    else
+        scenarios += ReadOnlySpan<RefreshScenario>(defaults);
+
+    double seconds = args.GetNumber("seconds", 600);
+    uint64 seed = (uint64)args.GetNumber("seed", 1);
+
+    printf("%8s %8s %7s %5s | %8s %8s %8s %12s | %8s %8s %8s\n", "nominal", "real", "jitter", "miss",
+        "wrong", "maxoff", "endoff", "period err", "legacy", "maxoff", "endoff");
+
+    uint failed = 0;
+    for (auto& sc : scenarios)
+    {
+        double period;
+        auto res = RunRefreshScenario(sc, seconds, seed, false, &period);
+        auto old = RunRefreshScenario(sc, seconds, seed, true);
+
+        // being a refresh off now and then is fine when the presents jitter, drifting away isn't
+        bool ok = res.MaxOffset <= 1;
+        failed += ok ? 0 : 1;
+
+        printf("%8.3f %8.3f %5.2fms %4.0f%% | %8llu %8lld %8lld %9.1fppm | %8llu %8lld %8lld %s\n",
+            sc.Nominal, sc.Real, sc.JitterMs, sc.MissPct,
+            res.WrongSteps, res.MaxOffset, res.EndOffset, 1e6 * (period * sc.Real - 1),
+            old.WrongSteps, old.MaxOffset, old.EndOffset, ok ? "" : " FAILED");
+    }
+
+    return failed ? 1 : 0;
+}
+
+//---------------------------------------------------------------------------
+// CPU color conversion
+//---------------------------------------------------------------------------
+
+static const char* const ConvertFormatNames[] = { "bgra8", "nv12", "yuv444_8", "yuv420_16", "yuv444_16" };
+static const IEncode::BufferFormat ConvertFormats[] =
+{
+    IEncode::BufferFormat::BGRA8, IEncode::BufferFormat::NV12, IEncode::BufferFormat::YUV444_8,
+    IEncode::BufferFormat::YUV420_16, IEncode::BufferFormat::YUV444_16,
+};
+
+// largest difference between two converted frames
+static int MaxConvertDiff(const Array<uint8>& a, const Array<uint8>& b, bool wide)
+{
+    int maxDiff = 0;
+    size_t n = wide ? a.Len() / 2 : a.Len();
+    for (size_t i = 0; i < n; i++)
+    {
+        int va = wide ? ((const uint16*)a.Ptr())[i] : a[i];
+        int vb = wide ? ((const uint16*)b.Ptr())[i] : b[i];
+        maxDiff = Max(maxDiff, abs(va - vb));
+    }
+    return maxDiff;
+}
+
+// seconds per call of func, called for at least the given time
+static double TimeConvert(double seconds, const Func<void()>& func)
+{
+    uint frames = 0;
+    double start = GetTime(), elapsed;
+    do
+    {
+        func();
+        frames++;
+    } while ((elapsed = GetTime() - start) < seconds);
+    return elapsed / frames;
+}
+
+// runs every output format through every conversion path this CPU has, and
+// on the best one with 1 to all threads of the pool. Checks that everything
+// comes out like the scalar single threaded version.
+static int BenchConvert(const ToolArgs& args)
+{
+    FrameSourcePara para;
+    args.GetSize("size", para.SizeX, para.SizeY);
+    para.Format = args.GetFormat("format", "bgra8");
+    para.Realtime = false;
+    para.Variations = 1;
+    uint upscale = Max((uint)args.GetNumber("upscale", 1), 1u);
+    double seconds = args.GetNumber("seconds", 1);
+    uint maxThreads = Clamp((uint)args.GetNumber("threads", GetThreadPool().GetThreadCount()), 1u, GetThreadPool().GetThreadCount());
+
+    IFrameSource* source = CreateFrameSourceSynthetic(para);
+    CaptureInfo info;
+    while (!source->AcquireFrame(100, info)) {}
+    Array<uint8> frame;
+    frame += info.data;
+    uint srcPitch = info.pitch;
+    bool isHdr = info.isHdr;
+    source->ReleaseFrame();
+    delete source;
+
+    uint sizeX = para.SizeX * upscale, sizeY = para.SizeY * upscale;
+    ConvertPath best = GetBestConvertPath();
+    printf("bench-convert: %ux%u %s%s, %s is the best this CPU can do, %u threads\n\n", sizeX, sizeY, (const char*)args.Get("format", "bgra8"),
+        upscale > 1 ? (const char*)String::PrintF(", upscaled %ux", upscale) : "", GetConvertPathName(best), maxThreads);
+
+    printf("%-10s %-6s %7s %10s %10s %8s %8s\n", "output", "path", "threads", "ms/frame", "GB/s", "speedup", "maxdiff");
+
+    uint failed = 0;
+    for (int f = 0; f < 5; f++)
+    {
+        ConvertPara cp = MakeConvertPara(para.Format, sizeX, sizeY, upscale, ConvertFormats[f], isHdr);
+        auto fi = GetFormatInfo(ConvertFormats[f], sizeX, sizeY);
+        size_t outSize = (size_t)fi.pitch * fi.lines;
+        bool wide = ConvertFormats[f] == IEncode::BufferFormat::YUV420_16 || ConvertFormats[f] == IEncode::BufferFormat::YUV444_16;
+
+        Array<uint8> reference, out;
+        reference.SetSize(outSize);
+        out.SetSize(outSize);
+
+        // bytes read and written, and the speedup is against scalar on one thread
+        double bytes = (double)srcPitch * para.SizeY + outSize;
+        double single = 0;
+
+        auto report = [&](ConvertPath path, uint threads, double time, bool check)
+        {
+            int maxDiff = check ? MaxConvertDiff(out, reference, wide) : 0;
+            bool ok = maxDiff <= 1;
+            failed += ok ? 0 : 1;
+            printf("%-10s %-6s %7u %10.3f %10.2f %7.2fx %8d%s\n", ConvertFormatNames[f], GetConvertPathName(path), threads,
+                1000.0 * time, bytes / (1e9 * time), single / time, maxDiff, ok ? "" : " FAILED");
+        };
+
+        for (int p = 0; p <= (int)best; p++)
+        {
+            CpuColorConvert convert(cp, (ConvertPath)p);
+            Array<uint8>& dest = p ? out : reference;
+            double time = TimeConvert(seconds, [&]() { convert.Convert(frame.Ptr(), srcPitch, dest.Ptr()); });
+            if (!p)
+                single = time;
+            report((ConvertPath)p, 1, time, p > 0);
+        }
+
+        CpuColorConvert convert(cp, best);
+        for (uint threads = 2; threads <= maxThreads; threads = threads < maxThreads ? Min(2 * threads, maxThreads) : threads + 1)
+        {
+            memset(out.Ptr(), 0, outSize);
+            double time = TimeConvert(seconds, [&]() { convert.ConvertParallel(frame.Ptr(), srcPitch, out.Ptr(), threads); });
+            report(best, threads, time, true);
+        }
+    }
+
+    return failed ? 1 : 0;
+}
+
+// Converts to the same output size from smaller and smaller sources with upscaling,
+// on one thread with the best path. Each source line only gets converted once and
+// the rest are copies, so the time should go down with the source size. Checks
+// against converting a source that's been upscaled beforehand.
+static int BenchUpscale(const ToolArgs& args)
+{
+    uint outX = 3840, outY = 2160;
+    args.GetSize("size", outX, outY);
+    PixelFormat format = args.GetFormat("format", "bgra8");
+    const char* outName = args.Get("output", "nv12");
+    uint maxUpscale = Max((uint)args.GetNumber("upscale", 6), 1u);
+    double seconds = args.GetNumber("seconds", 1);
+
+    int f = 0;
+    while (f < 5 && _stricmp(outName, ConvertFormatNames[f]))
+        f++;
+    if (f == 5)
+    {
+        printf("unknown output format %s\n", outName);
+        return 1;
+    }
+    IEncode::BufferFormat outFormat = ConvertFormats[f];
+    bool wide = outFormat == IEncode::BufferFormat::YUV420_16 || outFormat == IEncode::BufferFormat::YUV444_16;
+    uint pixelBytes = format == PixelFormat::RGBA16 || format == PixelFormat::RGBA16F ? 8 : 4;
+    ConvertPath path = GetBestConvertPath();
+
+    printf("bench-upscale: %ux%u %s to %s, %s, one thread\n\n", outX, outY, (const char*)args.Get("format", "bgra8"), outName, GetConvertPathName(path));
+    printf("%7s %11s %10s %10s %12s %8s\n", "upscale", "source", "ms/frame", "vs 1x", "ns/src px", "maxdiff");
+
+    uint failed = 0;
+    double base = 0;
+    for (uint up = 1; up <= maxUpscale; up++)
+    {
+        FrameSourcePara para;
+        para.SizeX = outX / up;
+        para.SizeY = outY / up;
+        para.Format = format;
+        para.Realtime = false;
+        para.Variations = 1;
+        if (!para.SizeX || !para.SizeY)
+            break;
+
+        IFrameSource* source = CreateFrameSourceSynthetic(para);
+        CaptureInfo info;
+        while (!source->AcquireFrame(100, info)) {}
+        Array<uint8> frame;
+        frame += info.data;
+        uint srcPitch = info.pitch;
+        bool isHdr = info.isHdr;
+        source->ReleaseFrame();
+        delete source;
+
+        uint sizeX = para.SizeX * up, sizeY = para.SizeY * up;
+        auto fi = GetFormatInfo(outFormat, sizeX, sizeY);
+        Array<uint8> out, reference;
+        out.SetSize((size_t)fi.pitch * fi.lines);
+        reference.SetSize((size_t)fi.pitch * fi.lines);
+
+        CpuColorConvert convert(MakeConvertPara(format, sizeX, sizeY, up, outFormat, isHdr), path);
+        double time = TimeConvert(seconds, [&]() { convert.Convert(frame.Ptr(), srcPitch, out.Ptr()); });
+        if (up == 1)
+            base = time;
+
+        // the same source with every pixel up x up times, converted without upscaling
+        Array<uint8> big;
+        big.SetSize((size_t)sizeX * pixelBytes * sizeY);
+        for (uint y = 0; y < sizeY; y++)
+            for (uint x = 0; x < sizeX; x++)
+                memcpy(big.Ptr() + ((size_t)y * sizeX + x) * pixelBytes, frame.Ptr() + (size_t)(y / up) * srcPitch + (x / up) * pixelBytes, pixelBytes);
+        CpuColorConvert(MakeConvertPara(format, sizeX, sizeY, 1, outFormat, isHdr), path).Convert(big.Ptr(), sizeX * pixelBytes, reference.Ptr());
+
+        int maxDiff = MaxConvertDiff(out, reference, wide);
+        bool ok = maxDiff == 0;
+        failed += ok ? 0 : 1;
+        printf("%6ux %5ux%-5u %10.3f %9.1f%% %12.2f %8d%s\n", up, para.SizeX, para.SizeY, 1000.0 * time, 100.0 * time / base,
+            1e9 * time / ((double)para.SizeX * para.SizeY), maxDiff, ok ? "" : " FAILED");
+    }
+
+    return failed ? 1 : 0;
+}
+
+// checks ST2084Approx on every path against the exact curve in double precision,
+// for every float from 0 to 1 (or every -step'th) plus some above, then times it
+static int BenchPQ(const ToolArgs& args)
+{
+    uint step = Max((uint)args.GetNumber("step", 1), 1u);
+    double seconds = args.GetNumber("seconds", 1);
+    ConvertPath best = GetBestConvertPath();
+    const int paths = (int)best + 1;
+
+    // bit patterns of positive floats up to 2^24, which covers everything up to 1 and then some
+    const uint last = 0x4b800000;
+    const uint count = last / step + 1;
+    const uint grain = 1 << 16;
+
+    struct Result
+    {
+        double MaxError[3 + 1];     // per path, and the exact float version last
+        float At[3 + 1];
+    };
+    Array<Result> results;
+    results.SetSize((count + grain - 1) / grain);
+    memset(results.Ptr(), 0, results.Len() * sizeof(Result));
+
+    printf("bench-pq: %u values, %u threads\n\n", count, GetThreadPool().GetThreadCount());
+
+    double start = GetTime();
+    GetThreadPool().ParallelFor(count, grain, [&](uint begin, uint end)
+    {
+        Result& res = results[begin / grain];
+        uint n = end - begin;
+        Array<float> in, out;
+        Array<double> exact;
+        in.SetSize(n);
+        out.SetSize(n);
+        exact.SetSize(n);
+        for (uint i = 0; i < n; i++)
+        {
+            uint bits = (begin + i) * step;
+            memcpy(&in[i], &bits, 4);
+            exact[i] = LinToST2084((double)in[i]);
+        }
+
+        for (int p = 0; p <= paths; p++)
+        {
+            memcpy(out.Ptr(), in.Ptr(), n * sizeof(float));
+            EncodeST2084(out.Ptr(), n, p < paths, p < paths ? (ConvertPath)p : ConvertPath::Scalar);
+            for (uint i = 0; i < n; i++)
+            {
+                double err = fabs(out[i] - exact[i]);
+                if (err > res.MaxError[p])
+                {
+                    res.MaxError[p] = err;
+                    res.At[p] = in[i];
+                }
+            }
+        }
+    });
+    double checkTime = GetTime() - start;
+
+    // timing on a buffer that fits in L1, so it's about the arithmetic
+    Array<float> values, work;
+    values.SetSize(4096);
+    work.SetSize(values.Len());
+    for (uint i = 0; i < values.Len(); i++)
+        values[i] = powf((float)i / values.Len(), 4);
+
+    printf("%-7s %12s %10s %14s %10s\n", "path", "max error", "10 bit", "at", "Mvalues/s");
+
+    uint failed = 0;
+    for (int p = 0; p <= paths; p++)
+    {
+        Result total = {};
+        for (auto& r : results)
+            if (r.MaxError[p] > total.MaxError[p])
+            {
+                total.MaxError[p] = r.MaxError[p];
+                total.At[p] = r.At[p];
+            }
+
+        double time = TimeConvert(seconds, [&]()
+        {
+            memcpy(work.Ptr(), values.Ptr(), work.Len() * sizeof(float));
+            EncodeST2084(work.Ptr(), work.Len(), p < paths, p < paths ? (ConvertPath)p : ConvertPath::Scalar);
+        });
+
+        // below one 10 bit code value, or it shows
+        double codes = total.MaxError[p] * 1023;
+        bool ok = codes < 1;
+        failed += ok ? 0 : 1;
+        printf("%-7s %12.3g %10.4f %14.6g %10.1f%s\n", p < paths ? GetConvertPathName((ConvertPath)p) : "exact",
+            total.MaxError[p], codes, total.At[p], work.Len() / (1e6 * time), ok ? "" : " FAILED");
+    }
+
+    printf("\nchecked in %.1f seconds\n", checkTime);
+    return failed ? 1 : 0;
+}
+
+//---------------------------------------------------------------------------
+
+struct Tool
+{
+    const char* Name;
+    int (*Run)(const ToolArgs&);
+    const char* Usage;
+};
+
+static const Tool Tools[] =
+{
+    { "bench-pipeline", BenchPipeline,
+        "[-source synthetic|<file.y4m>|<file.raw>] [-size 1920x1080] [-rate 60|60000/1001] [-format bgra8|rgb10a2|rgba16f]\n"
+        "    [-seconds 10] [-fast] [-skip n] [-variations n] [-maxmem MB] [-dirty] [-out dir] [-encoder auto|nvenc|libav|null]\n"
+        "    [-packets constant|keyframes|<sizes.txt>] [-packetsize bytes] [-keysize bytes] [-latency ms] [-nullout]\n"
+        "    [-muxbuffer MB] [-writebuffer MB] [-unbuffered] [-prealloc MB] [-vfr] [-duplicates encode|repeat]" },
+    { "bench-duplicates", BenchDuplicates,
+        "[-skip 2] [-seconds 10] and the other bench-pipeline options" },
+    { "replay-pacing", ReplayPacingTool,
+        "[-rate 60|60000/1001] [-poll ms] capture.trace|trace.csv [more traces...]" },
+    { "trace2csv", TraceToCSV,
+        "capture.trace [more traces...]" },
+    { "bench-refreshclock", BenchRefreshClock,
+        "[-rate 60 -real 59.94 [-jitter ms] [-miss %]] [-seconds 600] [-seed n]" },
+    { "bench-convert", BenchConvert,
+        "[-size 1920x1080] [-format bgra8|rgb10a2|rgba16f] [-upscale n] [-threads n] [-seconds 1]" },
+    { "bench-upscale", BenchUpscale,
+        "[-size 3840x2160] [-format bgra8|rgb10a2|rgba16f] [-output nv12|bgra8|yuv444_8|yuv420_16|yuv444_16] [-upscale 6] [-seconds 1]" },
+    { "bench-pq", BenchPQ,
+        "[-step n] [-seconds 1]" },
+};
+
+bool RunTool(const char* cmdLine, int& exitCode)
+{
+    ToolArgs args(cmdLine);
+    if (!args.Count())
+        return false;
+
+    const Tool* tool = nullptr;
+    for (auto& t : Tools)
+        if (!String::Compare(args[0], t.Name, true))
+            tool = &t;
+
+    bool help = !String::Compare(args[0], "help", true) || !String::Compare(args[0], "-help", true) || !String::Compare(args[0], "/?");
+    if (!tool && !help)
+        return false;
+
+    // we're a GUI app, so borrow the console of whoever started us (or get our own)
+    if (!AttachConsole(ATTACH_PARENT_PROCESS))
+        AllocConsole();
+    FILE* f;
+    freopen_s(&f, "CONOUT$", "w", stdout);
+    freopen_s(&f, "CONOUT$", "w", stderr);
+
+    if (tool)
+        exitCode = tool->Run(args);
+    else
+    {
+        printf("\ntools:\n");
+        for (auto& t : Tools)
+            printf("  %s %s\n", t.Name, t.Usage);
+        exitCode = 0;
+    }
+
+    fflush(stdout);
+    return true;
+}
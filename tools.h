@@ -0,0 +1,12 @@
+//
+// Copyright (C) Tammo Hinrichs 2021. All rights reserved.
+// Licensed under the MIT License. See LICENSE.md file for full license information
+//
+
+#pragma once
+
+#include "types.h"
+
+// Command line tools for benchmarking and analysis, eg. "Capturinha.exe bench-pipeline -size 3840x2160"
+// Returns false if the command line doesn't name a tool, otherwise runs it on the console.
+bool RunTool(const char* cmdLine, int& exitCode);
@@ -427,6 +427,12 @@ public:
 
 uint AtomicInc(uint& x);
 uint AtomicDec(uint& x);
+uint AtomicAdd(uint& x, uint add);
+uint AtomicLoad(const uint& x);         // acquire
+void AtomicStore(uint& x, uint v);      // release
+uint64 AtomicLoad(const uint64& x);     // acquire
+void AtomicStore(uint64& x, uint64 v);  // release
+void AtomicFence();                     // full memory barrier
 
 // COM and reference counting
 //----------------------------------------------------------------------------------------------